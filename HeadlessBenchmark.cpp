@@ -0,0 +1,1110 @@
+// HeadlessBenchmark.cpp
+// Headless benchmark driver for the QuadSortManager, no window, Vulkan, GLFW, ImGui or Win32 needed.
+// Particles are placed with seeded distributions, or replayed from a trace, and advanced on the CPU with the
+// same wrap-around rules as vulkan_compute_particles.comp. Each mode sweeps its settings and writes a CSV
+// to stdout or --out, exiting with 1 if any of its checks failed.
+//
+// Build on Linux with:
+//   g++ -std=c++17 -O2 -DQUADSORT_HEADLESS HeadlessBenchmark.cpp compute/pthread/QuadSortManager.cpp
+//       compute/pthread/QuadTree.cpp compute/pthread/ThreadPool.cpp compute/pthread/MortonSort.cpp
+//       compute/pthread/UniformGrid.cpp compute/pthread/ThreadAffinity.cpp compute/pthread/TreeSnapshot.cpp
+//       compute/pthread/Scenario.cpp compute/pthread/ParkedWorkerGroup.cpp -lpthread -o QuadSortBenchmark
+//
+// Options (lists are comma separated):
+//   --counts 256,65536     Particle counts to sort
+//   --capacities 4,16      Quad capacities to build the tree with
+//   --threads 1,2,4        Thread counts for the approaches that use them
+//   --approaches all       Approach names or "all", see GetThreadingApproachName
+//   --incremental 0,1      Run with full rebuilds (0) and/or incremental tree updates (1)
+//   --frames 30            Timed frames per configuration
+//   --warmup 3             Untimed frames before timing starts
+//   --seed 1               Seed used to place the particles
+//   --distributions all    How to place the particles, distribution names or "all", see GetParticleDistributionName
+//   --trace run.qtrace     Trace to replay, or to write with --mode record
+//   --out results.csv      Write the CSV to a file instead of stdout
+//   --mode sort            What to run:
+//                            sort        Times every approach's sort, checking the last tree holds every particle once, in a leaf containing it
+//                            collisions  Times the broad phase pair search on every approach's tree, checking the pairs against
+//                                        a brute force O(N^2) search for particle counts up to --brute-limit
+//                            stress      Runs the thread pool through rounds of nested jobs, checking every job runs once and that
+//                                        stopping mid-round can't hang. Build with -fsanitize=thread to check for data races,
+//                                        see RunPoolStress for what that does and doesn't cover
+//                            sharing     Times threads writing one shared counter, counters packed in a cache line and counters a
+//                                        line apart, then the pool running empty jobs. Try --affinity scatter on two sockets
+//                            snapshot    Times sort plus a snapshot with no writer, on the sorting thread and on the writer thread,
+//                                        checking queries on the last snapshot match the tree
+//                            record      Records the first distribution and particle count to --trace, for the other modes to replay
+//   --brute-limit 32768    Largest particle count to run the brute force collision search for
+//   --pool-cutoff 0        Particle count below which ThreadPool jobs break quads themselves, 0 works it out
+//   --autotune 1           Also run with autotuning on for every thread count with full rebuilds, reported as AutoTune(<approach picked>)
+//   --affinity compact     Pin sort workers with "none", "compact", "scatter" or a list of CPUs to use in order
+//   --snapshot-path f      File the snapshot mode writes to, the last snapshot is left there
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Timer.h"
+
+// Include the quad sort manager to handle quad sorting implementations
+#include "compute/pthread/QuadSortManager.h"
+
+// Include the scenarios the particles are placed and moved with
+#include "compute/pthread/Scenario.h"
+
+// World and particle setup, matching Main.cpp
+static constexpr float PARTICLE_RADIUS = 1.f;
+static constexpr float PARTICLE_X_VEL = -18.f;
+static constexpr float PARTICLE_Y_VEL = -25.f;
+
+static constexpr int WORLD_RIGHT = 1920;
+static constexpr int WORLD_LEFT = 0;
+static constexpr int WORLD_TOP = 0;
+static constexpr int WORLD_BOTTOM = 1080;
+
+// Fixed time step so every run moves the particles the same distance per frame
+static constexpr float FRAME_DELTA_TIME = 1.f / 60.f;
+
+static const ThreadingApproach ALL_APPROACHES[] =
+{
+    ThreadingApproach::NoThreading,
+    ThreadingApproach::QueueThreading,
+    ThreadingApproach::FlatFourThreading,
+    ThreadingApproach::StaticPartition,
+    ThreadingApproach::ThreadPool,
+    ThreadingApproach::MortonRadixSort,
+    ThreadingApproach::UniformGrid
+};
+
+struct BenchmarkSettings
+{
+    std::vector<size_t> ParticleCounts = { 256, 4096, 65536, 1048576, 10000000 };
+    std::vector<size_t> QuadCapacities = { 4, 16, 64 };
+    std::vector<unsigned> ThreadCounts;
+    std::vector<ThreadingApproach> Approaches;
+    std::vector<bool> IncrementalModes = { false };
+    unsigned Frames = 30;
+    unsigned WarmupFrames = 3;
+    unsigned Seed = 1;
+    std::string OutputPath;
+    std::string Mode = "sort";
+    size_t BruteForceLimit = 32768;
+    bool AutoTune = false;
+    size_t ThreadPoolCutoff = 0;
+    AffinityPolicy Affinity = AffinityPolicy::None;
+    std::vector<unsigned> AffinityCpus;
+    std::string SnapshotPath = "QuadSortBenchmark.qsnap";
+    std::vector<ParticleDistribution> Distributions = { ParticleDistribution::Uniform };
+    std::string TracePath;
+};
+
+struct BenchmarkResult
+{
+    double NsPerParticle;
+    size_t QuadCount;
+    double P50Us;
+    double P99Us;
+    double MeanUs;
+    ThreadingApproach FinalApproach;
+
+    // Every particle of every leaf was inside its leaf after the last sort
+    bool Verified;
+};
+
+static std::vector<std::string> SplitList(const std::string& List)
+{
+    std::vector<std::string> Items;
+    size_t Start = 0;
+    while (Start <= List.size())
+    {
+        size_t End = List.find(',', Start);
+        if (End == std::string::npos)
+        {
+            End = List.size();
+        }
+        if (End > Start)
+        {
+            Items.push_back(List.substr(Start, End - Start));
+        }
+        Start = End + 1;
+    }
+    return Items;
+}
+
+static bool ParseApproach(const std::string& Name, ThreadingApproach& OutApproach)
+{
+    for (ThreadingApproach Approach : ALL_APPROACHES)
+    {
+        if (Name == GetThreadingApproachName(Approach))
+        {
+            OutApproach = Approach;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool ParseDistribution(const std::string& Name, ParticleDistribution& OutDistribution)
+{
+    for (unsigned i = 0; i < ParticleDistributionCount; ++i)
+    {
+        if (Name == GetParticleDistributionName(static_cast<ParticleDistribution>(i)))
+        {
+            OutDistribution = static_cast<ParticleDistribution>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool ParseAffinity(const std::string& Value, BenchmarkSettings& Settings)
+{
+    Settings.AffinityCpus.clear();
+    if (Value == "none") { Settings.Affinity = AffinityPolicy::None; }
+    else if (Value == "compact") { Settings.Affinity = AffinityPolicy::Compact; }
+    else if (Value == "scatter") { Settings.Affinity = AffinityPolicy::Scatter; }
+    else
+    {
+        // Anything else is a list of CPUs
+        for (const std::string& Item : SplitList(Value))
+        {
+            char* End = nullptr;
+            const unsigned long Cpu = strtoul(Item.c_str(), &End, 10);
+            if (End == Item.c_str() || *End != '\0')
+            {
+                return false;
+            }
+            Settings.AffinityCpus.push_back(static_cast<unsigned>(Cpu));
+        }
+        Settings.Affinity = AffinityPolicy::Explicit;
+
+        // Every CPU has to be usable, or the run wouldn't be placed the way it was asked to be
+        return ThreadAffinity(Settings.Affinity, Settings.AffinityCpus).GetCpuOrder().size() == Settings.AffinityCpus.size();
+    }
+    return true;
+}
+
+static bool ParseArguments(int argc, char** argv, BenchmarkSettings& Settings)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string Arg = argv[i];
+        if (i + 1 >= argc)
+        {
+            std::cerr << "Missing value for " << Arg << std::endl;
+            return false;
+        }
+        const std::string Value = argv[++i];
+
+        if (Arg == "--counts")
+        {
+            Settings.ParticleCounts.clear();
+            for (const std::string& Item : SplitList(Value)) { Settings.ParticleCounts.push_back(std::stoull(Item)); }
+        }
+        else if (Arg == "--capacities")
+        {
+            Settings.QuadCapacities.clear();
+            for (const std::string& Item : SplitList(Value)) { Settings.QuadCapacities.push_back(std::stoull(Item)); }
+        }
+        else if (Arg == "--threads")
+        {
+            Settings.ThreadCounts.clear();
+            for (const std::string& Item : SplitList(Value)) { Settings.ThreadCounts.push_back(std::stoul(Item)); }
+        }
+        else if (Arg == "--approaches")
+        {
+            Settings.Approaches.clear();
+            if (Value == "all")
+            {
+                continue;
+            }
+            for (const std::string& Item : SplitList(Value))
+            {
+                ThreadingApproach Approach;
+                if (!ParseApproach(Item, Approach))
+                {
+                    std::cerr << "Unknown threading approach " << Item << std::endl;
+                    return false;
+                }
+                Settings.Approaches.push_back(Approach);
+            }
+        }
+        else if (Arg == "--incremental")
+        {
+            Settings.IncrementalModes.clear();
+            for (const std::string& Item : SplitList(Value)) { Settings.IncrementalModes.push_back(std::stoul(Item) != 0); }
+        }
+        else if (Arg == "--frames") { Settings.Frames = std::stoul(Value); }
+        else if (Arg == "--warmup") { Settings.WarmupFrames = std::stoul(Value); }
+        else if (Arg == "--seed") { Settings.Seed = std::stoul(Value); }
+        else if (Arg == "--out") { Settings.OutputPath = Value; }
+        else if (Arg == "--mode") { Settings.Mode = Value; }
+        else if (Arg == "--brute-limit") { Settings.BruteForceLimit = std::stoull(Value); }
+        else if (Arg == "--pool-cutoff") { Settings.ThreadPoolCutoff = std::stoull(Value); }
+        else if (Arg == "--autotune") { Settings.AutoTune = std::stoul(Value) != 0; }
+        else if (Arg == "--snapshot-path") { Settings.SnapshotPath = Value; }
+        else if (Arg == "--trace") { Settings.TracePath = Value; }
+        else if (Arg == "--distributions")
+        {
+            Settings.Distributions.clear();
+            for (unsigned d = 0; Value == "all" && d < ParticleDistributionCount; ++d)
+            {
+                Settings.Distributions.push_back(static_cast<ParticleDistribution>(d));
+            }
+            for (const std::string& Item : SplitList(Value == "all" ? std::string() : Value))
+            {
+                ParticleDistribution Distribution;
+                if (!ParseDistribution(Item, Distribution))
+                {
+                    std::cerr << "Unknown distribution " << Item << std::endl;
+                    return false;
+                }
+                Settings.Distributions.push_back(Distribution);
+            }
+        }
+        else if (Arg == "--affinity")
+        {
+            if (!ParseAffinity(Value, Settings))
+            {
+                std::cerr << "Unknown affinity or unusable CPU in " << Value << std::endl;
+                return false;
+            }
+        }
+        else
+        {
+            std::cerr << "Unknown option " << Arg << std::endl;
+            return false;
+        }
+    }
+
+    // Fill in defaults that depend on the machine
+    if (Settings.Approaches.empty())
+    {
+        Settings.Approaches.assign(std::begin(ALL_APPROACHES), std::end(ALL_APPROACHES));
+    }
+    if (Settings.ThreadCounts.empty())
+    {
+        const unsigned HardwareThreads = std::max(1u, std::thread::hardware_concurrency());
+        Settings.ThreadCounts = { 1, 2, 4, HardwareThreads };
+        std::sort(Settings.ThreadCounts.begin(), Settings.ThreadCounts.end());
+        Settings.ThreadCounts.erase(std::unique(Settings.ThreadCounts.begin(), Settings.ThreadCounts.end()),
+            Settings.ThreadCounts.end());
+    }
+
+    // Replayed runs have as many particles as the trace, whatever the distributions and counts asked for
+    if (!Settings.TracePath.empty() && Settings.Mode != "record")
+    {
+        ParticleScenario Scenario(static_cast<float>(WORLD_LEFT), static_cast<float>(WORLD_TOP), static_cast<float>(WORLD_RIGHT), static_cast<float>(WORLD_BOTTOM));
+        if (!Scenario.LoadTrace(Settings.TracePath))
+        {
+            std::cerr << "Failed to open trace " << Settings.TracePath << ", or it was recorded in another world" << std::endl;
+            return false;
+        }
+        Settings.ParticleCounts = { Scenario.GetParticleCount() };
+        Settings.Distributions = { ParticleDistribution::Uniform };
+    }
+    return Settings.Frames > 0 && !Settings.Distributions.empty() && (Settings.Mode == "sort" || Settings.Mode == "collisions"
+        || Settings.Mode == "stress" || Settings.Mode == "sharing" || Settings.Mode == "snapshot"
+        || (Settings.Mode == "record" && !Settings.TracePath.empty()));
+}
+
+// Nearest rank percentile of sorted samples
+static double Percentile(const std::vector<long long>& SortedSamples, double Fraction)
+{
+    size_t Rank = static_cast<size_t>(Fraction * SortedSamples.size() + 0.999999);
+    Rank = std::min(std::max<size_t>(Rank, 1), SortedSamples.size());
+    return static_cast<double>(SortedSamples[Rank - 1]);
+}
+
+// Name of the scenario a run used, for the CSV
+static const char* GetScenarioName(const BenchmarkSettings& Settings, ParticleDistribution Distribution)
+{
+    return Settings.TracePath.empty() ? GetParticleDistributionName(Distribution) : "Trace";
+}
+
+// Sets a run's scenario up from the settings and places the particles for the first frame
+static void StartScenario(const BenchmarkSettings& Settings, ParticleDistribution Distribution, ParticleScenario& Scenario,
+    Particles& ParticleContainer)
+{
+    bool Started = false;
+    if (Settings.TracePath.empty())
+    {
+        Scenario.SetDistribution(Distribution, Settings.Seed);
+        Started = Scenario.Start(ParticleContainer);
+    }
+    else
+    {
+        Started = Scenario.LoadTrace(Settings.TracePath) && Scenario.Start(ParticleContainer);
+    }
+    if (!Started)
+    {
+        std::cerr << "Failed to read trace " << Settings.TracePath << std::endl;
+    }
+}
+
+// Moves the particles of a run on to the next frame
+static void AdvanceScenario(const BenchmarkSettings& Settings, ParticleScenario& Scenario, Particles& ParticleContainer)
+{
+    if (!Scenario.NextFrame(ParticleContainer, FRAME_DELTA_TIME))
+    {
+        std::cerr << "Failed to read trace " << Settings.TracePath << std::endl;
+    }
+}
+
+// Pins the sort workers and this thread, which sorts, and places the particle memory following --affinity
+static void ApplyAffinity(const BenchmarkSettings& Settings, QuadSortManager& SortManager)
+{
+    if (Settings.Affinity == AffinityPolicy::None)
+    {
+        return;
+    }
+    SortManager.SetAffinity(Settings.Affinity, Settings.AffinityCpus);
+    SortManager.PinSortingThread();
+    SortManager.PlaceParticles();
+}
+
+static BenchmarkResult RunConfiguration(const BenchmarkSettings& Settings, ThreadingApproach Approach, ParticleDistribution Distribution,
+    size_t ParticleCount, size_t QuadCapacity, unsigned ThreadCount, bool Incremental, bool AutoTune)
+{
+    // Every configuration starts from the same particle layout
+    Particles ParticleContainer(ParticleCount, PARTICLE_RADIUS, PARTICLE_X_VEL, PARTICLE_Y_VEL);
+    ParticleScenario Scenario(static_cast<float>(WORLD_LEFT), static_cast<float>(WORLD_TOP), static_cast<float>(WORLD_RIGHT), static_cast<float>(WORLD_BOTTOM));
+    StartScenario(Settings, Distribution, Scenario, ParticleContainer);
+
+    QuadSortManager SortManager(ThreadCount, Approach, &ParticleContainer, QuadCapacity,
+        static_cast<float>(WORLD_LEFT), static_cast<float>(WORLD_TOP), static_cast<float>(WORLD_RIGHT), static_cast<float>(WORLD_BOTTOM));
+    SortManager.SetIncrementalUpdate(Incremental);
+    SortManager.SetAutoTune(AutoTune);
+    SortManager.SetThreadPoolCutoff(Settings.ThreadPoolCutoff);
+    ApplyAffinity(Settings, SortManager);
+
+    std::vector<long long> SortTimes;
+    SortTimes.reserve(Settings.Frames);
+
+    Timer<resolutions::nanoseconds> SortTimer;
+    for (unsigned Frame = 0; Frame < Settings.WarmupFrames + Settings.Frames; ++Frame)
+    {
+        AdvanceScenario(Settings, Scenario, ParticleContainer);
+
+        SortTimer.restart();
+        SortManager.SortParticles();
+        const long long SortTime = SortTimer.total_elapsed();
+
+        if (Frame >= Settings.WarmupFrames)
+        {
+            SortTimes.push_back(SortTime);
+        }
+    }
+
+    long long TotalSortTime = 0;
+    for (long long SortTime : SortTimes)
+    {
+        TotalSortTime += SortTime;
+    }
+    std::sort(SortTimes.begin(), SortTimes.end());
+
+    BenchmarkResult Result;
+    Result.MeanUs = static_cast<double>(TotalSortTime) / SortTimes.size() / 1000.0;
+    Result.NsPerParticle = static_cast<double>(TotalSortTime) / SortTimes.size() / ParticleCount;
+    Result.QuadCount = SortManager.GetQuadCount();
+    Result.P50Us = Percentile(SortTimes, 0.50) / 1000.0;
+    Result.P99Us = Percentile(SortTimes, 0.99) / 1000.0;
+    Result.FinalApproach = SortManager.GetCurrentThreadingApproach();
+    Result.Verified = SortManager.AreLeavesSorted();
+    return Result;
+}
+
+// Records the first distribution and particle count to the trace, placed for a first frame and then moved for
+// every warmup and timed frame, so replaying it sorts the same positions as a generated run. Returns the number
+// of frames recorded, 0 if the trace couldn't be written
+static uint32_t RecordTrace(const BenchmarkSettings& Settings)
+{
+    Particles ParticleContainer(Settings.ParticleCounts.front(), PARTICLE_RADIUS, PARTICLE_X_VEL, PARTICLE_Y_VEL);
+    ParticleScenario Scenario(static_cast<float>(WORLD_LEFT), static_cast<float>(WORLD_TOP), static_cast<float>(WORLD_RIGHT), static_cast<float>(WORLD_BOTTOM));
+    Scenario.SetDistribution(Settings.Distributions.front(), Settings.Seed);
+    Scenario.Start(ParticleContainer);
+
+    TraceRecorder Recorder;
+    bool Recorded = Recorder.Open(Settings.TracePath, ParticleContainer,
+        static_cast<float>(WORLD_LEFT), static_cast<float>(WORLD_TOP), static_cast<float>(WORLD_RIGHT), static_cast<float>(WORLD_BOTTOM))
+        && Recorder.RecordFrame(ParticleContainer);
+    for (unsigned Frame = 0; Recorded && Frame < Settings.WarmupFrames + Settings.Frames; ++Frame)
+    {
+        Scenario.NextFrame(ParticleContainer, FRAME_DELTA_TIME);
+        Recorded = Recorder.RecordFrame(ParticleContainer);
+    }
+    Recorded = Recorder.Close() && Recorded;
+    return Recorded ? Recorder.GetFrameCount() : 0;
+}
+
+struct CollisionResult
+{
+    size_t PairCount;
+    double P50Us;
+    double MeanUs;
+    size_t BruteForcePairCount;
+    double BruteForceUs;
+
+    // The leaves of the last tree held only their own particles, and the pair count matched the brute force
+    // search when it ran
+    bool Verified;
+};
+
+// Counts overlapping pairs by testing every particle against every other
+static size_t CountCollisionPairsBruteForce(const Particles& ParticleContainer)
+{
+    const float DiameterSquared = ParticleContainer._ParticleDiameter * ParticleContainer._ParticleDiameter;
+    size_t PairCount = 0;
+    for (size_t i = 0; i < ParticleContainer._MaxParticles; ++i)
+    {
+        for (size_t j = i + 1; j < ParticleContainer._MaxParticles; ++j)
+        {
+            const float DistanceX = ParticleContainer._PosX[j] - ParticleContainer._PosX[i];
+            const float DistanceY = ParticleContainer._PosY[j] - ParticleContainer._PosY[i];
+            if (DistanceX * DistanceX + DistanceY * DistanceY < DiameterSquared)
+            {
+                ++PairCount;
+            }
+        }
+    }
+    return PairCount;
+}
+
+static CollisionResult RunCollisionConfiguration(const BenchmarkSettings& Settings, ThreadingApproach Approach, ParticleDistribution Distribution,
+    size_t ParticleCount, size_t QuadCapacity, unsigned ThreadCount)
+{
+    Particles ParticleContainer(ParticleCount, PARTICLE_RADIUS, PARTICLE_X_VEL, PARTICLE_Y_VEL);
+    ParticleScenario Scenario(static_cast<float>(WORLD_LEFT), static_cast<float>(WORLD_TOP), static_cast<float>(WORLD_RIGHT), static_cast<float>(WORLD_BOTTOM));
+    StartScenario(Settings, Distribution, Scenario, ParticleContainer);
+
+    // Only the pair search is timed, the sort builds the tree it searches
+    QuadSortManager SortManager(ThreadCount, Approach, &ParticleContainer, QuadCapacity,
+        static_cast<float>(WORLD_LEFT), static_cast<float>(WORLD_TOP), static_cast<float>(WORLD_RIGHT), static_cast<float>(WORLD_BOTTOM));
+    ApplyAffinity(Settings, SortManager);
+
+    std::vector<long long> SearchTimes;
+    SearchTimes.reserve(Settings.Frames);
+
+    Timer<resolutions::nanoseconds> SearchTimer;
+    for (unsigned Frame = 0; Frame < Settings.WarmupFrames + Settings.Frames; ++Frame)
+    {
+        AdvanceScenario(Settings, Scenario, ParticleContainer);
+        SortManager.SortParticles();
+
+        SearchTimer.restart();
+        SortManager.FindCollisionPairs();
+        const long long SearchTime = SearchTimer.total_elapsed();
+
+        if (Frame >= Settings.WarmupFrames)
+        {
+            SearchTimes.push_back(SearchTime);
+        }
+    }
+
+    long long TotalSearchTime = 0;
+    for (long long SearchTime : SearchTimes)
+    {
+        TotalSearchTime += SearchTime;
+    }
+    std::sort(SearchTimes.begin(), SearchTimes.end());
+
+    CollisionResult Result;
+    Result.PairCount = SortManager.GetCollisionPairCount();
+    Result.P50Us = Percentile(SearchTimes, 0.50) / 1000.0;
+    Result.MeanUs = static_cast<double>(TotalSearchTime) / SearchTimes.size() / 1000.0;
+
+    // Brute force on the last frame's positions, the pair counts should match
+    Result.BruteForcePairCount = 0;
+    Result.BruteForceUs = 0.0;
+    if (ParticleCount <= Settings.BruteForceLimit)
+    {
+        SearchTimer.restart();
+        Result.BruteForcePairCount = CountCollisionPairsBruteForce(ParticleContainer);
+        Result.BruteForceUs = SearchTimer.total_elapsed() / 1000.0;
+    }
+    Result.Verified = SortManager.AreLeavesSorted()
+        && (ParticleCount > Settings.BruteForceLimit || Result.PairCount == Result.BruteForcePairCount);
+    return Result;
+}
+
+// Where snapshots of the tree are written during a snapshot run
+enum class SnapshotWriterMode
+{
+    None,
+    Sync,
+    Async
+};
+
+static const char* GetSnapshotWriterModeName(SnapshotWriterMode Mode)
+{
+    switch (Mode)
+    {
+    case SnapshotWriterMode::None:  return "none";
+    case SnapshotWriterMode::Sync:  return "sync";
+    case SnapshotWriterMode::Async: return "async";
+    }
+    return "unknown";
+}
+
+struct SnapshotResult
+{
+    uint64_t Bytes;
+    double P50Us;
+    double MeanUs;
+    double FlushUs;
+    bool Verified;
+};
+
+// Checks a query gives the same particles on the snapshot as on the tree, in any order
+static bool IsSameQueryResult(std::vector<uint32_t>& TreeResult, size_t TreeFound, std::vector<uint32_t>& SnapshotResult, size_t SnapshotFound)
+{
+    if (TreeFound != SnapshotFound || TreeFound > TreeResult.size())
+    {
+        return false;
+    }
+    std::sort(TreeResult.begin(), TreeResult.begin() + TreeFound);
+    std::sort(SnapshotResult.begin(), SnapshotResult.begin() + SnapshotFound);
+    return std::equal(TreeResult.begin(), TreeResult.begin() + TreeFound, SnapshotResult.begin());
+}
+
+// Maps the snapshot written after the last sort and runs the same queries on it and on the tree
+static bool VerifySnapshot(const BenchmarkSettings& Settings, const QuadSortManager& SortManager, size_t ParticleCount, unsigned SortCount)
+{
+    SnapshotView Snapshot;
+    if (!Snapshot.Open(Settings.SnapshotPath) || Snapshot.GetHeader()._Frame != SortCount
+        || Snapshot.GetHeader()._ParticleCount != ParticleCount)
+    {
+        return false;
+    }
+
+    std::vector<uint32_t> TreeResult(ParticleCount);
+    std::vector<uint32_t> SnapshotResult(ParticleCount);
+
+    // Every particle is found by a query covering everything, including any outside the world
+    const float Infinity = std::numeric_limits<float>::infinity();
+    if (Snapshot.QueryRect(-Infinity, -Infinity, Infinity, Infinity, SnapshotResult.data(), SnapshotResult.size()) != ParticleCount)
+    {
+        return false;
+    }
+
+    ScenarioRandom Random(Settings.Seed);
+    for (unsigned i = 0; i < 64; ++i)
+    {
+        const float x = WORLD_LEFT + Random.NextFloat() * (WORLD_RIGHT - WORLD_LEFT);
+        const float y = WORLD_TOP + Random.NextFloat() * (WORLD_BOTTOM - WORLD_TOP);
+        const float Size = 1.f + Random.NextFloat() * 199.f;
+
+        size_t TreeFound = SortManager.QueryRect(x, y, x + Size, y + Size, TreeResult.data(), TreeResult.size());
+        size_t SnapshotFound = Snapshot.QueryRect(x, y, x + Size, y + Size, SnapshotResult.data(), SnapshotResult.size());
+        if (!IsSameQueryResult(TreeResult, TreeFound, SnapshotResult, SnapshotFound))
+        {
+            return false;
+        }
+
+        TreeFound = SortManager.QueryRadius(x, y, Size, TreeResult.data(), TreeResult.size());
+        SnapshotFound = Snapshot.QueryRadius(x, y, Size, SnapshotResult.data(), SnapshotResult.size());
+        if (!IsSameQueryResult(TreeResult, TreeFound, SnapshotResult, SnapshotFound))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static SnapshotResult RunSnapshotConfiguration(const BenchmarkSettings& Settings, SnapshotWriterMode WriterMode,
+    ParticleDistribution Distribution, size_t ParticleCount, size_t QuadCapacity, unsigned ThreadCount)
+{
+    Particles ParticleContainer(ParticleCount, PARTICLE_RADIUS, PARTICLE_X_VEL, PARTICLE_Y_VEL);
+    ParticleScenario Scenario(static_cast<float>(WORLD_LEFT), static_cast<float>(WORLD_TOP), static_cast<float>(WORLD_RIGHT), static_cast<float>(WORLD_BOTTOM));
+    StartScenario(Settings, Distribution, Scenario, ParticleContainer);
+
+    QuadSortManager SortManager(ThreadCount, ThreadingApproach::ThreadPool, &ParticleContainer, QuadCapacity,
+        static_cast<float>(WORLD_LEFT), static_cast<float>(WORLD_TOP), static_cast<float>(WORLD_RIGHT), static_cast<float>(WORLD_BOTTOM));
+    ApplyAffinity(Settings, SortManager);
+
+    std::vector<long long> FrameTimes;
+    FrameTimes.reserve(Settings.Frames);
+
+    // Frames are timed from the start of the sort until the snapshot is handed off, the
+    // async writer's disk write overlapping the frames after it
+    bool Written = true;
+    Timer<resolutions::nanoseconds> FrameTimer;
+    const unsigned SortCount = Settings.WarmupFrames + Settings.Frames;
+    for (unsigned Frame = 0; Frame < SortCount; ++Frame)
+    {
+        AdvanceScenario(Settings, Scenario, ParticleContainer);
+
+        FrameTimer.restart();
+        SortManager.SortParticles();
+        if (WriterMode == SnapshotWriterMode::Sync)
+        {
+            Written = SortManager.SaveSnapshot(Settings.SnapshotPath) && Written;
+        }
+        else if (WriterMode == SnapshotWriterMode::Async)
+        {
+            SortManager.CaptureSnapshot(Settings.SnapshotPath);
+        }
+        const long long FrameTime = FrameTimer.total_elapsed();
+
+        if (Frame >= Settings.WarmupFrames)
+        {
+            FrameTimes.push_back(FrameTime);
+        }
+    }
+
+    // The last snapshot can still be being written
+    FrameTimer.restart();
+    Written = SortManager.FlushSnapshots() && Written;
+
+    SnapshotResult Result;
+    Result.FlushUs = FrameTimer.total_elapsed() / 1000.0;
+
+    long long TotalFrameTime = 0;
+    for (long long FrameTime : FrameTimes)
+    {
+        TotalFrameTime += FrameTime;
+    }
+    std::sort(FrameTimes.begin(), FrameTimes.end());
+
+    Result.P50Us = Percentile(FrameTimes, 0.50) / 1000.0;
+    Result.MeanUs = static_cast<double>(TotalFrameTime) / FrameTimes.size() / 1000.0;
+    Result.Bytes = 0;
+    Result.Verified = true;
+    if (WriterMode != SnapshotWriterMode::None)
+    {
+        SnapshotView Snapshot;
+        Result.Bytes = Snapshot.Open(Settings.SnapshotPath) ? Snapshot.GetHeader()._FileSize : 0;
+        Result.Verified = Written && VerifySnapshot(Settings, SortManager, ParticleCount, SortCount);
+    }
+    return Result;
+}
+
+struct StressResult
+{
+    long long JobCount;
+    long long CompletedCount;
+    unsigned FailedRounds;
+    double MeanUs;
+};
+
+// Runs rounds of jobs that each run a ParallelFor, restarting the pool between rounds. Every other
+// round stops the pool without waiting while jobs are still being added, which must not hang.
+// Under -fsanitize=thread this finds data races on jobs and pool state, as the pool orders them only
+// with mutexes and atomic operations TSan models. TSan treats seq_cst like acquire/release though, so
+// it doesn't check the store then load ordering the deque and the idle and waiter wakeups rely on.
+// Only lost or twice run jobs and hangs in this test catch a break there, and only on the interleavings
+// that happen to run
+static StressResult RunPoolStress(const BenchmarkSettings& Settings, unsigned ThreadCount)
+{
+    static const long long JobsPerRound = 1000;
+    static const size_t ChunksPerJob = 8;
+    static const size_t ItemsPerChunk = 8;
+
+    ThreadPool Pool(ThreadCount);
+    Pool.SetAffinity(ThreadAffinity(Settings.Affinity, Settings.AffinityCpus));
+    StressResult Result = { 0, 0, 0, 0.0 };
+    long long TotalRoundTime = 0;
+
+    Timer<resolutions::nanoseconds> RoundTimer;
+    for (unsigned Round = 0; Round < Settings.Frames; ++Round)
+    {
+        if (!Pool.Initialise())
+        {
+            ++Result.FailedRounds;
+            continue;
+        }
+
+        const bool StopSafely = Round % 2 == 0;
+        const long long CompletedBefore = Pool.GetNumJobsCompleted();
+        std::atomic<long long> ItemCount(0);
+        std::atomic<long long> RanCount(0);
+        JobLatch RoundLatch;
+
+        RoundTimer.restart();
+        for (long long i = 0; i < JobsPerRound; ++i)
+        {
+            Pool.Submit([&Pool, &ItemCount, &RanCount]()
+            {
+                Pool.ParallelFor(0, ChunksPerJob * ItemsPerChunk, ItemsPerChunk,
+                    [&ItemCount](size_t Begin, size_t End) { ItemCount.fetch_add(End - Begin, std::memory_order_relaxed); });
+                RanCount.fetch_add(1, std::memory_order_relaxed);
+            }, &RoundLatch);
+        }
+
+        if (StopSafely)
+        {
+            RoundLatch.Wait();
+        }
+        const bool Stopped = Pool.StopThreads(StopSafely);
+
+        // Dropped jobs are counted down, so this returns even when the pool stopped early
+        RoundLatch.Wait();
+        TotalRoundTime += RoundTimer.total_elapsed();
+
+        // A job that ran ran all of its chunks. The job and every chunk but the first, which it runs
+        // itself, count as completed jobs. Stopping without waiting may drop jobs, but nothing may run twice
+        const long long Ran = RanCount.load();
+        const long long Completed = Pool.GetNumJobsCompleted() - CompletedBefore;
+        bool Passed = Stopped && ItemCount.load() == Ran * static_cast<long long>(ChunksPerJob * ItemsPerChunk);
+        if (StopSafely)
+        {
+            Passed = Passed && Ran == JobsPerRound && Completed == JobsPerRound * static_cast<long long>(ChunksPerJob);
+        }
+        else
+        {
+            Passed = Passed && Ran <= JobsPerRound && Completed <= JobsPerRound * static_cast<long long>(ChunksPerJob);
+        }
+
+        Result.JobCount += JobsPerRound;
+        Result.CompletedCount += Completed;
+        Result.FailedRounds += Passed ? 0 : 1;
+    }
+    Result.MeanUs = static_cast<double>(TotalRoundTime) / std::max(Settings.Frames, 1u) / 1000.0;
+    return Result;
+}
+
+// Counter layouts the sharing benchmark compares: one counter every thread adds to, one counter
+// per thread packed next to each other, and one counter per thread on a line of its own
+enum class CounterLayout
+{
+    Shared,
+    Packed,
+    Padded
+};
+
+static const char* GetCounterLayoutName(CounterLayout Layout)
+{
+    switch (Layout)
+    {
+    case CounterLayout::Shared: return "shared";
+    case CounterLayout::Packed: return "packed";
+    case CounterLayout::Padded: return "padded";
+    }
+    return "unknown";
+}
+
+struct alignas(CacheLineSize) PaddedCounter
+{
+    std::atomic<long long> Count;
+};
+
+struct SharingThreadInfo
+{
+    CounterLayout Layout;
+    std::atomic<long long>* Counter;
+    long long Increments;
+    pthread_barrier_t* StartBarrier;
+};
+
+// Counts up as fast as it can, the only thing slowing it down is other threads writing the same line
+static void* SharingWorker(void* inData)
+{
+    SharingThreadInfo* Info = (SharingThreadInfo*)inData;
+    std::atomic<long long>& Counter = *Info->Counter;
+
+    pthread_barrier_wait(Info->StartBarrier);
+    for (long long i = 0; i < Info->Increments; ++i)
+    {
+        if (Info->Layout == CounterLayout::Shared)
+        {
+            Counter.fetch_add(1, std::memory_order_relaxed);
+        }
+        else
+        {
+            // Each thread owns its counter, the same single writer count the pool's worker stats use
+            Counter.store(Counter.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        }
+    }
+    return nullptr;
+}
+
+// Times ThreadCount pinned threads counting with a layout, returning ns per increment per thread
+static double RunCounterSharing(const BenchmarkSettings& Settings, unsigned ThreadCount, CounterLayout Layout)
+{
+    const long long Increments = static_cast<long long>(Settings.Frames) * 1000000;
+    const ThreadAffinity Affinity(Settings.Affinity, Settings.AffinityCpus);
+
+    std::vector<std::atomic<long long>> PackedCounters(ThreadCount);
+    std::vector<PaddedCounter> PaddedCounters(ThreadCount);
+    std::vector<SharingThreadInfo> Infos(ThreadCount);
+    std::vector<pthread_t> Threads(ThreadCount);
+
+    pthread_barrier_t StartBarrier;
+    pthread_barrier_init(&StartBarrier, NULL, ThreadCount + 1);
+
+    unsigned StartedThreads = 0;
+    for (unsigned i = 0; i < ThreadCount; ++i)
+    {
+        PackedCounters[i].store(0);
+        PaddedCounters[i].Count.store(0);
+        std::atomic<long long>* Counter = Layout == CounterLayout::Shared ? &PackedCounters[0]
+            : (Layout == CounterLayout::Packed ? &PackedCounters[i] : &PaddedCounters[i].Count);
+        Infos[i] = { Layout, Counter, Increments, &StartBarrier };
+    }
+    for (; StartedThreads < ThreadCount; ++StartedThreads)
+    {
+        if (Affinity.CreateThread(&Threads[StartedThreads], &SharingWorker, &Infos[StartedThreads], StartedThreads + 1))
+        {
+            break;
+        }
+    }
+
+    // Threads that failed to start are stood in for by this one so the barrier still opens
+    Timer<resolutions::nanoseconds> SharingTimer;
+    for (unsigned i = StartedThreads; i < ThreadCount; ++i)
+    {
+        pthread_barrier_wait(&StartBarrier);
+    }
+    pthread_barrier_wait(&StartBarrier);
+    SharingTimer.restart();
+    for (unsigned i = 0; i < StartedThreads; ++i)
+    {
+        pthread_join(Threads[i], NULL);
+    }
+    const long long Elapsed = SharingTimer.total_elapsed();
+    pthread_barrier_destroy(&StartBarrier);
+
+    return StartedThreads == ThreadCount ? static_cast<double>(Elapsed) / Increments : -1.0;
+}
+
+// Times the pool running empty jobs added from inside the pool, returning ns per job. Every
+// job completion writes the pool's counts, so this is where shared lines in the pool show up
+static double RunPoolJobSharing(const BenchmarkSettings& Settings, unsigned ThreadCount)
+{
+    const size_t JobCount = static_cast<size_t>(Settings.Frames) * 10000;
+    ThreadPool Pool(ThreadCount);
+    Pool.SetAffinity(ThreadAffinity(Settings.Affinity, Settings.AffinityCpus));
+    if (!Pool.Initialise())
+    {
+        return -1.0;
+    }
+
+    // One job per thread adds the empty jobs, so they go onto pool deques and get stolen
+    JobLatch AllJobs;
+    Timer<resolutions::nanoseconds> SharingTimer;
+    for (unsigned i = 0; i < ThreadCount; ++i)
+    {
+        Pool.Submit([&Pool, JobCount, ThreadCount]()
+        {
+            Pool.ParallelFor(0, JobCount / ThreadCount, 1, [](size_t, size_t) {});
+        }, &AllJobs);
+    }
+    AllJobs.Wait();
+    const long long Elapsed = SharingTimer.total_elapsed();
+    Pool.StopThreads(true);
+
+    return static_cast<double>(Elapsed) / JobCount;
+}
+
+int main(int argc, char** argv)
+{
+    BenchmarkSettings Settings;
+    if (!ParseArguments(argc, argv, Settings))
+    {
+        std::cerr << "Usage: " << argv[0] << " [--counts list] [--capacities list] [--threads list] "
+            "[--approaches list|all] [--incremental list] [--frames n] [--warmup n] [--seed n] [--out file] "
+            "[--mode sort|collisions|stress|sharing|snapshot|record] [--brute-limit n] [--pool-cutoff n] [--autotune 0|1] "
+            "[--affinity none|compact|scatter|list] [--snapshot-path file] [--distributions list|all] [--trace file]" << std::endl;
+        return 1;
+    }
+
+    std::ofstream OutputFile;
+    if (!Settings.OutputPath.empty())
+    {
+        OutputFile.open(Settings.OutputPath, std::ios::out | std::ios::trunc);
+        if (!OutputFile.is_open())
+        {
+            std::cerr << "Failed to open " << Settings.OutputPath << std::endl;
+            return 1;
+        }
+    }
+    std::ostream& Output = OutputFile.is_open() ? OutputFile : std::cout;
+
+    if (Settings.Mode == "record")
+    {
+        Output << "distribution,particles,frames,trace" << std::endl;
+
+        const uint32_t FrameCount = RecordTrace(Settings);
+        Output << GetParticleDistributionName(Settings.Distributions.front()) << ',' << Settings.ParticleCounts.front() << ','
+            << FrameCount << ',' << Settings.TracePath << std::endl;
+        return FrameCount > 0 ? 0 : 1;
+    }
+
+    if (Settings.Mode == "collisions")
+    {
+        Output << "approach,distribution,particles,capacity,threads,frames,pairs,p50_us,mean_us,brute_pairs,brute_us,verified" << std::endl;
+
+        bool AllVerified = true;
+        for (ParticleDistribution Distribution : Settings.Distributions)
+        {
+            for (size_t ParticleCount : Settings.ParticleCounts)
+            {
+                for (size_t QuadCapacity : Settings.QuadCapacities)
+                {
+                    for (ThreadingApproach Approach : Settings.Approaches)
+                    {
+                        // The uniform grid doesn't build the tree the pair search needs
+                        if (Approach == ThreadingApproach::UniformGrid)
+                        {
+                            continue;
+                        }
+
+                        for (unsigned ThreadCount : Settings.ThreadCounts)
+                        {
+                            const CollisionResult Result = RunCollisionConfiguration(Settings, Approach, Distribution, ParticleCount,
+                                QuadCapacity, ThreadCount);
+                            AllVerified = AllVerified && Result.Verified;
+
+                            Output << GetThreadingApproachName(Approach) << ',' << GetScenarioName(Settings, Distribution) << ',' << ParticleCount << ','
+                                << QuadCapacity << ',' << ThreadCount << ',' << Settings.Frames << ',' << Result.PairCount << ','
+                                << Result.P50Us << ',' << Result.MeanUs << ',' << Result.BruteForcePairCount << ',' << Result.BruteForceUs << ','
+                                << Result.Verified << std::endl;
+                        }
+                    }
+                }
+            }
+        }
+        return AllVerified ? 0 : 1;
+    }
+
+    if (Settings.Mode == "sharing")
+    {
+        Output << "threads,layout,ns_per_op" << std::endl;
+
+        const CounterLayout Layouts[] = { CounterLayout::Shared, CounterLayout::Packed, CounterLayout::Padded };
+        for (unsigned ThreadCount : Settings.ThreadCounts)
+        {
+            for (CounterLayout Layout : Layouts)
+            {
+                Output << ThreadCount << ',' << GetCounterLayoutName(Layout) << ','
+                    << RunCounterSharing(Settings, ThreadCount, Layout) << std::endl;
+            }
+            Output << ThreadCount << ",pool_jobs," << RunPoolJobSharing(Settings, ThreadCount) << std::endl;
+        }
+        return 0;
+    }
+
+    if (Settings.Mode == "snapshot")
+    {
+        Output << "distribution,particles,capacity,threads,writer,frames,bytes,p50_us,mean_us,flush_us,verified" << std::endl;
+
+        const SnapshotWriterMode WriterModes[] = { SnapshotWriterMode::None, SnapshotWriterMode::Sync, SnapshotWriterMode::Async };
+        bool AllVerified = true;
+        for (ParticleDistribution Distribution : Settings.Distributions)
+        {
+            for (size_t ParticleCount : Settings.ParticleCounts)
+            {
+                for (size_t QuadCapacity : Settings.QuadCapacities)
+                {
+                    for (unsigned ThreadCount : Settings.ThreadCounts)
+                    {
+                        for (SnapshotWriterMode WriterMode : WriterModes)
+                        {
+                            const SnapshotResult Result = RunSnapshotConfiguration(Settings, WriterMode, Distribution,
+                                ParticleCount, QuadCapacity, ThreadCount);
+                            AllVerified = AllVerified && Result.Verified;
+
+                            Output << GetScenarioName(Settings, Distribution) << ',' << ParticleCount << ',' << QuadCapacity << ','
+                                << ThreadCount << ',' << GetSnapshotWriterModeName(WriterMode) << ','
+                                << Settings.Frames << ',' << Result.Bytes << ',' << Result.P50Us << ',' << Result.MeanUs << ','
+                                << Result.FlushUs << ',' << Result.Verified << std::endl;
+                        }
+                    }
+                }
+            }
+        }
+        return AllVerified ? 0 : 1;
+    }
+
+    if (Settings.Mode == "stress")
+    {
+        Output << "threads,rounds,jobs,completed,failed_rounds,mean_us" << std::endl;
+
+        unsigned FailedRounds = 0;
+        for (unsigned ThreadCount : Settings.ThreadCounts)
+        {
+            const StressResult Result = RunPoolStress(Settings, ThreadCount);
+            FailedRounds += Result.FailedRounds;
+
+            Output << ThreadCount << ',' << Settings.Frames << ',' << Result.JobCount << ',' << Result.CompletedCount << ','
+                << Result.FailedRounds << ',' << Result.MeanUs << std::endl;
+        }
+        return FailedRounds > 0 ? 1 : 0;
+    }
+
+    Output << "approach,incremental,distribution,particles,capacity,threads,frames,ns_per_particle,quads,p50_us,p99_us,mean_us,verified" << std::endl;
+
+    bool AllVerified = true;
+
+    for (ParticleDistribution Distribution : Settings.Distributions)
+    {
+        for (size_t ParticleCount : Settings.ParticleCounts)
+        {
+            for (size_t QuadCapacity : Settings.QuadCapacities)
+            {
+                for (ThreadingApproach Approach : Settings.Approaches)
+                {
+                    // Only the queue and pool approaches take a thread count, the others
+                    // are run once with the number of threads they actually use
+                    std::vector<unsigned> ThreadCounts = Settings.ThreadCounts;
+                    if (Approach == ThreadingApproach::NoThreading)
+                    {
+                        ThreadCounts = { 1 };
+                    }
+                    else if (Approach == ThreadingApproach::FlatFourThreading)
+                    {
+                        ThreadCounts = { 4 };
+                    }
+
+                    for (unsigned ThreadCount : ThreadCounts)
+                    {
+                        for (bool Incremental : Settings.IncrementalModes)
+                        {
+                            const BenchmarkResult Result = RunConfiguration(Settings, Approach, Distribution, ParticleCount, QuadCapacity,
+                                ThreadCount, Incremental, false);
+                            AllVerified = AllVerified && Result.Verified;
+
+                            Output << GetThreadingApproachName(Approach) << ',' << Incremental << ',' << GetScenarioName(Settings, Distribution) << ','
+                                << ParticleCount << ',' << QuadCapacity << ',' << ThreadCount << ',' << Settings.Frames << ',' << Result.NsPerParticle << ','
+                                << Result.QuadCount << ',' << Result.P50Us << ',' << Result.P99Us << ',' << Result.MeanUs << ',' << Result.Verified << std::endl;
+                        }
+                    }
+                }
+
+                // Autotuning starts on no threading and finds its own way to the fastest approach
+                if (!Settings.AutoTune)
+                {
+                    continue;
+                }
+                for (unsigned ThreadCount : Settings.ThreadCounts)
+                {
+                    for (bool Incremental : Settings.IncrementalModes)
+                    {
+                        // Autotuning turns itself off when updating incrementally
+                        if (Incremental)
+                        {
+                            continue;
+                        }
+
+                        const BenchmarkResult Result = RunConfiguration(Settings, ThreadingApproach::NoThreading, Distribution, ParticleCount,
+                            QuadCapacity, ThreadCount, Incremental, true);
+                        AllVerified = AllVerified && Result.Verified;
+
+                        Output << "AutoTune(" << GetThreadingApproachName(Result.FinalApproach) << ")," << Incremental << ','
+                            << GetScenarioName(Settings, Distribution) << ',' << ParticleCount << ',' << QuadCapacity << ',' << ThreadCount << ',' << Settings.Frames << ','
+                            << Result.NsPerParticle << ',' << Result.QuadCount << ',' << Result.P50Us << ',' << Result.P99Us << ','
+                            << Result.MeanUs << ',' << Result.Verified << std::endl;
+                    }
+                }
+            }
+        }
+    }
+    return AllVerified ? 0 : 1;
+}
@@ -1,5 +1,5 @@
 // Main.cpp
-// Program creates particles with random locations and then sorts them into a quadtree
+// Program creates particles with seeded locations and then sorts them into a quadtree
 
 // Windows Things
 #define VK_USE_PLATFORM_WIN32_KHR // tell vulkan we are on Windows platform
@@ -28,6 +28,9 @@
 // Include the quad sort manager to handle quad sorting implementations
 #include "compute/pthread/QuadSortManager.h"
 
+// Include the scenarios to place the particles the same way every run
+#include "compute/pthread/Scenario.h"
+
 // Number of threads the Quad Sort Manager can use for Pool and Queue managed threading approached
 static constexpr unsigned int SORT_THREAD_COUNT = 4;
 
@@ -37,6 +40,10 @@ static constexpr float PARTICLE_RADIUS = 1.f;
 static constexpr float PARTICLE_X_VEL = -18.f;
 static constexpr float PARTICLE_Y_VEL = -25.f;
 
+// How the particles are placed at the start, see ParticleDistribution
+static constexpr ParticleDistribution START_DISTRIBUTION = ParticleDistribution::Uniform;
+static constexpr uint64_t START_SEED = 1u;
+
 static constexpr unsigned SCREEN_WIDTH = 1920u;
 static constexpr unsigned SCREEN_HEIGHT = 1080u;
 // Changed for texture rendering
@@ -99,13 +106,11 @@ int WINAPI WinMain(HINSTANCE hInstance,
     // Create a window with GLFW
     create_window("QuadTree Particles Vulkan", SCREEN_WIDTH, SCREEN_HEIGHT);
 
-    // Seed Rand
-    srand(time(NULL));
-
-    // Create a container of particles and randomise their locations
+    // Create a container of particles and place them for the first frame, the same seed
+    // places them the same way every run so runs can be compared
     Particles ParticleContainer(NUM_PARTICLES, PARTICLE_RADIUS, PARTICLE_X_VEL, PARTICLE_Y_VEL);
-    // Randomise start locations of particles across world space
-    ParticleContainer.RandomiseLocationsInRange(WORLD_LEFT, WORLD_RIGHT, WORLD_TOP, WORLD_BOTTOM);
+    GenerateDistribution(ParticleContainer, START_DISTRIBUTION, START_SEED,
+        static_cast<float>(WORLD_LEFT), static_cast<float>(WORLD_TOP), static_cast<float>(WORLD_RIGHT), static_cast<float>(WORLD_BOTTOM));
 
     SortManager = new QuadSortManager(SORT_THREAD_COUNT, ThreadingApproach::ThreadPool, &ParticleContainer, QUAD_CAPACITY,
         static_cast<float>(WORLD_LEFT), static_cast<float>(WORLD_TOP), static_cast<float>(WORLD_RIGHT), static_cast<float>(WORLD_BOTTOM));
@@ -3,6 +3,7 @@
 
 namespace resolutions
 {
+	typedef std::chrono::nanoseconds	nanoseconds;
 	typedef std::chrono::microseconds	microseconds;
 	typedef std::chrono::milliseconds	milliseconds;
 	typedef std::chrono::seconds			seconds;
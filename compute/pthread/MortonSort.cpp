@@ -0,0 +1,252 @@
+#include "MortonSort.h"
+#include <cmath>
+#include <utility>
+
+MortonSorter::MortonSorter(unsigned ThreadCount)
+	:_ThreadCount(ThreadCount > 0 ? ThreadCount : 1), _Keys(), _ScratchKeys(), _Histograms(), _WorkerInfos(), _Affinity(), _Workers(),
+	_l(0.f), _t(0.f), _r(0.f), _b(0.f), _ScaleX(0.f), _ScaleY(0.f), _SideWidth(0.f), _SideHeight(0.f)
+{
+}
+
+MortonSorter::~MortonSorter()
+{
+	StopWorkers();
+	if (_PassBarrierReady)
+	{
+		pthread_barrier_destroy(&_PassBarrier);
+	}
+}
+
+void MortonSorter::SetAffinity(const ThreadAffinity& Affinity)
+{
+	_Affinity = Affinity;
+	StopWorkers();
+}
+
+bool MortonSorter::StopWorkers()
+{
+	return _Workers.Stop();
+}
+
+bool MortonSorter::Sort(const Particles* ParticleContainer, float l, float t, float r, float b)
+{
+	_ParticleContainer = ParticleContainer;
+	_l = l;
+	_t = t;
+	_r = r;
+	_b = b;
+	// Scale positions so the bounds cover the full 16 bit range of each axis
+	_ScaleX = 65536.f / (r - l);
+	_ScaleY = 65536.f / (b - t);
+	// Same as QuadTree's quad sizes at the deepest level
+	_SideWidth = std::ldexp(r - l, -static_cast<int>(_MaxDepth));
+	_SideHeight = std::ldexp(b - t, -static_cast<int>(_MaxDepth));
+
+	_Keys.resize(ParticleContainer->_MaxParticles);
+	_ScratchKeys.resize(ParticleContainer->_MaxParticles);
+
+	// Helper threads are started the first time they are needed and stay parked between sorts
+	bool Success = true;
+	if (!_Workers._Running && _ThreadCount > 1)
+	{
+		_WorkerInfos.resize(_ThreadCount);
+		std::vector<void*> WorkerArgs(_ThreadCount - 1);
+		for (unsigned i = 1; i < _ThreadCount; ++i)
+		{
+			_WorkerInfos[i] = { this, i };
+			WorkerArgs[i - 1] = &_WorkerInfos[i];
+		}
+		Success = _Workers.Start(_Affinity, _ThreadCount - 1, &SortWorker, WorkerArgs.data());
+	}
+
+	// The pass barrier and histograms only change when the number of threads sorting does
+	const unsigned WorkerCount = _Workers._Running ? _Workers._WorkerCount + 1 : 1;
+	if (!_PassBarrierReady || WorkerCount != _WorkerCount)
+	{
+		if (_PassBarrierReady)
+		{
+			pthread_barrier_destroy(&_PassBarrier);
+		}
+		pthread_barrier_init(&_PassBarrier, NULL, WorkerCount);
+		_PassBarrierReady = true;
+		_WorkerCount = WorkerCount;
+		_Histograms.assign(static_cast<size_t>(_WorkerCount) * _RadixSize, 0);
+	}
+
+	// Wake the helpers, the calling thread sorts the first chunk
+	if (_Workers._Running)
+	{
+		pthread_barrier_wait(&_Workers._FrameStartBarrier);
+	}
+	SortChunk(0);
+	if (_Workers._Running)
+	{
+		pthread_barrier_wait(&_Workers._FrameEndBarrier);
+	}
+
+	return Success;
+}
+
+const MortonKey* MortonSorter::GetSortedKeys() const
+{
+	return _SortedKeys;
+}
+
+size_t MortonSorter::GetKeyCount() const
+{
+	return _Keys.size();
+}
+
+unsigned MortonSorter::GetChildIndex(uint32_t Key, int Depth)
+{
+	return (Key >> (30 - 2 * Depth)) & 3u;
+}
+
+float MortonSorter::GetSideX(uint32_t Column) const
+{
+	return Column >= (1u << _MaxDepth) ? _r : _l + static_cast<float>(Column) * _SideWidth;
+}
+
+float MortonSorter::GetSideY(uint32_t Row) const
+{
+	return Row >= (1u << _MaxDepth) ? _b : _t + static_cast<float>(Row) * _SideHeight;
+}
+
+uint32_t MortonSorter::SpreadBits(uint32_t Value)
+{
+	Value &= 0x0000FFFF;
+	Value = (Value | (Value << 8)) & 0x00FF00FF;
+	Value = (Value | (Value << 4)) & 0x0F0F0F0F;
+	Value = (Value | (Value << 2)) & 0x33333333;
+	Value = (Value | (Value << 1)) & 0x55555555;
+	return Value;
+}
+
+void* MortonSorter::SortWorker(void* inData)
+{
+	WorkerInfo* Info = (WorkerInfo*)inData;
+	MortonSorter* ThisSorter = Info->_Sorter;
+	ParkedWorkerGroup& Workers = ThisSorter->_Workers;
+
+	Workers.WaitForStartGate();
+
+	// Stay parked until a sort wakes the helpers
+	for (;;)
+	{
+		pthread_barrier_wait(&Workers._FrameStartBarrier);
+		if (Workers._Stopping)
+		{
+			break;
+		}
+
+		ThisSorter->SortChunk(Info->_ThreadID);
+
+		pthread_barrier_wait(&Workers._FrameEndBarrier);
+	}
+	return nullptr;
+}
+
+void MortonSorter::SortChunk(unsigned ThreadID)
+{
+	const unsigned WorkerCount = _WorkerCount;
+	const size_t KeyCount = _Keys.size();
+	const size_t Begin = KeyCount * ThreadID / WorkerCount;
+	const size_t End = KeyCount * (ThreadID + 1) / WorkerCount;
+
+	// Compute the keys for this chunk, the x axis goes in the even bits and y in the odd bits
+	// so each 2 bit digit is a child index with x selecting left/right and y selecting top/bottom
+	const float* PosX = _ParticleContainer->_PosX;
+	const float* PosY = _ParticleContainer->_PosY;
+	MortonKey* Keys = _Keys.data();
+	const uint32_t LastSide = (1u << _MaxDepth) - 1u;
+	for (size_t i = Begin; i < End; ++i)
+	{
+		const float PositionX = *(PosX + i);
+		const float PositionY = *(PosY + i);
+		float x = (PositionX - _l) * _ScaleX;
+		float y = (PositionY - _t) * _ScaleY;
+
+		// Clamp anything outside the bounds onto the edge quads
+		x = x < 0.f ? 0.f : (x > 65535.f ? 65535.f : x);
+		y = y < 0.f ? 0.f : (y > 65535.f ? 65535.f : y);
+
+		// Scaling rounds differently to the tree's sides, so a position just next to a side can land
+		// in the column or row over it. Move it to the one whose sides hold it by the tree's own
+		// comparisons, every side higher up is one of these sides so each level of the key then
+		// agrees with the x >= MidX and y >= MidY tests of sorting
+		uint32_t Column = static_cast<uint32_t>(x);
+		uint32_t Row = static_cast<uint32_t>(y);
+		while (Column > 0 && PositionX < GetSideX(Column)) { --Column; }
+		while (Column < LastSide && PositionX >= GetSideX(Column + 1u)) { ++Column; }
+		while (Row > 0 && PositionY < GetSideY(Row)) { --Row; }
+		while (Row < LastSide && PositionY >= GetSideY(Row + 1u)) { ++Row; }
+
+		Keys[i]._Key = SpreadBits(Column) | (SpreadBits(Row) << 1);
+		Keys[i]._Index = static_cast<uint32_t>(i);
+	}
+
+	MortonKey* Source = Keys;
+	MortonKey* Destination = _ScratchKeys.data();
+	size_t* Histogram = _Histograms.data() + static_cast<size_t>(ThreadID) * _RadixSize;
+
+	for (unsigned Pass = 0; Pass < _PassCount; ++Pass)
+	{
+		const unsigned Shift = Pass * _RadixBits;
+
+		// Count the digits in this chunk
+		for (unsigned d = 0; d < _RadixSize; ++d)
+		{
+			Histogram[d] = 0;
+		}
+		for (size_t i = Begin; i < End; ++i)
+		{
+			++Histogram[(Source[i]._Key >> Shift) & (_RadixSize - 1)];
+		}
+
+		pthread_barrier_wait(&_PassBarrier);
+
+		// Work out where this chunk scatters each digit to, every worker makes the
+		// same decision about skipping a pass where all keys share the digit
+		size_t Offsets[_RadixSize];
+		size_t DigitStart = 0;
+		bool SkipPass = false;
+		for (unsigned d = 0; d < _RadixSize; ++d)
+		{
+			size_t DigitTotal = 0;
+			size_t BeforeThisChunk = 0;
+			for (unsigned w = 0; w < WorkerCount; ++w)
+			{
+				const size_t Count = _Histograms[static_cast<size_t>(w) * _RadixSize + d];
+				if (w < ThreadID)
+				{
+					BeforeThisChunk += Count;
+				}
+				DigitTotal += Count;
+			}
+			SkipPass |= DigitTotal == KeyCount;
+			Offsets[d] = DigitStart + BeforeThisChunk;
+			DigitStart += DigitTotal;
+		}
+
+		if (!SkipPass)
+		{
+			for (size_t i = Begin; i < End; ++i)
+			{
+				Destination[Offsets[(Source[i]._Key >> Shift) & (_RadixSize - 1)]++] = Source[i];
+			}
+		}
+
+		// Wait for every chunk to scatter before the histograms are reused
+		pthread_barrier_wait(&_PassBarrier);
+
+		if (!SkipPass)
+		{
+			std::swap(Source, Destination);
+		}
+	}
+
+	if (ThreadID == 0)
+	{
+		_SortedKeys = Source;
+	}
+}
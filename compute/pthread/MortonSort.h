@@ -0,0 +1,108 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+#include "Particle.h"
+#include "ThreadAffinity.h"
+#include "ParkedWorkerGroup.h"
+
+#define __PTW32_STATIC_LIB
+#include "pthread.h"
+
+// Morton (Z-order) key of a particle and the index of the particle it was made from
+struct MortonKey
+{
+	uint32_t _Key;
+	uint32_t _Index;
+};
+
+// Computes Morton keys from particle positions and sorts them with a parallel LSD radix sort,
+// so particles in the same quad end up next to each other sharing a key prefix
+class MortonSorter
+{
+public:
+	MortonSorter() = delete;
+
+	// Create a sorter that splits its work over the given number of threads
+	MortonSorter(unsigned ThreadCount);
+
+	// Stops the helper threads
+	~MortonSorter();
+
+	// Where the helper threads are placed, helper i runs in slot i of the policy. Helpers running now
+	// are stopped and start again on their new CPUs the next time Sort is called
+	void SetAffinity(const ThreadAffinity& Affinity);
+
+	// Compute keys for every particle inside the given bounds and sort them. Helper threads are started by
+	// the first sort and stay parked between sorts, returns false if some of them failed to start
+	bool Sort(const Particles* ParticleContainer, float l, float t, float r, float b);
+
+	// Keys sorted by the last call to Sort
+	const MortonKey* GetSortedKeys() const;
+
+	size_t GetKeyCount() const;
+
+	// Has the helper threads exit, returns false if any of them couldn't be joined. Sort starts them again
+	bool StopWorkers();
+
+	// Two key bits per quad level, so keys can describe quads down to this depth
+	static const unsigned _MaxDepth = 16;
+
+	// Returns the 2 bit child quad index of a key at the given depth, matching the child order of Quad
+	static unsigned GetChildIndex(uint32_t Key, int Depth);
+
+private:
+	// Number of bits sorted per radix pass
+	static const unsigned _RadixBits = 8;
+	static const unsigned _RadixSize = 1u << _RadixBits;
+	static const unsigned _PassCount = 32 / _RadixBits;
+
+	struct WorkerInfo
+	{
+		MortonSorter* _Sorter;
+		unsigned _ThreadID;
+	};
+
+	// Static function for the helper threads to run, sorts a chunk of particles every time they are woken
+	static void* SortWorker(void* inData);
+
+	// Computes the keys of one worker's chunk of particles and takes it through every radix pass
+	void SortChunk(unsigned ThreadID);
+
+	// Position of the left side of a column and the top side of a row at _MaxDepth, worked out the same
+	// way as QuadTree so keys split particles exactly where sorting does
+	float GetSideX(uint32_t Column) const;
+	float GetSideY(uint32_t Row) const;
+
+	// Spreads the lower 16 bits of a value out into the even bits
+	static uint32_t SpreadBits(uint32_t Value);
+
+	const unsigned _ThreadCount;
+
+	// Key buffers, sorting ping-pongs between the two
+	std::vector<MortonKey> _Keys;
+	std::vector<MortonKey> _ScratchKeys;
+	MortonKey* _SortedKeys = nullptr;
+
+	// One histogram of radix digit counts per thread
+	std::vector<size_t> _Histograms;
+
+	std::vector<WorkerInfo> _WorkerInfos;
+	ThreadAffinity _Affinity;
+
+	// Helper threads, the calling thread sorts the first chunk
+	ParkedWorkerGroup _Workers;
+
+	// Number of threads sorting, helpers that started plus the calling thread
+	unsigned _WorkerCount = 1;
+
+	// Barrier to keep workers on the same radix pass, set up for _WorkerCount threads
+	pthread_barrier_t _PassBarrier;
+	bool _PassBarrierReady = false;
+
+	// Data for the sort currently in progress
+	const Particles* _ParticleContainer = nullptr;
+	float _l, _t, _r, _b, _ScaleX, _ScaleY;
+
+	// Width and height of a column and row at _MaxDepth
+	float _SideWidth, _SideHeight;
+};
@@ -0,0 +1,83 @@
+#include "ParkedWorkerGroup.h"
+
+bool ParkedWorkerGroup::Start(const ThreadAffinity& Affinity, unsigned Count, void*(*WorkerFunc)(void*), void* const* WorkerArgs)
+{
+	pthread_mutex_init(&_StartGate_mutex, NULL);
+	pthread_cond_init(&_StartGate, NULL);
+	_GateOpen = false;
+	_Stopping = false;
+
+	// Workers wait at the start gate until the barriers are set up for the threads that actually started
+	_Threads.resize(Count);
+	unsigned StartedThreads = 0;
+	for (; StartedThreads < Count; ++StartedThreads)
+	{
+		if (Affinity.CreateThread(&_Threads[StartedThreads], WorkerFunc, WorkerArgs[StartedThreads], StartedThreads + 1))
+		{
+			break;
+		}
+	}
+	_Threads.resize(StartedThreads);
+	_WorkerCount = StartedThreads;
+
+	pthread_barrier_init(&_FrameStartBarrier, NULL, StartedThreads + 1);
+	pthread_barrier_init(&_FrameEndBarrier, NULL, StartedThreads + 1);
+	_Running = true;
+
+	pthread_mutex_lock(&_StartGate_mutex);
+	_GateOpen = true;
+	pthread_cond_broadcast(&_StartGate);
+	pthread_mutex_unlock(&_StartGate_mutex);
+
+	// A group without workers can't sort anything
+	if (StartedThreads == 0)
+	{
+		Stop();
+	}
+	return StartedThreads == Count;
+}
+
+void ParkedWorkerGroup::Run()
+{
+	pthread_barrier_wait(&_FrameStartBarrier);
+	pthread_barrier_wait(&_FrameEndBarrier);
+}
+
+bool ParkedWorkerGroup::Stop()
+{
+	if (!_Running)
+	{
+		return true;
+	}
+
+	// Wake the workers with the stop flag set so they exit instead of sorting
+	_Stopping = true;
+	pthread_barrier_wait(&_FrameStartBarrier);
+
+	bool Joined = true;
+	for (pthread_t& Thread : _Threads)
+	{
+		if (pthread_join(Thread, NULL))
+		{
+			Joined = false;
+		}
+	}
+	_Threads.clear();
+
+	pthread_barrier_destroy(&_FrameStartBarrier);
+	pthread_barrier_destroy(&_FrameEndBarrier);
+	pthread_mutex_destroy(&_StartGate_mutex);
+	pthread_cond_destroy(&_StartGate);
+	_Running = false;
+	return Joined;
+}
+
+void ParkedWorkerGroup::WaitForStartGate()
+{
+	pthread_mutex_lock(&_StartGate_mutex);
+	while (!_GateOpen)
+	{
+		pthread_cond_wait(&_StartGate, &_StartGate_mutex);
+	}
+	pthread_mutex_unlock(&_StartGate_mutex);
+}
@@ -0,0 +1,43 @@
+#pragma once
+#include <vector>
+#include "ThreadAffinity.h"
+
+#define __PTW32_STATIC_LIB
+#include "pthread.h"
+
+// Threads kept parked between sorts. Each sort wakes them at the frame start barrier and waits for them
+// at the frame end barrier, so threads are only created the first time they are needed. A worker calls
+// WaitForStartGate once, then loops waiting at the frame start barrier, exiting if _Stopping is set and
+// otherwise doing its part of the sort before waiting at the frame end barrier
+struct ParkedWorkerGroup
+{
+	// Creates Count workers running WorkerFunc, worker i is passed WorkerArgs[i] and placed in slot i + 1 of
+	// the policy. Returns false if not every worker started, the group still runs with the ones that did
+	bool Start(const ThreadAffinity& Affinity, unsigned Count, void*(*WorkerFunc)(void*), void* const* WorkerArgs);
+
+	// Wakes the workers for one sort and waits for all of them to finish
+	void Run();
+
+	// Has the workers exit and joins them, returns false if any of them couldn't be joined
+	bool Stop();
+
+	// Blocks a worker until every worker of its group has been created
+	void WaitForStartGate();
+
+	std::vector<pthread_t> _Threads;
+
+	// Workers wait at the start gate until the number of threads that actually started is known
+	pthread_mutex_t _StartGate_mutex;
+	pthread_cond_t _StartGate;
+	bool _GateOpen = false;
+
+	pthread_barrier_t _FrameStartBarrier;
+	pthread_barrier_t _FrameEndBarrier;
+
+	// Number of workers that started, the sorting thread also waits at the barriers
+	unsigned _WorkerCount = 0;
+	bool _Running = false;
+
+	// Set before waking the workers to have them exit instead of sorting
+	bool _Stopping = false;
+};
@@ -1,7 +1,6 @@
 #pragma once
 
 #include <cstdlib>
-#include <time.h>
 
 struct Particles
 {
@@ -14,13 +13,74 @@ struct Particles
 		_ParticleRadius(ParticleRadius), _ParticleDiameter(_ParticleRadius*2), _XVel(xVel), _YVel(yVel)
 	{}
 
-	// Move all particles to a random location within the provided range
-	void RandomiseLocationsInRange(int MinX, int MaxX, int MinY, int MaxY)
+	// Particle memory is owned by the container, so it can't be copied
+	Particles(const Particles&) = delete;
+	Particles& operator=(const Particles&) = delete;
+
+	~Particles()
+	{
+		free(_PosX);
+		free(_PosY);
+	}
+
+	// Moves the positions into new memory owned by the container. FillPositions is handed the new arrays and
+	// copies every position into them, so it decides which threads first touch each page and with that which
+	// NUMA node the pages end up on. Returns false, leaving the positions where they were, if the memory
+	// couldn't be allocated. Pointers to the old position arrays are no longer valid afterwards
+	bool PlacePositions(void(*FillPositions)(const Particles& Source, float* PosX, float* PosY, void* Context), void* Context)
 	{
+		// New memory is allocated before the old is freed so none of the old pages can be handed back
+		float* PosX = (float*)malloc(_MaxParticles * sizeof(float));
+		float* PosY = (float*)malloc(_MaxParticles * sizeof(float));
+		if (!PosX || !PosY)
+		{
+			free(PosX);
+			free(PosY);
+			return false;
+		}
+
+		FillPositions(*this, PosX, PosY, Context);
+
+		free(_PosX);
+		free(_PosY);
+		_PosX = PosX;
+		_PosY = PosY;
+		return true;
+	}
+
+	// Move all particles by their velocity on the CPU, wrapping around the borders
+	// the same way vulkan_compute_particles.comp does on the GPU
+	void AdvancePositions(float DeltaTime, float LeftBorder, float RightBorder, float TopBorder, float BottomBorder)
+	{
+		const float DeltaX = _XVel * DeltaTime;
+		const float DeltaY = _YVel * DeltaTime;
+
 		for (size_t i = 0; i < _MaxParticles; ++i)
 		{
-			*(_PosX + i) = static_cast<float>(rand() % (MaxX - MinX) + MinX);
-			*(_PosY + i) = static_cast<float>(rand() % (MaxY - MinY) + MinY);
+			float x = *(_PosX + i) + DeltaX;
+			float y = *(_PosY + i) + DeltaY;
+
+			// Shift particles if they go out of bounds
+			if (x < LeftBorder)
+			{
+				x = RightBorder + (x - LeftBorder);
+			}
+			else if (x > RightBorder)
+			{
+				x = LeftBorder + (x - RightBorder);
+			}
+
+			if (y > BottomBorder)
+			{
+				y = TopBorder + (y - BottomBorder);
+			}
+			else if (y < TopBorder)
+			{
+				y = BottomBorder + (y - TopBorder);
+			}
+
+			*(_PosX + i) = x;
+			*(_PosY + i) = y;
 		}
 	}
 
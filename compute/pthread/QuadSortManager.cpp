@@ -1,21 +1,33 @@
 #include "QuadSortManager.h"
 #include "../../Logging.h"
-#include "imgui.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <numeric>
 
 
 QuadSortManager::QuadSortManager(unsigned int ThreadCount, ThreadingApproach InitialThreadingApproach,
     Particles* ParticleContainer, size_t QuadCapacity,
     float l, float t, float r, float b)
-    : _TopQuad(nullptr), _ThreadCount(ThreadCount), _CurrentThreadingApproach(InitialThreadingApproach),
-    _QuadQueue_mutex(), _ThreadPool(ThreadCount), _QueueThreads(ThreadCount),
-    _FlatFourThreads()
+    : _Tree(ParticleContainer, &_QuadPool, QuadCapacity, l, t, r, b), _ThreadCount(ThreadCount), _CurrentThreadingApproach(InitialThreadingApproach),
+    _QuadQueue_mutex(), _ThreadPool(ThreadCount), _QueueWorkers(),
+    _FlatFourWorkers(), _PartitionWorkers(), _MortonSorter(ThreadCount), _Affinity(), _AutoTuneApproach(InitialThreadingApproach), _UniformGrid(ThreadCount)
 {
-    _TopQuad = new Quad(ParticleContainer, nullptr, &_QuadPool, QuadCapacity, l,
-        t, r, b, true);
-
-    pthread_mutex_init(&_QuadPool_mutex, NULL);
     pthread_mutex_init(&_QuadQueue_mutex, NULL);
 
+    // Reserve enough quads for the particles up front
+    ReserveQuads(ParticleContainer->_MaxParticles);
+
+    // Start the index buffer off in particle order
+    _ParticleIndices.resize(ParticleContainer->_MaxParticles);
+    std::iota(_ParticleIndices.begin(), _ParticleIndices.end(), 0u);
+
+    // Autotuning picks from every approach that builds the quad tree unless told otherwise
+    _AutoTuneCandidates = { ThreadingApproach::NoThreading, ThreadingApproach::QueueThreading,
+        ThreadingApproach::FlatFourThreading, ThreadingApproach::StaticPartition, ThreadingApproach::ThreadPool,
+        ThreadingApproach::MortonRadixSort };
+
     // Initialise Flat Four Threading infos
     for (int i = 0; i < 4; ++i)
     {
@@ -23,9 +35,16 @@ QuadSortManager::QuadSortManager(unsigned int ThreadCount, ThreadingApproach Ini
         _FlatFourThreadInfos[i]._Manager = this;
     }
 
+    _PartitionThreadInfos.resize(std::max(_ThreadCount, 1u));
+    for (unsigned i = 0; i < _PartitionThreadInfos.size(); ++i)
+    {
+        _PartitionThreadInfos[i]._ThreadID = i;
+        _PartitionThreadInfos[i]._Manager = this;
+    }
+
     if(_CurrentThreadingApproach == ThreadingApproach::ThreadPool)
     {
-        if (!_ThreadPool.Initialise())
+        if (!StartThreadPool())
         {
             DBG_LOG_ASSERT(false, "QuadTreeThreading.cpp", "Failed to initialise threadpool");
         }
@@ -34,130 +53,236 @@ QuadSortManager::QuadSortManager(unsigned int ThreadCount, ThreadingApproach Ini
 
 QuadSortManager::~QuadSortManager()
 {
-    delete _TopQuad;
-    if (_CurrentThreadingApproach == ThreadingApproach::ThreadPool)
+    StopParkedWorkers(_QueueWorkers);
+    StopParkedWorkers(_FlatFourWorkers);
+    StopParkedWorkers(_PartitionWorkers);
+
+    if (_ThreadPoolRunning)
     {
-        _ThreadPool.StopThreads(false);
+        _ThreadPool.StopThreads(true);
     }
 }
 
 // Sort Function declaration for any Quad Tree Threading Implementation
 void QuadSortManager::SortParticles()
 {
+    // Incremental updates only break the few leaves particles moved into on this thread whatever the
+    // approach, so autotuning would time nothing but the odd rebuild and its switches would change nothing
+    if (_AutoTune && _IncrementalUpdate)
+    {
+        DBG_LOG("QuadSortManager.cpp", "Autotuning turned off, it can't time approaches while updating incrementally");
+        _AutoTune = false;
+    }
+
+    // Autotuning picks the approach for this sort
+    if (_AutoTune)
+    {
+        ChooseAutoTuneApproach();
+    }
+
     // Reset sort performance timer
     _SortPerformanceTimer.restart();
+    _AutoTuneTimer.restart();
+
+    // Update the last tree in place when it is kept, rebuilding once merges have dropped
+    // about as many quads as a tree holds so the pool doesn't keep growing
+    const bool UpdateIncrementally = _IncrementalUpdate && _CanUpdateTree
+        && _CurrentThreadingApproach != ThreadingApproach::UniformGrid
+        && _MergedQuadCount <= 4 * (_ParticleIndices.size() / _Tree._Capacity);
+
+    if (!UpdateIncrementally)
+    {
+        // Reset the quad pool to make all previosly allocated quads available
+        _QuadPool.Reset();
+        _Tree._TopQuad._ChildQuads = nullptr;
+        _MergedQuadCount = 0;
 
-    // Reset the quad pool to make all previosly allocated quads available
-    _QuadPool.Reset();
+        // The top quad holds every particle
+        _Tree._ObjectIndices = _ParticleIndices.data();
+        _Tree._TopQuad._FirstObject = 0;
+        _Tree._TopQuad._ObjectCount = static_cast<uint32_t>(_ParticleIndices.size());
+    }
 
     // Sort Particles based on the currently selected approach
-    if (_CurrentThreadingApproach == ThreadingApproach::NoThreading)
+    if (UpdateIncrementally)
+    {
+        UpdateTreeIncrementally();
+    }
+    else if (_CurrentThreadingApproach == ThreadingApproach::NoThreading)
     {
         // Check the Top Quad should be broken before pushing it to the quad queue
-        if (_TopQuad->ShouldBreak())
+        if (_Tree.ShouldBreak(&_Tree._TopQuad))
         {
-            _QuadQueue.push(_TopQuad);
+            _QuadQueue.push(&_Tree._TopQuad);
         }
 
-        // Loop until all Quads from the queue have been sorted
-        for (; !_QuadQueue.empty();)
-        {
-            // Get the quad from the front of the queue
-            Quad* CurrentQuad = _QuadQueue.front();
-            _QuadQueue.pop();
-
-            // Allocate child quads and then sort the quad
-            CurrentQuad->AllocateChildQuads();
-            CurrentQuad->SortChildQuads();
-
-            // Iterate through the 4 child quads
-            for (unsigned i = 0; i < 4; ++i)
-            {
-                // Only add child quads to the queue if they should be broken
-                if ((CurrentQuad->_ChildQuads + i)->ShouldBreak())
-                {
-                    _QuadQueue.push(CurrentQuad->_ChildQuads + i);
-                }
-            }
-        }
+        SortQueuedQuads();
     }
     else if (_CurrentThreadingApproach == ThreadingApproach::QueueThreading)
     {
         // Check the Top Quad should be broken before pushing it to the quad queue
-        if (_TopQuad->ShouldBreak())
+        if (_Tree.ShouldBreak(&_Tree._TopQuad))
         {
             // Break initial quad
-            _TopQuad->AllocateChildQuads();
-            _TopQuad->SortChildQuads();
+            _Tree.AllocateChildQuads(&_Tree._TopQuad);
+            _Tree.SortChildQuads(&_Tree._TopQuad);
             for (unsigned i = 0; i < 4; ++i)
             {
-                if ((_TopQuad->_ChildQuads + i)->ShouldBreak())
+                if (_Tree.ShouldBreak(_Tree._TopQuad._ChildQuads + i))
                 {
-                    _QuadQueue.push(_TopQuad->_ChildQuads + i);
+                    _QuadQueue.push(_Tree._TopQuad._ChildQuads + i);
                 }
             }
 
-            // Start up threads on sorting the quad tree
-            for (int i = 0; i < _ThreadCount; ++i)
+            // Threads are started the first time this approach sorts and stay parked between sorts
+            if (!_QueueWorkers._Running)
             {
-                if (pthread_create(&_QueueThreads[i], NULL, &QueueQuadSortWorker, this))
+                std::vector<void*> WorkerArgs(_ThreadCount, this);
+                if (!_QueueWorkers.Start(_Affinity, _ThreadCount, &QueueQuadSortWorker, WorkerArgs.data()))
                 {
                     DBG_LOG_ERROR("QuadSortManager.cpp", "Failed to create threads in Basic Queue Threading Approach!");
                 }
             }
 
-            // Wait for threads to finish
-            for (int i = 0; i < _ThreadCount; ++i)
+            // Wake the threads on sorting the quad tree, sorting on this thread if none of them started
+            if (_QueueWorkers._Running)
             {
-                if (pthread_join(_QueueThreads[i], NULL)) 
-                {
-                    DBG_LOG_ERROR("QuadSortManager.cpp", "Failed to join threads in Basic Queue Threading Approach!");
-                }
+                _QueueWorkers.Run();
+            }
+            else
+            {
+                SortQueuedQuads();
             }
         }
     }
     else if (_CurrentThreadingApproach == ThreadingApproach::FlatFourThreading)
     {
-        if (_TopQuad->ShouldBreak())
+        if (_Tree.ShouldBreak(&_Tree._TopQuad))
         {
-            pthread_mutex_init(&_QuadPool_mutex, NULL);
-
-            // Break initial quad
-            pthread_t threads[4];
-
             // Sort the top level quad into 4 child quads
-            _TopQuad->AllocateChildQuads();
-            _TopQuad->SortChildQuads();
+            _Tree.AllocateChildQuads(&_Tree._TopQuad);
+            _Tree.SortChildQuads(&_Tree._TopQuad);
 
-            // Start threads on sorting a quad each
-            for (unsigned i = 0; i < 4; ++i)
+            // Threads are started the first time this approach sorts and stay parked between sorts
+            if (!_FlatFourWorkers._Running)
+            {
+                void* WorkerArgs[4] = { _FlatFourThreadInfos, _FlatFourThreadInfos + 1, _FlatFourThreadInfos + 2, _FlatFourThreadInfos + 3 };
+                if (!_FlatFourWorkers.Start(_Affinity, 4, &FlatFourQuadSortWorker, WorkerArgs))
+                {
+                    DBG_LOG_ERROR("QuadSortManager.cpp", "Failed to create threads in Flat Four approach!");
+                }
+            }
+
+            // Wake the threads on sorting a quad each, sorting on this thread if none of them started
+            if (_FlatFourWorkers._Running)
+            {
+                _FlatFourWorkers.Run();
+            }
+            else
             {
-                if ((_TopQuad->_ChildQuads + i)->ShouldBreak())
+                for (unsigned i = 0; i < 4; ++i)
                 {
-                    if (pthread_create(&_FlatFourThreads[i], NULL, &FlatFourQuadSortWorker, _FlatFourThreadInfos+i))
+                    if (_Tree.ShouldBreak(_Tree._TopQuad._ChildQuads + i))
                     {
-                        DBG_LOG_ERROR("QuadSortManager.cpp", "Failed to create threads in Flat Four approach!");
+                        _QuadQueue.push(_Tree._TopQuad._ChildQuads + i);
                     }
                 }
+                SortQueuedQuads();
+            }
+        }
+    }
+    else if (_CurrentThreadingApproach == ThreadingApproach::StaticPartition)
+    {
+        if (_Tree.ShouldBreak(&_Tree._TopQuad) && SplitForStaticPartition())
+        {
+            // Threads are started the first time this approach sorts and stay parked between sorts
+            if (!_PartitionWorkers._Running)
+            {
+                std::vector<void*> WorkerArgs(_PartitionThreadInfos.size());
+                for (size_t i = 0; i < WorkerArgs.size(); ++i)
+                {
+                    WorkerArgs[i] = &_PartitionThreadInfos[i];
+                }
+                if (!_PartitionWorkers.Start(_Affinity, static_cast<unsigned>(WorkerArgs.size()), &StaticPartitionWorker, WorkerArgs.data()))
+                {
+                    DBG_LOG_ERROR("QuadSortManager.cpp", "Failed to create threads in Static Partition approach!");
+                }
             }
 
-            // Wait for threads to finish
-            for (unsigned i = 0; i < 4; ++i)
+            // Wake the threads on sorting their subtrees, sorting on this thread if none of them started
+            if (_PartitionWorkers._Running)
             {
-                if (pthread_join(_FlatFourThreads[i], NULL)) 
+                AssignPartitionSubtrees(_PartitionWorkers._WorkerCount);
+                _PartitionWorkers.Run();
+            }
+            else
+            {
+                for (Quad* Subtree : _PartitionSubtrees)
                 {
-                    DBG_LOG_ERROR("QuadSortManager.cpp", "Failed to join threads in Flat Four approach!"); 
+                    _QuadQueue.push(Subtree);
                 }
+                SortQueuedQuads();
             }
         }
     }
     else if(_CurrentThreadingApproach == ThreadingApproach::ThreadPool)
     {
-        ThreadPoolQuadSort(_TopQuad, this);
+        if (_Tree.ShouldBreak(&_Tree._TopQuad))
+        {
+            UpdateThreadPoolCutoff();
+            ThreadPoolQuadSort(&_Tree._TopQuad, this);
+
+            // Sleep until every job of the sort has been completed
+            _ThreadPoolSortLatch.Wait();
+        }
+    }
+    else if (_CurrentThreadingApproach == ThreadingApproach::MortonRadixSort)
+    {
+        if (_Tree.ShouldBreak(&_Tree._TopQuad))
+        {
+            // Sort the particles along the Z-order curve so every quad is a contiguous range of keys
+            if (!_MortonSorter.Sort(_Tree._ParticleContainer, _Tree._l, _Tree._t, _Tree._r, _Tree._b))
+            {
+                DBG_LOG_ERROR("QuadSortManager.cpp", "Failed to start all threads in Morton Radix Sort approach!");
+            }
+
+            // Lay the index buffer out in key order, so every quad's range of keys is also its range of indices
+            const MortonKey* SortedKeys = _MortonSorter.GetSortedKeys();
+            for (size_t i = 0; i < _ParticleIndices.size(); ++i)
+            {
+                _ParticleIndices[i] = SortedKeys[i]._Index;
+            }
+
+            BuildQuadFromMortonKeys(&_Tree._TopQuad, SortedKeys, 0, _MortonSorter.GetKeyCount());
+        }
+
+    }
+    else if (_CurrentThreadingApproach == ThreadingApproach::UniformGrid)
+    {
+        // Without a set cell size, size cells to hold about a quad's capacity of particles on average
+        float CellSize = _GridCellSize;
+        if (CellSize <= 0.f)
+        {
+            const float Area = _Tree._Width * _Tree._Height;
+            CellSize = std::sqrt(Area * _Tree._Capacity / std::max<size_t>(_ParticleIndices.size(), 1));
+        }
 
-        // Wait for threads to finish
-        _ThreadPool.WaitForAllThreads();
+        // The top quad is left as one leaf holding every particle
+        if (!_UniformGrid.Build(_Tree._ParticleContainer, CellSize, _Tree._l, _Tree._t, _Tree._r, _Tree._b))
+        {
+            DBG_LOG_ERROR("QuadSortManager.cpp", "Failed to start all threads in Uniform Grid approach!");
+        }
+    }
+
+    _HasTree = true;
 
+    // The UniformGrid approach leaves the top quad unbroken, so the next incremental update rebuilds
+    _CanUpdateTree = _CurrentThreadingApproach != ThreadingApproach::UniformGrid;
+
+    // Only full rebuilds say how fast an approach is
+    if (_AutoTune && !UpdateIncrementally)
+    {
+        RecordAutoTuneSample(_AutoTuneTimer.total_elapsed());
     }
 
     // Collect performance information
@@ -167,57 +292,263 @@ void QuadSortManager::SortParticles()
 
     _TotalSortTime += _SortTime;
     _AvgSortTime = _TotalSortTime / _SortCount;
+
+    // Snapshots are taken after timing so laying them out isn't counted as sorting
+    if (_SnapshotInterval > 0 && _SortCount % _SnapshotInterval == 0)
+    {
+        CaptureSnapshot(_SnapshotPrefix + std::to_string(_SortCount) + ".qsnap");
+    }
+}
+
+void QuadSortManager::SortQueuedQuads()
+{
+    // Loop until all Quads from the queue have been sorted
+    for (; !_QuadQueue.empty();)
+    {
+        // Get the quad from the front of the queue
+        Quad* CurrentQuad = _QuadQueue.front();
+        _QuadQueue.pop();
+
+        // Allocate child quads and then sort the quad
+        _Tree.AllocateChildQuads(CurrentQuad);
+        _Tree.SortChildQuads(CurrentQuad);
+
+        // Iterate through the 4 child quads
+        for (unsigned i = 0; i < 4; ++i)
+        {
+            // Only add child quads to the queue if they should be broken
+            if (_Tree.ShouldBreak(CurrentQuad->_ChildQuads + i))
+            {
+                _QuadQueue.push(CurrentQuad->_ChildQuads + i);
+            }
+        }
+    }
+}
+
+void QuadSortManager::UpdateTreeIncrementally()
+{
+    // Find every particle that left its leaf, most particles stay put between frames
+    _MovedParticles.clear();
+    _StayCounts.clear();
+    FindMovedParticles(&_Tree._TopQuad);
+
+    // Nothing changed leaf, so every count and range is still right. A top quad left unbroken
+    // may still need breaking though
+    if (_MovedParticles.empty())
+    {
+        if (!_Tree._TopQuad._ChildQuads && _Tree.ShouldBreak(&_Tree._TopQuad))
+        {
+            _QuadQueue.push(&_Tree._TopQuad);
+            SortQueuedQuads();
+        }
+        return;
+    }
+
+    // Leaves now count the particles that stayed plus the ones moving in
+    for (const MovedParticle& Moved : _MovedParticles)
+    {
+        ++Moved._Destination->_ObjectCount;
+    }
+
+    // Lay the particles that stayed out again in tree order, leaving a gap at the end of every
+    // leaf for the ones moving in
+    _NextParticleIndices.resize(_ParticleIndices.size());
+    size_t LeafIndex = 0;
+    RelayoutQuad(&_Tree._TopQuad, _NextParticleIndices.data(), LeafIndex);
+    _ParticleIndices.swap(_NextParticleIndices);
+    _Tree._ObjectIndices = _ParticleIndices.data();
+
+    // Fill the gaps, leaves count back up to their full size. Quads merged away still
+    // point at the right part of their parent's range
+    for (const MovedParticle& Moved : _MovedParticles)
+    {
+        Quad* Destination = Moved._Destination;
+        *(_Tree.GetObjectIndices(Destination) + Destination->_ObjectCount++) = Moved._Index;
+    }
+
+    // Break the leaves that have grown too full
+    SortQueuedQuads();
+}
+
+void QuadSortManager::FindMovedParticles(Quad* CurrentQuad)
+{
+    if (CurrentQuad->_ChildQuads)
+    {
+        for (unsigned i = 0; i < 4; ++i)
+        {
+            FindMovedParticles(CurrentQuad->_ChildQuads + i);
+        }
+        return;
+    }
+
+    const float* PosX = _Tree._ParticleContainer->_PosX;
+    const float* PosY = _Tree._ParticleContainer->_PosY;
+
+    // Particles that stay go to the front of the range, the leaf keeps only those for now
+    uint32_t* Begin = _Tree.GetObjectIndices(CurrentQuad);
+    uint32_t* End = Begin + CurrentQuad->_ObjectCount;
+    const QuadBounds Bounds = _Tree.GetBounds(CurrentQuad);
+    uint32_t* StayEnd = std::partition(Begin, End, [&Bounds, PosX, PosY](uint32_t Index)
+        {
+            return Bounds.Contains(*(PosX + Index), *(PosY + Index));
+        });
+
+    for (uint32_t* Moved = StayEnd; Moved != End; ++Moved)
+    {
+        _MovedParticles.push_back({ FindLeafQuad(CurrentQuad, *(PosX + *Moved), *(PosY + *Moved)), *Moved });
+    }
+
+    CurrentQuad->_ObjectCount = static_cast<uint32_t>(StayEnd - Begin);
+    _StayCounts.push_back(CurrentQuad->_ObjectCount);
+}
+
+Quad* QuadSortManager::FindLeafQuad(Quad* StartQuad, float x, float y) const
+{
+    // Go up to the lowest quad holding the position, the top quad holds everything
+    Quad* CurrentQuad = StartQuad;
+    while (CurrentQuad->_Depth > 0 && !_Tree.IsInsideQuad(CurrentQuad, x, y))
+    {
+        CurrentQuad = CurrentQuad->_ParentQuad;
+    }
+
+    // Then down to the leaf, choosing children the same way SortChildQuads does
+    while (CurrentQuad->_ChildQuads)
+    {
+        CurrentQuad = CurrentQuad->_ChildQuads + _Tree.GetChildIndex(CurrentQuad, x, y);
+    }
+    return CurrentQuad;
+}
+
+uint32_t* QuadSortManager::RelayoutQuad(Quad* CurrentQuad, uint32_t* Output, size_t& LeafIndex)
+{
+    uint32_t* const Begin = Output;
+    const uint32_t FirstObject = static_cast<uint32_t>(Begin - _NextParticleIndices.data());
+
+    if (CurrentQuad->_ChildQuads)
+    {
+        for (unsigned i = 0; i < 4; ++i)
+        {
+            Output = RelayoutQuad(CurrentQuad->_ChildQuads + i, Output, LeafIndex);
+        }
+
+        CurrentQuad->_FirstObject = FirstObject;
+        CurrentQuad->_ObjectCount = static_cast<uint32_t>(Output - Begin);
+
+        // Merge the child quads back in once they would no longer be broken, children merge first
+        // so they are all leaves by now
+        if (!_Tree.IsTooFull(CurrentQuad))
+        {
+            CurrentQuad->_ChildQuads = nullptr;
+            _MergedQuadCount += 4;
+        }
+        return Output;
+    }
+
+    // Leaves are visited in the same order FindMovedParticles counted them in
+    const uint32_t StayCount = _StayCounts[LeafIndex++];
+    const uint32_t FullCount = CurrentQuad->_ObjectCount;
+    const uint32_t* ObjectIndices = _Tree.GetObjectIndices(CurrentQuad);
+    std::copy(ObjectIndices, ObjectIndices + StayCount, Output);
+
+    // The count is where the particles moving in get written, and the breaking
+    // check needs the count the leaf will end up with
+    CurrentQuad->_FirstObject = FirstObject;
+    if (FullCount > _Tree._Capacity && _Tree.CanBreak(CurrentQuad))
+    {
+        _QuadQueue.push(CurrentQuad);
+    }
+    CurrentQuad->_ObjectCount = StayCount;
+
+    return Output + FullCount;
+}
+
+void QuadSortManager::StopParkedWorkers(ParkedWorkerGroup& Workers)
+{
+    if (!Workers.Stop())
+    {
+        DBG_LOG_ERROR("QuadSortManager.cpp", "Failed to join parked worker threads!");
+    }
+}
+
+void QuadSortManager::StopSorterWorkers(bool KeepCurrentApproach)
+{
+    const bool KeepMorton = KeepCurrentApproach && _CurrentThreadingApproach == ThreadingApproach::MortonRadixSort;
+    if (!KeepMorton && !_MortonSorter.StopWorkers())
+    {
+        DBG_LOG_ERROR("QuadSortManager.cpp", "Failed to join Morton Radix Sort threads!");
+    }
+
+    const bool KeepGrid = KeepCurrentApproach && _CurrentThreadingApproach == ThreadingApproach::UniformGrid;
+    if (!KeepGrid && !_UniformGrid.StopWorkers())
+    {
+        DBG_LOG_ERROR("QuadSortManager.cpp", "Failed to join Uniform Grid threads!");
+    }
 }
 
 // Worker function for any threaded Quad Tree implementation
 void* QuadSortManager::QueueQuadSortWorker(void* inData)
 {
     QuadSortManager* pQuadSortManager = (QuadSortManager*)inData;
+    ParkedWorkerGroup& Workers = pQuadSortManager->_QueueWorkers;
+
+    Workers.WaitForStartGate();
+
+    // Stay parked until a sort wakes the workers
+    for (;;)
+    {
+        pthread_barrier_wait(&Workers._FrameStartBarrier);
+        if (Workers._Stopping)
+        {
+            break;
+        }
+
+        pQuadSortManager->SortSharedQuadQueue();
+
+        pthread_barrier_wait(&Workers._FrameEndBarrier);
+    }
+    return nullptr;
+}
 
+void QuadSortManager::SortSharedQuadQueue()
+{
     bool Continue = true;
     Quad* CurrentQuad = nullptr;
 
     for (; Continue;)
     {
-        pthread_mutex_lock(&pQuadSortManager->_QuadQueue_mutex);
+        pthread_mutex_lock(&_QuadQueue_mutex);
 
-        Continue = !pQuadSortManager->_QuadQueue.empty();
+        Continue = !_QuadQueue.empty();
 
         if (Continue)
         {
-            CurrentQuad = pQuadSortManager->_QuadQueue.front();
-            pQuadSortManager->_QuadQueue.pop();
+            CurrentQuad = _QuadQueue.front();
+            _QuadQueue.pop();
         }
 
-        pthread_mutex_unlock(&pQuadSortManager->_QuadQueue_mutex);
+        pthread_mutex_unlock(&_QuadQueue_mutex);
 
         if (Continue)
         {
-            pthread_mutex_lock(&pQuadSortManager->_QuadPool_mutex);
-
-            if (!CurrentQuad->AllocateChildQuads())
+            if (!_Tree.AllocateChildQuads(CurrentQuad))
             {
-                pthread_mutex_unlock(&pQuadSortManager->_QuadPool_mutex);
                 DBG_LOG_ERROR("QuadSortManager.cpp", "Failed to allocate quads");
-                return nullptr;
+                return;
             }
 
-            pthread_mutex_unlock(&pQuadSortManager->_QuadPool_mutex);
-
-            CurrentQuad->SortChildQuads();
+            _Tree.SortChildQuads(CurrentQuad);
 
             for (unsigned i = 0; i < 4; ++i)
             {
-                if ((CurrentQuad->_ChildQuads + i)->ShouldBreak())
+                if (_Tree.ShouldBreak(CurrentQuad->_ChildQuads + i))
                 {
-                    pthread_mutex_lock(&pQuadSortManager->_QuadQueue_mutex);
-                    pQuadSortManager->_QuadQueue.push(CurrentQuad->_ChildQuads + i);
-                    pthread_mutex_unlock(&pQuadSortManager->_QuadQueue_mutex);
+                    pthread_mutex_lock(&_QuadQueue_mutex);
+                    _QuadQueue.push(CurrentQuad->_ChildQuads + i);
+                    pthread_mutex_unlock(&_QuadQueue_mutex);
                 }
             }
         }
     }
-    return nullptr;
 }
 
 // Worker function for any threaded Quad Tree implementation
@@ -226,128 +557,1046 @@ void* QuadSortManager::FlatFourQuadSortWorker(void* inData)
     FlatFourThreadInfo* ThreadInfo = (FlatFourThreadInfo*)inData;
 
     QuadSortManager* ThisManager = ThreadInfo->_Manager;
+    ParkedWorkerGroup& Workers = ThisManager->_FlatFourWorkers;
 
-    // Get the quad this thread should start with from the manager
-    Quad* StartQuad = ThisManager->_TopQuad->_ChildQuads + ThreadInfo->_ThreadID;
-
-    std::queue<Quad*> QuadQueue;
-    QuadQueue.push(StartQuad);
+    Workers.WaitForStartGate();
 
-    for (; !QuadQueue.empty();)
+    // Stay parked until a sort wakes the workers
+    for (;;)
     {
-        Quad* CurrentQuad = QuadQueue.front();
-        QuadQueue.pop();
-
-        pthread_mutex_lock(&ThisManager->_QuadPool_mutex);
+        pthread_barrier_wait(&Workers._FrameStartBarrier);
+        if (Workers._Stopping)
+        {
+            break;
+        }
 
-        if (!CurrentQuad->AllocateChildQuads())
+        // Each thread starts with its own child quad of the top quad, taking every
+        // WorkerCount'th one instead if fewer than four threads started
+        std::queue<Quad*> QuadQueue;
+        for (unsigned i = ThreadInfo->_ThreadID; i < 4; i += Workers._WorkerCount)
         {
-            pthread_mutex_unlock(&ThisManager->_QuadPool_mutex);
-            DBG_LOG_ERROR("QuadSortManager.cpp", "Failed to allocate quads");
-            return nullptr;
+            if (ThisManager->_Tree.ShouldBreak(ThisManager->_Tree._TopQuad._ChildQuads + i))
+            {
+                QuadQueue.push(ThisManager->_Tree._TopQuad._ChildQuads + i);
+            }
         }
 
-        pthread_mutex_unlock(&ThisManager->_QuadPool_mutex);
+        for (; !QuadQueue.empty();)
+        {
+            Quad* CurrentQuad = QuadQueue.front();
+            QuadQueue.pop();
 
-        CurrentQuad->SortChildQuads();
+            if (!ThisManager->_Tree.AllocateChildQuads(CurrentQuad))
+            {
+                DBG_LOG_ERROR("QuadSortManager.cpp", "Failed to allocate quads");
+                break;
+            }
 
-        for (unsigned i = 0; i < 4; ++i)
-        {
-            if ((CurrentQuad->_ChildQuads + i)->ShouldBreak())
+            ThisManager->_Tree.SortChildQuads(CurrentQuad);
+
+            for (unsigned i = 0; i < 4; ++i)
             {
-                QuadQueue.push(CurrentQuad->_ChildQuads + i);
+                if (ThisManager->_Tree.ShouldBreak(CurrentQuad->_ChildQuads + i))
+                {
+                    QuadQueue.push(CurrentQuad->_ChildQuads + i);
+                }
             }
         }
+
+        pthread_barrier_wait(&Workers._FrameEndBarrier);
     }
     return nullptr;
 }
 
-// Worker function for any threaded Quad Tree implementation
-void QuadSortManager::ThreadPoolQuadSort(void* inData, void* inContext)
+bool QuadSortManager::SplitForStaticPartition()
 {
-    //QuadSortWorkerData*
-    Quad* CurrentQuad = (Quad*)inData;
-    QuadSortManager* ThisManager = (QuadSortManager*)inContext;
-
-    pthread_mutex_lock(&ThisManager->_QuadPool_mutex);
-
-    if (!CurrentQuad->AllocateChildQuads())
-    {
-        DBG_LOG_ERROR("QuadTreeThreading.cpp", "Failed to allocate quads!");
-    }
+    const unsigned Depth = GetPartitionDepth();
 
-    pthread_mutex_unlock(&ThisManager->_QuadPool_mutex);
-
-    CurrentQuad->SortChildQuads();
-
-    for (unsigned i = 0; i < 4; ++i)
+    // Break the tree a level at a time, quads that don't need breaking are finished leaves
+    _PartitionSubtrees.assign(1, &_Tree._TopQuad);
+    for (unsigned Level = 0; Level < Depth && !_PartitionSubtrees.empty(); ++Level)
     {
-        if ((CurrentQuad->_ChildQuads + i)->ShouldBreak())
+        _PartitionNextLevel.clear();
+        for (Quad* CurrentQuad : _PartitionSubtrees)
         {
-            // Acquire an empty job from the thread pool
-            JobTwoParams* NewJob = ThisManager->_ThreadPool.GetFreeJob_TwoParams();
-            // Fill in the Job data
-            NewJob->_FuncPtr = &QuadSortManager::ThreadPoolQuadSort;
-            NewJob->_Param1 = CurrentQuad->_ChildQuads + i;
-            NewJob->_Param2 = ThisManager;
+            if (!_Tree.AllocateChildQuads(CurrentQuad))
+            {
+                DBG_LOG_ERROR("QuadSortManager.cpp", "Failed to allocate quads");
+                return false;
+            }
 
-            // Pass the Job to the threadpool
-            ThisManager->_ThreadPool.AddWork(NewJob);
+            _Tree.SortChildQuads(CurrentQuad);
+
+            for (unsigned i = 0; i < 4; ++i)
+            {
+                if (_Tree.ShouldBreak(CurrentQuad->_ChildQuads + i))
+                {
+                    _PartitionNextLevel.push_back(CurrentQuad->_ChildQuads + i);
+                }
+            }
         }
+        _PartitionSubtrees.swap(_PartitionNextLevel);
     }
+    return true;
 }
 
-
-// End anything Quad Tree Threading related at end of the program
-void QuadSortManager::EndQuadTreeThreading()
+void QuadSortManager::AssignPartitionSubtrees(unsigned WorkerCount)
 {
-    if (_CurrentThreadingApproach == ThreadingApproach::ThreadPool)
+    // Particle count stands in for the work of sorting a subtree
+    std::sort(_PartitionSubtrees.begin(), _PartitionSubtrees.end(),
+        [](const Quad* A, const Quad* B) { return A->_ObjectCount > B->_ObjectCount; });
+
+    _PartitionAssignments.resize(WorkerCount);
+    for (std::vector<Quad*>& Assignment : _PartitionAssignments)
     {
-        _ThreadPool.StopThreads(false);
+        Assignment.clear();
+    }
+    _PartitionLoads.assign(WorkerCount, 0);
+
+    for (Quad* Subtree : _PartitionSubtrees)
+    {
+        const size_t Worker = std::min_element(_PartitionLoads.begin(), _PartitionLoads.end()) - _PartitionLoads.begin();
+        _PartitionAssignments[Worker].push_back(Subtree);
+        _PartitionLoads[Worker] += Subtree->_ObjectCount;
     }
 }
 
-void QuadSortManager::SwapThreadingApproach(ThreadingApproach NewThreadingApproach)
+void QuadSortManager::SetPartitionDepth(unsigned Depth)
 {
-    if (NewThreadingApproach == _CurrentThreadingApproach)
+    _PartitionDepth = std::min(Depth, _MaxPartitionDepth);
+}
+
+unsigned QuadSortManager::GetPartitionDepth() const
+{
+    if (_PartitionDepth > 0)
     {
-        return;
+        return _PartitionDepth;
     }
 
-    // Safely eject from using a Thread Pool
-    if (_CurrentThreadingApproach == ThreadingApproach::ThreadPool)
+    // Enough levels for at least two subtrees per thread, so one busy subtree doesn't leave the others idle
+    unsigned Depth = 1;
+    while (Depth < _MaxPartitionDepth && (1u << (2 * Depth)) < 2 * _ThreadCount)
     {
-        _ThreadPool.StopThreads(true);
+        ++Depth;
     }
+    return Depth;
+}
 
-    // Set the current threading approach
-    _CurrentThreadingApproach = NewThreadingApproach;
+// Worker function for any threaded Quad Tree implementation
+void* QuadSortManager::StaticPartitionWorker(void* inData)
+{
+    PartitionThreadInfo* ThreadInfo = (PartitionThreadInfo*)inData;
 
-    // Initialise new threading approach if needed
+    QuadSortManager* ThisManager = ThreadInfo->_Manager;
+    ParkedWorkerGroup& Workers = ThisManager->_PartitionWorkers;
 
-    if (_CurrentThreadingApproach == ThreadingApproach::ThreadPool)
+    Workers.WaitForStartGate();
+
+    // Stay parked until a sort wakes the workers
+    std::vector<Quad*> QuadStack;
+    for (;;)
     {
-        if (!_ThreadPool.Initialise())
+        pthread_barrier_wait(&Workers._FrameStartBarrier);
+        if (Workers._Stopping)
         {
-            DBG_LOG_ASSERT(false, "QuadSortManager.cpp", "Thread Pool failed to initialise!");
+            break;
         }
-    }
 
+        // Only this thread touches its subtrees, so no locking is needed
+        const std::vector<Quad*>& Assignment = ThisManager->_PartitionAssignments[ThreadInfo->_ThreadID];
+        QuadStack.assign(Assignment.begin(), Assignment.end());
+        for (; !QuadStack.empty();)
+        {
+            Quad* CurrentQuad = QuadStack.back();
+            QuadStack.pop_back();
+
+            if (!ThisManager->_Tree.AllocateChildQuads(CurrentQuad))
+            {
+                DBG_LOG_ERROR("QuadSortManager.cpp", "Failed to allocate quads");
+                break;
+            }
+
+            ThisManager->_Tree.SortChildQuads(CurrentQuad);
+
+            for (unsigned i = 0; i < 4; ++i)
+            {
+                if (ThisManager->_Tree.ShouldBreak(CurrentQuad->_ChildQuads + i))
+                {
+                    QuadStack.push_back(CurrentQuad->_ChildQuads + i);
+                }
+            }
+        }
+
+        pthread_barrier_wait(&Workers._FrameEndBarrier);
+    }
+    return nullptr;
+}
+
+// Worker function for any threaded Quad Tree implementation
+void QuadSortManager::ThreadPoolQuadSort(void* inData, void* inContext)
+{
+    //QuadSortWorkerData*
+    Quad* CurrentQuad = (Quad*)inData;
+    QuadSortManager* ThisManager = (QuadSortManager*)inContext;
+
+    if (!ThisManager->_Tree.AllocateChildQuads(CurrentQuad))
+    {
+        DBG_LOG_ERROR("QuadTreeThreading.cpp", "Failed to allocate quads!");
+        return;
+    }
+
+    // The top quad is broken on the sorting thread, timing it gives the cost of partitioning a particle
+    if (CurrentQuad->_Depth == 0)
+    {
+        ThisManager->_PartitionCostTimer.restart();
+        ThisManager->_Tree.SortChildQuads(CurrentQuad);
+        const double CostNs = static_cast<double>(ThisManager->_PartitionCostTimer.total_elapsed()) / std::max<uint32_t>(CurrentQuad->_ObjectCount, 1);
+        ThisManager->_PartitionCostNs = ThisManager->_PartitionCostNs > 0.0 ? 0.75 * ThisManager->_PartitionCostNs + 0.25 * CostNs : CostNs;
+    }
+    else
+    {
+        ThisManager->_Tree.SortChildQuads(CurrentQuad);
+    }
+
+    // Children above the cutoffs get jobs first so other threads can take them while this one works
+    bool SortHere[4] = { false, false, false, false };
+    for (unsigned i = 0; i < 4; ++i)
+    {
+        Quad* ChildQuad = CurrentQuad->_ChildQuads + i;
+        if (!ThisManager->_Tree.ShouldBreak(ChildQuad))
+        {
+            continue;
+        }
+
+        if (ChildQuad->_ObjectCount < ThisManager->_ThreadPoolCutoff
+            || (ThisManager->_ThreadPoolCutoffDepth >= 0 && ChildQuad->_Depth >= ThisManager->_ThreadPoolCutoffDepth))
+        {
+            SortHere[i] = true;
+            continue;
+        }
+
+        // Pass the child to the threadpool as part of this sort
+        ThisManager->_ThreadPool.Submit([ChildQuad, ThisManager]() { ThreadPoolQuadSort(ChildQuad, ThisManager); },
+            &ThisManager->_ThreadPoolSortLatch);
+    }
+
+    // Small subtrees cost less to sort here than to hand out
+    for (unsigned i = 0; i < 4; ++i)
+    {
+        if (SortHere[i] && !SortQuadInThread(ThisManager->_Tree, CurrentQuad->_ChildQuads + i))
+        {
+            DBG_LOG_ERROR("QuadTreeThreading.cpp", "Failed to allocate quads!");
+            return;
+        }
+    }
+}
+
+bool QuadSortManager::SortQuadInThread(const QuadTree& Tree, Quad* CurrentQuad)
+{
+    if (!Tree.AllocateChildQuads(CurrentQuad))
+    {
+        return false;
+    }
+
+    Tree.SortChildQuads(CurrentQuad);
+
+    for (unsigned i = 0; i < 4; ++i)
+    {
+        if (Tree.ShouldBreak(CurrentQuad->_ChildQuads + i) && !SortQuadInThread(Tree, CurrentQuad->_ChildQuads + i))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+void QuadSortManager::SetThreadPoolCutoff(size_t ParticleCount)
+{
+    _ThreadPoolCutoffSetting = ParticleCount;
+}
+
+void QuadSortManager::SetThreadPoolCutoffDepth(int Depth)
+{
+    _ThreadPoolCutoffDepth = Depth;
+}
+
+size_t QuadSortManager::GetThreadPoolCutoff() const
+{
+    return _ThreadPoolCutoff;
+}
+
+void QuadSortManager::UpdateThreadPoolCutoff()
+{
+    if (_ThreadPoolCutoffSetting > 0)
+    {
+        _ThreadPoolCutoff = _ThreadPoolCutoffSetting;
+        return;
+    }
+
+    // Until the first sort has been timed every quad gets a job
+    if (_ThreadPoolJobOverheadNs <= 0.0 || _PartitionCostNs <= 0.0)
+    {
+        _ThreadPoolCutoff = 0;
+        return;
+    }
+
+    // A job is worth it once partitioning its quad takes much longer than handing it out,
+    // but no bigger than leaves every thread a few jobs to balance with
+    const size_t OverheadCutoff = static_cast<size_t>(_CutoffOverheadRatio * _ThreadPoolJobOverheadNs / _PartitionCostNs);
+    const size_t BalanceCutoff = _ParticleIndices.size() / (static_cast<size_t>(std::max(_ThreadCount, 1u)) * _MinJobsPerThread);
+    _ThreadPoolCutoff = std::min(OverheadCutoff, BalanceCutoff);
+}
+
+void QuadSortManager::MeasureThreadPoolJobOverhead()
+{
+    // Jobs added from outside the pool take the slowest path, through the shared queue
+    const unsigned JobCount = 256;
+    JobLatch OverheadLatch;
+    Timer<resolutions::nanoseconds> OverheadTimer;
+    for (unsigned i = 0; i < JobCount; ++i)
+    {
+        _ThreadPool.Submit([]() {}, &OverheadLatch);
+    }
+    OverheadLatch.Wait();
+    _ThreadPoolJobOverheadNs = static_cast<double>(OverheadTimer.total_elapsed()) / JobCount;
+}
+
+void QuadSortManager::BuildQuadFromMortonKeys(Quad* CurrentQuad, const MortonKey* Keys, size_t Begin, size_t End)
+{
+    const int Depth = CurrentQuad->_Depth;
+
+    // The index buffer is in key order, so the quad's particles are the same range
+    CurrentQuad->_FirstObject = static_cast<uint32_t>(Begin);
+    CurrentQuad->_ObjectCount = static_cast<uint32_t>(End - Begin);
+
+    // Same rule as QuadTree::ShouldBreak, limited to the depth the keys can describe
+    const bool ShouldBreak = End - Begin > _Tree._Capacity && _Tree.CanBreak(CurrentQuad)
+        && Depth < static_cast<int>(MortonSorter::_MaxDepth);
+
+    if (ShouldBreak && _Tree.AllocateChildQuads(CurrentQuad))
+    {
+        _Tree.InitialiseChildQuads(CurrentQuad);
+
+        // Keys in this range share a prefix, so the next 2 bits split it into the child quads
+        size_t ChildBegin = Begin;
+        for (unsigned i = 0; i < 4; ++i)
+        {
+            size_t ChildEnd = ChildBegin;
+            if (i == 3)
+            {
+                ChildEnd = End;
+            }
+            else
+            {
+                ChildEnd = std::partition_point(Keys + ChildBegin, Keys + End, [Depth, i](const MortonKey& Key)
+                    {
+                        return MortonSorter::GetChildIndex(Key._Key, Depth) <= i;
+                    }) - Keys;
+            }
+
+            BuildQuadFromMortonKeys(CurrentQuad->_ChildQuads + i, Keys, ChildBegin, ChildEnd);
+            ChildBegin = ChildEnd;
+        }
+    }
+}
+
+// End anything Quad Tree Threading related at end of the program
+void QuadSortManager::EndQuadTreeThreading()
+{
+    StopParkedWorkers(_QueueWorkers);
+    StopParkedWorkers(_FlatFourWorkers);
+    StopParkedWorkers(_PartitionWorkers);
+    StopSorterWorkers(false);
+
+    if (_ThreadPoolRunning)
+    {
+        _ThreadPool.StopThreads(false);
+        _ThreadPoolRunning = false;
+    }
+}
+
+void QuadSortManager::SwapThreadingApproach(ThreadingApproach NewThreadingApproach)
+{
+    if (NewThreadingApproach == _CurrentThreadingApproach)
+    {
+        return;
+    }
+
+    // Park no threads for approaches that are no longer used
+    if (NewThreadingApproach != ThreadingApproach::QueueThreading)
+    {
+        StopParkedWorkers(_QueueWorkers);
+    }
+    if (NewThreadingApproach != ThreadingApproach::FlatFourThreading)
+    {
+        StopParkedWorkers(_FlatFourWorkers);
+    }
+    if (NewThreadingApproach != ThreadingApproach::StaticPartition)
+    {
+        StopParkedWorkers(_PartitionWorkers);
+    }
+
+    // Safely eject from using a Thread Pool
+    if (_ThreadPoolRunning)
+    {
+        _ThreadPool.StopThreads(true);
+        _ThreadPoolRunning = false;
+    }
+
+    // Set the current threading approach, the next sort rebuilds the tree with it
+    _CurrentThreadingApproach = NewThreadingApproach;
+    _CanUpdateTree = false;
+    StopSorterWorkers(true);
+
+    // Initialise new threading approach if needed
+
+    if (_CurrentThreadingApproach == ThreadingApproach::ThreadPool)
+    {
+        if (!StartThreadPool())
+        {
+            DBG_LOG_ASSERT(false, "QuadSortManager.cpp", "Thread Pool failed to initialise!");
+        }
+    }
+
+}
+
+ThreadingApproach QuadSortManager::GetCurrentThreadingApproach() const
+{
+    return _CurrentThreadingApproach;
+}
+
+void QuadSortManager::SetAutoTune(bool AutoTune)
+{
+    if (AutoTune && !_AutoTune)
+    {
+        // Start from fresh averages, sorting stays on the current approach until another is faster
+        for (AutoTuneStats& Stats : _AutoTuneStats)
+        {
+            Stats = AutoTuneStats();
+        }
+        _AutoTuneApproach = _CurrentThreadingApproach;
+        _FramesSinceAutoTuneSwitch = _AutoTuneMinFramesBetweenSwitches;
+    }
+    _AutoTune = AutoTune;
+}
+
+bool QuadSortManager::IsAutoTuning() const
+{
+    return _AutoTune;
+}
+
+void QuadSortManager::SetAutoTuneCandidates(const std::vector<ThreadingApproach>& Candidates)
+{
+    // Each approach is a candidate once, so timing turns always have another approach to move on to
+    _AutoTuneCandidates.clear();
+    for (ThreadingApproach Candidate : Candidates)
+    {
+        if (std::find(_AutoTuneCandidates.begin(), _AutoTuneCandidates.end(), Candidate) == _AutoTuneCandidates.end())
+        {
+            _AutoTuneCandidates.push_back(Candidate);
+        }
+    }
+    _AutoTuneTimedCandidate = 0;
+}
+
+void QuadSortManager::UseThreadingApproach(ThreadingApproach NewThreadingApproach)
+{
+    if (NewThreadingApproach == ThreadingApproach::ThreadPool && !StartThreadPool())
+    {
+        DBG_LOG_ERROR("QuadSortManager.cpp", "Thread Pool failed to initialise, staying on the current approach!");
+        return;
+    }
+    _CurrentThreadingApproach = NewThreadingApproach;
+}
+
+void QuadSortManager::ChooseAutoTuneApproach()
+{
+    if (_AutoTuneCandidates.empty())
+    {
+        return;
+    }
+
+    ++_AutoTuneFrame;
+    ++_FramesSinceAutoTuneSwitch;
+
+    // Sorting stays on the fastest approach, unless a candidate is still warming up or is due to be timed again
+    ThreadingApproach NextApproach = _AutoTuneApproach;
+    bool WarmingUp = false;
+    for (ThreadingApproach Candidate : _AutoTuneCandidates)
+    {
+        if (_AutoTuneStats[static_cast<unsigned>(Candidate)]._Samples < _AutoTuneWarmupSamples)
+        {
+            NextApproach = Candidate;
+            WarmingUp = true;
+            break;
+        }
+    }
+
+    if (!WarmingUp && _AutoTuneCandidates.size() > 1 && _AutoTuneFrame % _AutoTuneTimingInterval == 0)
+    {
+        // Take turns timing the other candidates
+        do
+        {
+            _AutoTuneTimedCandidate = (_AutoTuneTimedCandidate + 1) % _AutoTuneCandidates.size();
+        } while (_AutoTuneCandidates[_AutoTuneTimedCandidate] == _AutoTuneApproach);
+
+        NextApproach = _AutoTuneCandidates[_AutoTuneTimedCandidate];
+    }
+
+    if (NextApproach != _CurrentThreadingApproach)
+    {
+        UseThreadingApproach(NextApproach);
+    }
+}
+
+void QuadSortManager::RecordAutoTuneSample(long long SortTimeNs)
+{
+    AutoTuneStats& Stats = _AutoTuneStats[static_cast<unsigned>(_CurrentThreadingApproach)];
+    Stats._AverageNs = Stats._Samples == 0 ? static_cast<double>(SortTimeNs)
+        : _AutoTuneSmoothing * SortTimeNs + (1.0 - _AutoTuneSmoothing) * Stats._AverageNs;
+    ++Stats._Samples;
+
+    // Find the fastest candidate, the averages are only trusted once every candidate has warmed up
+    // since a single cold sort can be far off
+    ThreadingApproach Fastest = _AutoTuneApproach;
+    const AutoTuneStats* FastestStats = nullptr;
+    bool WarmedUp = true;
+    for (ThreadingApproach Candidate : _AutoTuneCandidates)
+    {
+        const AutoTuneStats& CandidateStats = _AutoTuneStats[static_cast<unsigned>(Candidate)];
+        WarmedUp &= CandidateStats._Samples >= _AutoTuneWarmupSamples;
+        if (CandidateStats._Samples > 0 && (!FastestStats || CandidateStats._AverageNs < FastestStats->_AverageNs))
+        {
+            Fastest = Candidate;
+            FastestStats = &CandidateStats;
+        }
+    }
+
+    // Move to it once it is clearly faster than the approach sorting is on
+    const AutoTuneStats& CurrentStats = _AutoTuneStats[static_cast<unsigned>(_AutoTuneApproach)];
+    if (WarmedUp && FastestStats && Fastest != _AutoTuneApproach && _FramesSinceAutoTuneSwitch >= _AutoTuneMinFramesBetweenSwitches
+        && (CurrentStats._Samples == 0 || FastestStats->_AverageNs < CurrentStats._AverageNs * (1.0 - _AutoTuneHysteresis)))
+    {
+        DBG_LOG("QuadSortManager.cpp", "Autotuning moved from ", GetThreadingApproachName(_AutoTuneApproach), " to ",
+            GetThreadingApproachName(Fastest));
+        _AutoTuneApproach = Fastest;
+        _FramesSinceAutoTuneSwitch = 0;
+    }
+}
+
+bool QuadSortManager::StartThreadPool()
+{
+    if (!_ThreadPoolRunning)
+    {
+        _ThreadPoolRunning = _ThreadPool.Initialise();
+
+        // Job cost only needs measuring once, the same threads come back on a restart
+        if (_ThreadPoolRunning && _ThreadPoolJobOverheadNs <= 0.0)
+        {
+            MeasureThreadPoolJobOverhead();
+        }
+    }
+    return _ThreadPoolRunning;
+}
+
+void QuadSortManager::RunOnThreadPool(size_t Count, size_t BlockSize, void(*FuncPtr)(void*, size_t, size_t), void* Context)
+{
+    if (Count == 0)
+    {
+        return;
+    }
+
+    // Without threads the blocks are run here
+    if (!StartThreadPool())
+    {
+        DBG_LOG_ERROR("QuadSortManager.cpp", "Thread Pool failed to initialise, running blocks on the calling thread!");
+        FuncPtr(Context, 0, Count);
+        return;
+    }
+
+    // The calling thread runs blocks too until every block has been run
+    _ThreadPool.ParallelFor(0, Count, BlockSize, [FuncPtr, Context](size_t Begin, size_t End) { FuncPtr(Context, Begin, End); });
+}
+
+size_t QuadSortManager::QueryRect(float l, float t, float r, float b, uint32_t* Out, size_t OutCapacity) const
+{
+    if (_CurrentThreadingApproach == ThreadingApproach::UniformGrid)
+    {
+        return _UniformGrid.QueryRect(l, t, r, b, Out, OutCapacity);
+    }
+    return _Tree.QueryRect(l, t, r, b, Out, OutCapacity);
+}
+
+size_t QuadSortManager::QueryRadius(float x, float y, float Radius, uint32_t* Out, size_t OutCapacity) const
+{
+    if (_CurrentThreadingApproach == ThreadingApproach::UniformGrid)
+    {
+        return _UniformGrid.QueryRadius(x, y, Radius, Out, OutCapacity);
+    }
+    return _Tree.QueryRadius(x, y, Radius, Out, OutCapacity);
+}
+
+void QuadSortManager::QueryRectBatch(const RectQuery* Queries, size_t QueryCount, uint32_t* Out, size_t OutCapacity,
+    size_t* OutCounts)
+{
+    QueryBatch Batch = { this, Queries, nullptr, Out, OutCapacity, OutCounts };
+    RunOnThreadPool(QueryCount, _QueryBlockSize, &QueryBatchWorker, &Batch);
+}
+
+void QuadSortManager::QueryRadiusBatch(const RadiusQuery* Queries, size_t QueryCount, uint32_t* Out, size_t OutCapacity,
+    size_t* OutCounts)
+{
+    QueryBatch Batch = { this, nullptr, Queries, Out, OutCapacity, OutCounts };
+    RunOnThreadPool(QueryCount, _QueryBlockSize, &QueryBatchWorker, &Batch);
+}
+
+void QuadSortManager::QueryBatchWorker(void* inContext, size_t Begin, size_t End)
+{
+    const QueryBatch* Batch = (const QueryBatch*)inContext;
+
+    for (size_t i = Begin; i < End; ++i)
+    {
+        // Every query has its own part of the output buffer
+        uint32_t* QueryOut = Batch->_Out + i * Batch->_OutCapacity;
+        if (Batch->_RectQueries)
+        {
+            const RectQuery& Query = Batch->_RectQueries[i];
+            Batch->_OutCounts[i] = Batch->_Manager->QueryRect(Query._l, Query._t, Query._r, Query._b, QueryOut, Batch->_OutCapacity);
+        }
+        else
+        {
+            const RadiusQuery& Query = Batch->_RadiusQueries[i];
+            Batch->_OutCounts[i] = Batch->_Manager->QueryRadius(Query._x, Query._y, Query._Radius, QueryOut, Batch->_OutCapacity);
+        }
+    }
+}
+
+void QuadSortManager::GatherLeaves()
+{
+    _Leaves.clear();
+    std::vector<const Quad*> QuadStack(1, &_Tree._TopQuad);
+    for (; !QuadStack.empty();)
+    {
+        const Quad* CurrentQuad = QuadStack.back();
+        QuadStack.pop_back();
+
+        if (CurrentQuad->_ChildQuads)
+        {
+            // Pushed last to first so the first child comes off the stack first
+            for (unsigned i = 4; i-- > 0;)
+            {
+                QuadStack.push_back(CurrentQuad->_ChildQuads + i);
+            }
+        }
+        else if (CurrentQuad->_ObjectCount > 0)
+        {
+            _Leaves.push_back(CurrentQuad);
+        }
+    }
+}
+
+void QuadSortManager::FindCollisionPairs()
+{
+    // Buffers keep their memory between frames
+    _CollisionPairBuffers.resize(static_cast<size_t>(_ThreadPool.GetThreadCount()) + 1);
+    for (CollisionPairBuffer& Buffer : _CollisionPairBuffers)
+    {
+        Buffer._Pairs.clear();
+    }
+
+    if (_CurrentThreadingApproach == ThreadingApproach::UniformGrid)
+    {
+        DBG_LOG_ERROR("QuadSortManager.cpp", "Collision pairs need the quad tree, which the Uniform Grid approach doesn't build!");
+        return;
+    }
+
+    // Each leaf is searched on its own
+    GatherLeaves();
+
+    RunOnThreadPool(_Leaves.size(), _LeafBlockSize, &CollisionPairWorker, this);
+}
+
+void QuadSortManager::CollisionPairWorker(void* inContext, size_t Begin, size_t End)
+{
+    QuadSortManager* ThisManager = (QuadSortManager*)inContext;
+
+    // Pool threads use their own buffer, the last one is for the calling thread
+    const int ThreadIndex = ThisManager->_ThreadPool.GetCurrentThreadIndex();
+    const size_t BufferIndex = ThreadIndex >= 0 ? static_cast<size_t>(ThreadIndex) : ThisManager->_CollisionPairBuffers.size() - 1;
+    std::vector<CollisionPair>& Pairs = ThisManager->_CollisionPairBuffers[BufferIndex]._Pairs;
+
+    for (size_t i = Begin; i < End; ++i)
+    {
+        ThisManager->_Tree.FindCollisionPairs(ThisManager->_Leaves[i], Pairs);
+    }
+}
+
+size_t QuadSortManager::GetCollisionPairBufferCount() const
+{
+    return _CollisionPairBuffers.size();
+}
+
+const std::vector<CollisionPair>& QuadSortManager::GetCollisionPairs(size_t BufferIndex) const
+{
+    return _CollisionPairBuffers[BufferIndex]._Pairs;
+}
+
+size_t QuadSortManager::GetCollisionPairCount() const
+{
+    size_t PairCount = 0;
+    for (const CollisionPairBuffer& Buffer : _CollisionPairBuffers)
+    {
+        PairCount += Buffer._Pairs.size();
+    }
+    return PairCount;
+}
+
+size_t QuadSortManager::QueryNearest(float x, float y, size_t K, uint32_t* Out) const
+{
+    if (_CurrentThreadingApproach == ThreadingApproach::UniformGrid)
+    {
+        DBG_LOG_ERROR("QuadSortManager.cpp", "Nearest particle searches need the quad tree, which the Uniform Grid approach doesn't build!");
+        return 0;
+    }
+    return _Tree.FindNearest(x, y, K, UINT32_MAX, Out);
+}
+
+void QuadSortManager::QueryNearestForAllParticles(size_t K, uint32_t* Out)
+{
+    if (_CurrentThreadingApproach == ThreadingApproach::UniformGrid)
+    {
+        DBG_LOG_ERROR("QuadSortManager.cpp", "Nearest particle searches need the quad tree, which the Uniform Grid approach doesn't build!");
+        std::fill(Out, Out + _ParticleIndices.size() * K, UINT32_MAX);
+        return;
+    }
+
+    // Particles are searched leaf by leaf so neighbouring searches walk the same part of the tree
+    GatherLeaves();
+
+    NearestBatch Batch = { this, K, Out };
+    RunOnThreadPool(_Leaves.size(), _LeafBlockSize, &NearestBatchWorker, &Batch);
+}
+
+void QuadSortManager::NearestBatchWorker(void* inContext, size_t Begin, size_t End)
+{
+    const NearestBatch* Batch = (const NearestBatch*)inContext;
+    const QuadTree& Tree = Batch->_Manager->_Tree;
+    const float* PosX = Tree._ParticleContainer->_PosX;
+    const float* PosY = Tree._ParticleContainer->_PosY;
+
+    for (size_t i = Begin; i < End; ++i)
+    {
+        const Quad* Leaf = Batch->_Manager->_Leaves[i];
+        const uint32_t* ObjectIndices = Tree.GetObjectIndices(Leaf);
+        for (uint32_t j = 0; j < Leaf->_ObjectCount; ++j)
+        {
+            const uint32_t Index = *(ObjectIndices + j);
+            uint32_t* ParticleOut = Batch->_Out + static_cast<size_t>(Index) * Batch->_K;
+
+            const size_t Found = Tree.FindNearest(*(PosX + Index), *(PosY + Index), Batch->_K, Index, ParticleOut);
+            std::fill(ParticleOut + Found, ParticleOut + Batch->_K, UINT32_MAX);
+        }
+    }
+}
+
+size_t QuadSortManager::GetQuadCount() const
+{
+    // Quads are handed out to threads in chunks, so count the quads actually in the tree
+    size_t QuadCount = 0;
+    std::vector<const Quad*> QuadStack(1, &_Tree._TopQuad);
+
+    for (; !QuadStack.empty();)
+    {
+        const Quad* CurrentQuad = QuadStack.back();
+        QuadStack.pop_back();
+        ++QuadCount;
+
+        if (CurrentQuad->_ChildQuads)
+        {
+            for (unsigned i = 0; i < 4; ++i)
+            {
+                QuadStack.push_back(CurrentQuad->_ChildQuads + i);
+            }
+        }
+    }
+    return QuadCount;
+}
+
+bool QuadSortManager::AreLeavesSorted() const
+{
+    return _Tree.AreLeavesSorted();
+}
+
+void QuadSortManager::ReserveQuads(size_t ParticleCount)
+{
+    // A full quad holds more than capacity particles and breaks into 4, so a tree
+    // rarely has more than 4 quads per capacity worth of particles. Each thread
+    // can also leave most of a chunk unused
+    const size_t EstimatedQuadCount = 4 * (ParticleCount / _Tree._Capacity + 1)
+        + static_cast<size_t>(_ThreadCount + 1) * QuadPool::_ChunkSize * QuadPool::_PageSize;
+
+    if (_Affinity.GetPolicy() == AffinityPolicy::None)
+    {
+        // Unpinned threads are most likely to run on the node of the thread reserving
+        _QuadPool.Reserve(EstimatedQuadCount, ThreadAffinity::GetCurrentNode());
+        return;
+    }
+
+    // Every node a sort worker is pinned to gets the whole estimate, as one node may end up
+    // building most of the tree. Pages are only touched on the node they are reserved for
+    const CpuTopology& Topology = CpuTopology::Get();
+    std::vector<unsigned> Slots;
+    std::vector<QuadReserveInfo> ReserveInfos;
+    std::vector<bool> NodeReserved(Topology._NodeCount, false);
+    for (unsigned Slot = 0; Slot <= std::max(_ThreadCount, 4u); ++Slot)
+    {
+        const unsigned Node = std::min(Topology.GetNode(static_cast<unsigned>(_Affinity.GetSlotCpu(Slot))), Topology._NodeCount - 1);
+        if (!NodeReserved[Node])
+        {
+            NodeReserved[Node] = true;
+            Slots.push_back(Slot);
+            ReserveInfos.push_back({ &_QuadPool, EstimatedQuadCount, Node });
+        }
+    }
+
+    std::vector<void*> WorkerArgs(ReserveInfos.size());
+    for (size_t i = 0; i < ReserveInfos.size(); ++i)
+    {
+        WorkerArgs[i] = &ReserveInfos[i];
+    }
+    RunPinnedThreads(Slots, &QuadReserveWorker, WorkerArgs.data());
+}
+
+void* QuadSortManager::QuadReserveWorker(void* inData)
+{
+    QuadReserveInfo* Info = (QuadReserveInfo*)inData;
+    Info->_QuadPool->Reserve(Info->_QuadCount, Info->_Node);
+    return nullptr;
+}
+
+void QuadSortManager::SetAffinity(AffinityPolicy Policy, const std::vector<unsigned>& CpuList)
+{
+    _Affinity = ThreadAffinity(Policy, CpuList);
+    if (Policy == AffinityPolicy::Explicit && _Affinity.GetCpuOrder().size() != CpuList.size())
+    {
+        DBG_LOG_WARNING("QuadSortManager.cpp", "Dropped ", CpuList.size() - _Affinity.GetCpuOrder().size(),
+            " CPUs from the affinity list that this process can't run on");
+    }
+
+    // Parked workers start again on their new CPUs the next time their approach sorts
+    StopParkedWorkers(_QueueWorkers);
+    StopParkedWorkers(_FlatFourWorkers);
+    StopParkedWorkers(_PartitionWorkers);
+
+    _ThreadPool.SetAffinity(_Affinity);
+    _MortonSorter.SetAffinity(_Affinity);
+    _UniformGrid.SetAffinity(_Affinity);
+
+    if (_ThreadPoolRunning)
+    {
+        _ThreadPool.StopThreads(true);
+        _ThreadPoolRunning = false;
+        if (!StartThreadPool())
+        {
+            DBG_LOG_ERROR("QuadSortManager.cpp", "Thread Pool failed to restart with the new affinity!");
+        }
+    }
+
+    if (_Affinity.GetPolicy() != AffinityPolicy::None)
+    {
+        ReserveQuads(_ParticleIndices.size());
+    }
+}
+
+bool QuadSortManager::PinSortingThread() const
+{
+    if (!_Affinity.PinCurrentThread(0))
+    {
+        DBG_LOG_WARNING("QuadSortManager.cpp", "Failed to set the affinity of the sorting thread");
+        return false;
+    }
+    return true;
+}
+
+bool QuadSortManager::PlaceParticles()
+{
+    if (!_Tree._ParticleContainer->PlacePositions(&FillPlacedPositions, this))
+    {
+        DBG_LOG_WARNING("QuadSortManager.cpp", "Failed to allocate memory to place particles in");
+        return false;
+    }
+    return true;
+}
+
+const ThreadAffinity& QuadSortManager::GetAffinity() const
+{
+    return _Affinity;
+}
+
+bool QuadSortManager::RunPinnedThreads(const std::vector<unsigned>& Slots, void*(*WorkerFunc)(void*), void* const* WorkerArgs)
+{
+    std::vector<pthread_t> Threads(Slots.size());
+    std::vector<bool> Started(Slots.size(), false);
+    bool Success = true;
+    for (size_t i = 0; i < Slots.size(); ++i)
+    {
+        Started[i] = _Affinity.CreateThread(&Threads[i], WorkerFunc, WorkerArgs[i], Slots[i]) == 0;
+        if (!Started[i])
+        {
+            // The work still has to be done, even if not on the right node
+            WorkerFunc(WorkerArgs[i]);
+            Success = false;
+        }
+    }
+    for (size_t i = 0; i < Slots.size(); ++i)
+    {
+        if (Started[i] && pthread_join(Threads[i], NULL))
+        {
+            Success = false;
+        }
+    }
+    return Success;
+}
+
+void QuadSortManager::FillPlacedPositions(const Particles& Source, float* PosX, float* PosY, void* Context)
+{
+    QuadSortManager* ThisManager = (QuadSortManager*)Context;
+    const size_t ParticleCount = Source._MaxParticles;
+
+    // Chunks match the ones the Morton and grid workers split the particles into
+    const unsigned WorkerCount = std::max(ThisManager->_ThreadCount, 1u);
+    std::vector<unsigned> Slots(WorkerCount);
+    std::vector<ParticlePlacementInfo> PlacementInfos(WorkerCount);
+    std::vector<void*> WorkerArgs(WorkerCount);
+    for (unsigned i = 0; i < WorkerCount; ++i)
+    {
+        Slots[i] = i;
+        PlacementInfos[i] = { &Source, PosX, PosY, ParticleCount * i / WorkerCount, ParticleCount * (i + 1) / WorkerCount };
+        WorkerArgs[i] = &PlacementInfos[i];
+    }
+    ThisManager->RunPinnedThreads(Slots, &ParticlePlacementWorker, WorkerArgs.data());
+}
+
+void* QuadSortManager::ParticlePlacementWorker(void* inData)
+{
+    ParticlePlacementInfo* Info = (ParticlePlacementInfo*)inData;
+    const size_t Count = Info->_End - Info->_Begin;
+    memcpy(Info->_PosX + Info->_Begin, Info->_ParticleContainer->_PosX + Info->_Begin, Count * sizeof(float));
+    memcpy(Info->_PosY + Info->_Begin, Info->_ParticleContainer->_PosY + Info->_Begin, Count * sizeof(float));
+    return nullptr;
+}
+
+void QuadSortManager::SetGridCellSize(float CellSize)
+{
+    _GridCellSize = CellSize;
+}
+
+const UniformGrid& QuadSortManager::GetUniformGrid() const
+{
+    return _UniformGrid;
+}
+
+void QuadSortManager::SetIncrementalUpdate(bool IncrementalUpdate)
+{
+    _IncrementalUpdate = IncrementalUpdate;
+}
+
+bool QuadSortManager::IsIncrementalUpdate() const
+{
+    return _IncrementalUpdate;
+}
+
+void QuadSortManager::SetSnapshotInterval(unsigned Interval, const std::string& PathPrefix)
+{
+    _SnapshotInterval = Interval;
+    _SnapshotPrefix = PathPrefix;
+}
+
+void QuadSortManager::CaptureSnapshot(const std::string& Path)
+{
+    if (!_HasTree)
+    {
+        DBG_LOG_ERROR("QuadSortManager.cpp", "Can't snapshot the quad tree before the first sort!");
+        return;
+    }
+
+    _SnapshotWriter.Capture(_Tree, static_cast<uint64_t>(_SortCount), Path);
+
+    LogSnapshotFailures();
 }
 
+bool QuadSortManager::SaveSnapshot(const std::string& Path) const
+{
+    if (!_HasTree)
+    {
+        DBG_LOG_ERROR("QuadSortManager.cpp", "Can't snapshot the quad tree before the first sort!");
+        return false;
+    }
+    return WriteTreeSnapshot(_Tree, static_cast<uint64_t>(_SortCount), Path);
+}
+
+bool QuadSortManager::FlushSnapshots()
+{
+    _SnapshotWriter.Flush();
+    LogSnapshotFailures();
+    return _LoggedSnapshotFailures == 0;
+}
+
+void QuadSortManager::LogSnapshotFailures()
+{
+    const size_t FailedWrites = _SnapshotWriter.GetFailedWriteCount();
+    if (FailedWrites > _LoggedSnapshotFailures)
+    {
+        DBG_LOG_ERROR("QuadSortManager.cpp", "Failed to write ", FailedWrites - _LoggedSnapshotFailures, " quad tree snapshots!");
+        _LoggedSnapshotFailures = FailedWrites;
+    }
+}
+
+#ifndef QUADSORT_HEADLESS
 void QuadSortManager::ImGuiDraw()
 {
     ImGui::Text("Sort Performance:");
     ImGui::Text("Total Sort Time(ms): %lli", _TotalSortTime);
     ImGui::Text("Sort Time(ms): %lli", _SortTime);
     ImGui::Text("Average Sort Time(ms): %lli", _AvgSortTime);
-    unsigned int AllocatedQuadCount = (_QuadPool._End + 1) * _QuadPool._PageSize;
-    ImGui::Text("Quad Count = %d \n", AllocatedQuadCount);
+    ImGui::Text("Quad Count = %zu \n", GetQuadCount());
+    ImGui::Checkbox("Incremental Update", &_IncrementalUpdate);
+
+    if (ImGui::Button("Save Tree Snapshot"))
+    {
+        CaptureSnapshot("QuadTree.qsnap");
+    }
+
+    bool AutoTune = _AutoTune;
+    if (ImGui::Checkbox("Auto Tune Approach", &AutoTune))
+    {
+        SetAutoTune(AutoTune);
+    }
+    ImGui::Text("Threading Approach: %s", GetThreadingApproachName(_CurrentThreadingApproach));
+
+    if (_CurrentThreadingApproach == ThreadingApproach::StaticPartition)
+    {
+        int PartitionDepth = static_cast<int>(_PartitionDepth);
+        if (ImGui::SliderInt("Partition Depth (0 = auto)", &PartitionDepth, 0, static_cast<int>(_MaxPartitionDepth)))
+        {
+            SetPartitionDepth(static_cast<unsigned>(PartitionDepth));
+        }
+    }
     ImGui::NewLine();
 
     if (_CurrentThreadingApproach == ThreadingApproach::ThreadPool)
     {
         ImGui::Text("Num Jobs Completed: %lli", _ThreadPool.GetNumJobsCompleted());
+        ImGui::Text("Job Particle Cutoff: %zu", _ThreadPoolCutoff);
         ImGui::Text("Num Idle Threads: %d", _ThreadPool.GetNumIdleThreads());
     }
-}
\ No newline at end of file
+
+    // Explicit CPU lists can only be set from code
+    const char* AffinityPolicyNames[] = { "None", "Compact", "Scatter" };
+    int Policy = static_cast<int>(_Affinity.GetPolicy());
+    if (Policy < 3 && ImGui::Combo("Thread Affinity", &Policy, AffinityPolicyNames, 3))
+    {
+        SetAffinity(static_cast<AffinityPolicy>(Policy));
+    }
+}
+#endif
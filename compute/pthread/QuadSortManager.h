@@ -4,11 +4,19 @@
 #include <queue>
 #include <string>
 #include "ThreadPool.h"
+#include "MortonSort.h"
+#include "UniformGrid.h"
+#include "ThreadAffinity.h"
+#include "ParkedWorkerGroup.h"
+#include "TreeSnapshot.h"
 
 #define __PTW32_STATIC_LIB
 #include "pthread.h"
 
+// Define QUADSORT_HEADLESS to build without ImGui, e.g. for the headless benchmark
+#ifndef QUADSORT_HEADLESS
 #include "imgui.h"
+#endif
 
 #include "../../Timer.h"
 
@@ -17,9 +25,31 @@ enum class ThreadingApproach
 	NoThreading,
 	QueueThreading,
 	FlatFourThreading,
-	ThreadPool
+	StaticPartition,
+	ThreadPool,
+	MortonRadixSort,
+	UniformGrid
 };
 
+// Number of threading approaches, UniformGrid must stay the last one
+const unsigned ThreadingApproachCount = static_cast<unsigned>(ThreadingApproach::UniformGrid) + 1;
+
+// Readable name of a threading approach, used for UI and benchmark output
+inline const char* GetThreadingApproachName(ThreadingApproach Approach)
+{
+	switch (Approach)
+	{
+	case ThreadingApproach::NoThreading:		return "NoThreading";
+	case ThreadingApproach::QueueThreading:		return "QueueThreading";
+	case ThreadingApproach::FlatFourThreading:	return "FlatFourThreading";
+	case ThreadingApproach::StaticPartition:	return "StaticPartition";
+	case ThreadingApproach::ThreadPool:			return "ThreadPool";
+	case ThreadingApproach::MortonRadixSort:	return "MortonRadixSort";
+	case ThreadingApproach::UniformGrid:		return "UniformGrid";
+	}
+	return "Unknown";
+}
+
 class QuadSortManager;
 
 struct FlatFourThreadInfo
@@ -28,6 +58,49 @@ struct FlatFourThreadInfo
 	QuadSortManager* _Manager;
 };
 
+struct PartitionThreadInfo
+{
+	unsigned _ThreadID;
+	QuadSortManager* _Manager;
+};
+
+// A range of particle positions copied into new memory by the worker that owns it
+struct ParticlePlacementInfo
+{
+	const Particles* _ParticleContainer;
+	float* _PosX;
+	float* _PosY;
+	size_t _Begin;
+	size_t _End;
+};
+
+// A node arena of the quad pool reserved from a thread on that node
+struct QuadReserveInfo
+{
+	QuadPool* _QuadPool;
+	size_t _QuadCount;
+	unsigned _Node;
+};
+
+// A particle that left its leaf quad during an incremental update and the leaf it moved into
+struct MovedParticle
+{
+	Quad* _Destination;
+	uint32_t _Index;
+};
+
+// Area searched by a batched rectangle query
+struct RectQuery
+{
+	float _l, _t, _r, _b;
+};
+
+// Area searched by a batched radius query
+struct RadiusQuery
+{
+	float _x, _y, _Radius;
+};
+
 class QuadSortManager
 {
 public:
@@ -47,36 +120,404 @@ public:
 
 	static void* FlatFourQuadSortWorker(void* inData);
 
+	// Sorts the subtrees the static partition assigned to one thread
+	static void* StaticPartitionWorker(void* inData);
+
 	static void ThreadPoolQuadSort(void* inData, void* inContext);
 
+	// Builds the quads below CurrentQuad from a range of Morton sorted keys
+	void BuildQuadFromMortonKeys(Quad* CurrentQuad, const MortonKey* Keys, size_t Begin, size_t End);
+
 	// End anything Quad Tree Threading related at end of the program
 	void EndQuadTreeThreading();
 
 	void SwapThreadingApproach(ThreadingApproach NewThreadingApproach);
 
+	ThreadingApproach GetCurrentThreadingApproach() const;
+
+	// When enabled every candidate approach is timed on the live particles now and then, keeping a moving
+	// average of each one's sort time, and sorts use the fastest. Sorting only moves to another approach
+	// when it is clearly faster, so close approaches don't keep swapping. Autotuning is turned off by the
+	// next sort while incremental update is enabled, since the approach isn't used to update the tree
+	void SetAutoTune(bool AutoTune);
+
+	bool IsAutoTuning() const;
+
+	// Approaches autotuning picks from, defaults to every approach that builds the quad tree. Approaches
+	// listed more than once are only kept once
+	void SetAutoTuneCandidates(const std::vector<ThreadingApproach>& Candidates);
+
+	// Number of quads in the tree built by the last sort, including the top quad
+	size_t GetQuadCount() const;
+
+	// Checks every particle is held by exactly one leaf of the tree built by the last sort and is inside it.
+	// The UniformGrid approach leaves the tree as one quad, which holds every particle
+	bool AreLeavesSorted() const;
+
+	// Reserve quad pool memory for sorting the given number of particles, so sorts don't allocate. With an
+	// affinity policy set the arena of every node sort workers run on is reserved from a thread on that node
+	void ReserveQuads(size_t ParticleCount);
+
+	// Pins every sort worker following the policy. Worker groups running now are restarted on their new CPUs
+	// and the quad arenas are reserved again. The calling thread and the particle memory are left alone,
+	// PinSortingThread and PlaceParticles move them too
+	void SetAffinity(AffinityPolicy Policy, const std::vector<unsigned>& CpuList = std::vector<unsigned>());
+
+	// Pins the calling thread to slot 0 of the policy, for the thread that calls SortParticles.
+	// Returns false if its affinity couldn't be set
+	bool PinSortingThread() const;
+
+	// Has the particle container move its positions into memory first touched by the sort worker that reads
+	// each chunk of them. The position arrays are replaced, so pointers to them must be fetched again.
+	// Returns false, leaving the positions where they were, if the memory couldn't be allocated
+	bool PlaceParticles();
+
+	const ThreadAffinity& GetAffinity() const;
+
+	// When enabled each sort updates the tree from the last sort instead of rebuilding it,
+	// only moving particles that crossed into another quad
+	void SetIncrementalUpdate(bool IncrementalUpdate);
+
+	bool IsIncrementalUpdate() const;
+
+	// Depth the StaticPartition approach splits the top of the tree to on the sorting thread before handing
+	// the up to 4^Depth subtrees to threads. 0 picks the depth giving at least two subtrees per thread
+	void SetPartitionDepth(unsigned Depth);
+
+	// Depth the StaticPartition approach splits to with the current settings
+	unsigned GetPartitionDepth() const;
+
+	// Quads with fewer than ParticleCount particles are broken by the ThreadPool job that reached them
+	// instead of getting jobs of their own. 0 works the cutoff out from the measured cost of a job
+	void SetThreadPoolCutoff(size_t ParticleCount);
+
+	// Quads at Depth or deeper are also broken by the job that reached them, -1 for no depth cutoff
+	void SetThreadPoolCutoffDepth(int Depth);
+
+	// Particle cutoff used by the last ThreadPool sort
+	size_t GetThreadPoolCutoff() const;
+
+	// Cell size used by the UniformGrid approach, 0 picks one so cells hold about a quad's capacity of particles
+	void SetGridCellSize(float CellSize);
+
+	// Grid built by the last sort with the UniformGrid approach
+	const UniformGrid& GetUniformGrid() const;
+
+	// Writes the indices of particles inside the rectangle to Out, up to OutCapacity of them, and returns
+	// how many are inside, which can be more than OutCapacity. Searches the tree built by the last sort,
+	// or the grid with the UniformGrid approach
+	size_t QueryRect(float l, float t, float r, float b, uint32_t* Out, size_t OutCapacity) const;
+
+	// Same as QueryRect for particles within Radius of a point
+	size_t QueryRadius(float x, float y, float Radius, uint32_t* Out, size_t OutCapacity) const;
+
+	// Answers many queries in parallel on the thread pool, starting it if needed. Query i writes up to
+	// OutCapacity indices to Out + i * OutCapacity and how many particles it found to OutCounts[i]
+	void QueryRectBatch(const RectQuery* Queries, size_t QueryCount, uint32_t* Out, size_t OutCapacity, size_t* OutCounts);
+
+	void QueryRadiusBatch(const RadiusQuery* Queries, size_t QueryCount, uint32_t* Out, size_t OutCapacity, size_t* OutCounts);
+
+	// Broad phase, finds every pair of overlapping particles in the tree built by the last sort on the
+	// thread pool, starting it if needed. Each thread appends the pairs it finds to its own buffer.
+	// The UniformGrid approach doesn't build the tree, so finds nothing
+	void FindCollisionPairs();
+
+	// Number of pair buffers, one per pool thread and one for the calling thread
+	size_t GetCollisionPairBufferCount() const;
+
+	// Pairs found by the last FindCollisionPairs, in no particular order
+	const std::vector<CollisionPair>& GetCollisionPairs(size_t BufferIndex) const;
+
+	// Total number of pairs found by the last FindCollisionPairs
+	size_t GetCollisionPairCount() const;
+
+	// Writes the indices of the K particles closest to a point to Out, closest first, and returns
+	// how many were written, fewer than K when there are fewer particles. Like FindCollisionPairs
+	// these need the quad tree, so find nothing with the UniformGrid approach
+	size_t QueryNearest(float x, float y, size_t K, uint32_t* Out) const;
+
+	// Finds the K closest other particles of every particle on the thread pool, starting it if needed.
+	// Particle i's neighbours are written closest first to Out + i * K, slots left over when there
+	// are fewer than K other particles are set to UINT32_MAX
+	void QueryNearestForAllParticles(size_t K, uint32_t* Out);
+
+	// Every Interval sorts a snapshot of the tree is written to PathPrefix followed by the sort count and
+	// ".qsnap". Snapshots are written on a thread of their own while the next sorts run, 0 stops them
+	void SetSnapshotInterval(unsigned Interval, const std::string& PathPrefix);
+
+	// Lays out a snapshot of the tree built by the last sort and queues it to be written to Path
+	// while sorting carries on
+	void CaptureSnapshot(const std::string& Path);
+
+	// Writes a snapshot of the tree built by the last sort to Path on the calling thread,
+	// returns false if it couldn't be written
+	bool SaveSnapshot(const std::string& Path) const;
+
+	// Waits for every queued snapshot to be written, returns false if any snapshot so far failed to write
+	bool FlushSnapshots();
+
+#ifndef QUADSORT_HEADLESS
 	void ImGuiDraw();
+#endif
 private:
-	// Top quad to act as the parent quad for all other quads
-	Quad* _TopQuad;
+	// A batch of queries being answered on the thread pool, only one of the query arrays is set
+	struct QueryBatch
+	{
+		const QuadSortManager* _Manager;
+		const RectQuery* _RectQueries;
+		const RadiusQuery* _RadiusQueries;
+		uint32_t* _Out;
+		size_t _OutCapacity;
+		size_t* _OutCounts;
+	};
+
+	// Starts the thread pool if it isn't running, returns false if it failed to start
+	bool StartThreadPool();
+
+	// Times a batch of empty jobs to find what a job costs on its own
+	void MeasureThreadPoolJobOverhead();
+
+	// Works out the particle cutoff of the next ThreadPool sort
+	void UpdateThreadPoolCutoff();
+
+	// Breaks a quad and every quad below it that should be broken on the calling thread
+	static bool SortQuadInThread(const QuadTree& Tree, Quad* CurrentQuad);
+
+	// Switches the approach used for the next sort, leaving the thread pool running so autotuning
+	// can move back to it without restarting threads
+	void UseThreadingApproach(ThreadingApproach NewThreadingApproach);
+
+	// Picks the approach for the next sort, either the fastest one so far or a candidate due to be timed
+	void ChooseAutoTuneApproach();
+
+	// Adds the time of a sort to the average of the approach that did it and moves to the fastest approach
+	void RecordAutoTuneSample(long long SortTimeNs);
+
+	// Splits Count items into blocks and runs FuncPtr on each block on the thread pool,
+	// returning once every block has been run
+	void RunOnThreadPool(size_t Count, size_t BlockSize, void(*FuncPtr)(void*, size_t, size_t), void* Context);
+
+	// Answers a block of queries from a QueryBatch
+	static void QueryBatchWorker(void* inContext, size_t Begin, size_t End);
+
+	// Number of queries each thread pool job answers
+	static const size_t _QueryBlockSize = 64;
+
+	// Gathers the leaves with particles in them into _Leaves, in tree order
+	void GatherLeaves();
+
+	// Finds the collision pairs of a block of leaves
+	static void CollisionPairWorker(void* inContext, size_t Begin, size_t End);
+
+	// Nearest particle search of every particle being run on the thread pool
+	struct NearestBatch
+	{
+		QuadSortManager* _Manager;
+		size_t _K;
+		uint32_t* _Out;
+	};
+
+	// Finds the nearest particles of every particle in a block of leaves
+	static void NearestBatchWorker(void* inContext, size_t Begin, size_t End);
+
+	// Number of leaves each thread pool job works through
+	static const size_t _LeafBlockSize = 64;
+
+	// Pairs found by one thread, kept on their own cache line so threads don't share one while appending
+	struct alignas(64) CollisionPairBuffer
+	{
+		std::vector<CollisionPair> _Pairs;
+	};
+
+	// Breaks every quad in the quad queue and any of their children that should be broken, on this thread
+	void SortQueuedQuads();
+
+	// Has the workers of a group exit and joins them, logging workers that couldn't be joined
+	void StopParkedWorkers(ParkedWorkerGroup& Workers);
+
+	// Stops the helper threads the Morton sorter and the uniform grid keep parked, unless KeepCurrentApproach
+	// is set and theirs is the approach sorting now. They start again the next time their approach sorts
+	void StopSorterWorkers(bool KeepCurrentApproach);
+
+	// Starts a thread pinned to each of the given affinity slots, thread i running WorkerFunc with WorkerArgs[i],
+	// and waits for all of them. Returns false if a thread failed to start, its work is run on the calling thread
+	bool RunPinnedThreads(const std::vector<unsigned>& Slots, void*(*WorkerFunc)(void*), void* const* WorkerArgs);
+
+	// Copies the particle positions into the new memory of Particles::PlacePositions, each chunk written
+	// by a thread in the slot of the Morton and grid worker that reads it
+	static void FillPlacedPositions(const Particles& Source, float* PosX, float* PosY, void* Context);
+
+	// Static functions for pinned threads to run, placing particles and reserving a node's quad arena
+	static void* ParticlePlacementWorker(void* inData);
+	static void* QuadReserveWorker(void* inData);
+
+	// Sorts quads from the shared quad queue until it is empty, run by each Queue Threading worker
+	void SortSharedQuadQueue();
+
+	// Breaks the top of the tree down to the partition depth on this thread, leaving the quads
+	// at that depth which still need breaking in _PartitionSubtrees
+	bool SplitForStaticPartition();
+
+	// Hands the partition subtrees out to the given number of threads, largest first to the thread
+	// with the fewest particles so far
+	void AssignPartitionSubtrees(unsigned WorkerCount);
+
+	// Logs snapshot writes that failed since the last call. Writes finish on the writer thread,
+	// so failures are only found by a later capture or flush
+	void LogSnapshotFailures();
+
+	// Updates the tree from the last sort to the current particle positions
+	void UpdateTreeIncrementally();
+
+	// Moves particles that left their leaf quad below CurrentQuad to the end of the leaf's range,
+	// recording the leaf they are now in and how many particles stayed in each leaf
+	void FindMovedParticles(Quad* CurrentQuad);
+
+	// Returns the leaf quad a position is in, searching up from a quad to the first one holding the position
+	Quad* FindLeafQuad(Quad* StartQuad, float x, float y) const;
+
+	// Writes the particles that stayed in the quads below CurrentQuad to Output in tree order, leaving room
+	// for the ones moving in. Merges quads that no longer need to be broken and queues leaves that now do,
+	// returns the end of the quad's new range
+	uint32_t* RelayoutQuad(Quad* CurrentQuad, uint32_t* Output, size_t& LeafIndex);
+
+	// Tree being sorted, holds the top quad and everything its quads share
+	QuadTree _Tree;
 
 	const unsigned int _ThreadCount;
 
 	// Used to determine which threading approach to use
 	ThreadingApproach _CurrentThreadingApproach;
 
-	std::queue<Quad*> _QuadQueue;
+	// Queue Threading workers all take quads from the queue, it and its lock get a line of their own
+	alignas(CacheLineSize) std::queue<Quad*> _QuadQueue;
 	pthread_mutex_t _QuadQueue_mutex;
 
-	QuadPool _QuadPool;
-	pthread_mutex_t _QuadPool_mutex;
+	// Quad pool is safe to allocate from on any thread without locking
+	alignas(CacheLineSize) QuadPool _QuadPool;
+
+	// Frame wide buffer of particle indices, every quad owns a range of it. The order is kept
+	// between sorts as a permutation of the particles that is already close to sorted
+	std::vector<uint32_t> _ParticleIndices;
+
+	// Incremental update state, the tree is only kept once a sort has built it
+	bool _IncrementalUpdate = false;
+	bool _HasTree = false;
+
+	// Set when the last sort broke the tree with the current approach, so the next sort can update it.
+	// UniformGrid sorts and approach changes clear it
+	bool _CanUpdateTree = false;
+
+	// Quads dropped from the tree by merges since the last rebuild, they can't be reused until the pool is reset
+	size_t _MergedQuadCount = 0;
+
+	// Particles that changed leaf this update
+	std::vector<MovedParticle> _MovedParticles;
+
+	// Number of particles that stayed in each leaf this update, in tree order
+	std::vector<uint32_t> _StayCounts;
+
+	// Index buffer an incremental update writes the new layout into before it is swapped in
+	std::vector<uint32_t> _NextParticleIndices;
 
 	ThreadPool _ThreadPool;
 
-	std::vector<pthread_t> _QueueThreads;
+	// Counts the jobs of the sort running on the thread pool
+	JobLatch _ThreadPoolSortLatch;
+
+	// The pool runs for the ThreadPool approach, and is started for batched work with any approach
+	bool _ThreadPoolRunning = false;
+
+	// ThreadPool sort granularity, quads below the cutoffs are broken without new jobs
+	size_t _ThreadPoolCutoffSetting = 0;
+	size_t _ThreadPoolCutoff = 0;
+	int _ThreadPoolCutoffDepth = -1;
+
+	// Measured cost of one job and of partitioning one particle, used to work out the cutoff
+	double _ThreadPoolJobOverheadNs = 0.0;
+	double _PartitionCostNs = 0.0;
+	Timer<resolutions::nanoseconds> _PartitionCostTimer;
+
+	// A job's subtree should take this many times longer to sort than the job costs
+	static const size_t _CutoffOverheadRatio = 16;
+
+	// The worked out cutoff is capped so every thread still gets about this many jobs
+	static const size_t _MinJobsPerThread = 8;
+
+	// Leaves holding particles, gathered to split work on the tree between threads
+	std::vector<const Quad*> _Leaves;
+
+	std::vector<CollisionPairBuffer> _CollisionPairBuffers;
+
+	// Parked workers of the Queue and Flat Four approaches, started the first time each approach sorts
+	ParkedWorkerGroup _QueueWorkers;
+	ParkedWorkerGroup _FlatFourWorkers;
 
-	pthread_t _FlatFourThreads[4];
 	FlatFourThreadInfo _FlatFourThreadInfos[4];
 
+	// Static partition state, the subtrees each thread sorts are worked out again every sort
+	unsigned _PartitionDepth = 0;
+	ParkedWorkerGroup _PartitionWorkers;
+	std::vector<PartitionThreadInfo> _PartitionThreadInfos;
+	std::vector<Quad*> _PartitionSubtrees;
+	std::vector<Quad*> _PartitionNextLevel;
+	std::vector<std::vector<Quad*>> _PartitionAssignments;
+	std::vector<size_t> _PartitionLoads;
+
+	// Deepest split, 4^8 subtrees is far more than any machine has threads
+	static constexpr unsigned _MaxPartitionDepth = 8;
+
+	MortonSorter _MortonSorter;
+
+	// Placement of every sort worker, slot 0 is the thread calling the sort
+	ThreadAffinity _Affinity;
+
+	// Autotuning state, each approach keeps an exponentially weighted moving average of its sort time
+	struct AutoTuneStats
+	{
+		double _AverageNs = 0.0;
+		unsigned _Samples = 0;
+	};
+
+	bool _AutoTune = false;
+	std::vector<ThreadingApproach> _AutoTuneCandidates;
+	AutoTuneStats _AutoTuneStats[ThreadingApproachCount];
+
+	// The fastest approach so far, sorts use it unless another candidate is being timed
+	ThreadingApproach _AutoTuneApproach;
+
+	long long _AutoTuneFrame = 0;
+	long long _FramesSinceAutoTuneSwitch = 0;
+	size_t _AutoTuneTimedCandidate = 0;
+
+	Timer<resolutions::nanoseconds> _AutoTuneTimer;
+
+	// Weight of the newest sort time in the moving average
+	static constexpr double _AutoTuneSmoothing = 0.25;
+
+	// Another approach has to be this much faster before sorting moves to it
+	static constexpr double _AutoTuneHysteresis = 0.1;
+
+	// Times each candidate is timed before the averages are trusted, sorting doesn't move to another approach before then
+	static const unsigned _AutoTuneWarmupSamples = 2;
+
+	// Once warmed up, one other candidate is timed every this many frames
+	static const unsigned _AutoTuneTimingInterval = 30;
+
+	// Sorting stays on an approach for at least this many frames after moving to it
+	static const unsigned _AutoTuneMinFramesBetweenSwitches = 30;
+
+	UniformGrid _UniformGrid;
+	float _GridCellSize = 0.f;
+
+	// Snapshots are laid out after a sort and written while the next ones run
+	SnapshotWriter _SnapshotWriter;
+	unsigned _SnapshotInterval = 0;
+	std::string _SnapshotPrefix;
+
+	// Failed snapshot writes that have been logged, the writer thread can't log them itself
+	size_t _LoggedSnapshotFailures = 0;
+
 	// Performance collection data
 
 	Timer<resolutions::milliseconds> _SortPerformanceTimer;
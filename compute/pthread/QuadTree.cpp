@@ -1,160 +1,864 @@
 #include "QuadTree.h"
+#include "ThreadAffinity.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#if defined(__AVX2__) || defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+#endif
+#ifdef _WIN32
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#endif
 
 
-Quad::Quad(Particles* ParticleContainer, Quad* ParentQuad, QuadPool* QuadPool, size_t Capacity, 
-	float l, float t, float r, float b, bool IsTopQuad, int Depth)
-	:_ParticleContainer(ParticleContainer), _QuadPool(QuadPool), _ParentQuad(ParentQuad), _Capacity(Capacity),
-	_l(l), _t(t), _r(r), _b(b), _Width(_r-_l), _Height(_t-_b), _ChildObjectIndices(), _IsTopQuad(IsTopQuad), _Depth(Depth)
+QuadTree::QuadTree(Particles* ParticleContainer, QuadPool* QuadPool, size_t Capacity,
+	float l, float t, float r, float b)
+	:_TopQuad(), _ParticleContainer(ParticleContainer), _QuadPool(QuadPool), _Capacity(Capacity > 0 ? Capacity : 1),
+	_l(l), _t(t), _r(r), _b(b), _Width(_r-_l), _Height(_t-_b), _ObjectIndices(nullptr)
 {
 	if (_Height < 0)
 	{
 		_Height = -_Height;
 	}
+
+	// Halving is exact, so a side is at the same position at every depth that has it
+	for (unsigned Depth = 0; Depth <= _MaxDepth; ++Depth)
+	{
+		_QuadWidths[Depth] = std::ldexp(_r - _l, -static_cast<int>(Depth));
+		_QuadHeights[Depth] = std::ldexp(_b - _t, -static_cast<int>(Depth));
+	}
+}
+
+bool QuadTree::AllocateChildQuads(Quad* CurrentQuad) const
+{
+	CurrentQuad->_ChildQuads = _QuadPool->GetFourQuads();
+
+	return CurrentQuad->_ChildQuads != nullptr;
+}
+
+void QuadTree::InitialiseChildQuads(Quad* CurrentQuad) const
+{
+	// Children are the 4 quads of the next depth's grid inside this one, right then bottom
+	const uint16_t X = static_cast<uint16_t>(CurrentQuad->_X * 2);
+	const uint16_t Y = static_cast<uint16_t>(CurrentQuad->_Y * 2);
+	const uint8_t Depth = static_cast<uint8_t>(CurrentQuad->_Depth + 1);
+
+	for (unsigned i = 0; i < 4; ++i)
+	{
+		*(CurrentQuad->_ChildQuads + i) = { CurrentQuad, nullptr, CurrentQuad->_FirstObject, 0,
+			static_cast<uint16_t>(X + (i % 2)), static_cast<uint16_t>(Y + (i / 2)), Depth };
+	}
+}
+
+// Child index of a position, 2 comparisons against the middle of the quad give the
+// same child order as InitialiseChildQuads, bit 0 is right and bit 1 is bottom
+static inline unsigned GetChildQuadIndex(float x, float y, float MidX, float MidY)
+{
+	return static_cast<unsigned>(x >= MidX) | (static_cast<unsigned>(y >= MidY) << 1);
+}
+
+#if defined(__AVX2__) || defined(__SSE2__) || defined(_M_X64)
+#define QUAD_PARTITION_SIMD
+#endif
+
+#if defined(__AVX2__)
+// Running counts of right, bottom and bottom right particles, one per lane
+struct ChildQuadCounters
+{
+	__m256i _Right = _mm256_setzero_si256();
+	__m256i _Bottom = _mm256_setzero_si256();
+	__m256i _BottomRight = _mm256_setzero_si256();
+};
+
+// Classify 8 particles at once, writing their child indices as bytes and adding to the counts
+static inline void ClassifyEight(const float* PosX, const float* PosY, const uint32_t* Indices,
+	__m256 MidX, __m256 MidY, uint8_t* ChildIndices, ChildQuadCounters& Counters)
+{
+	const __m256i Index = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(Indices));
+	const __m256 x = _mm256_i32gather_ps(PosX, Index, 4);
+	const __m256 y = _mm256_i32gather_ps(PosY, Index, 4);
+
+	// Comparisons give -1 in lanes where they are true
+	const __m256i Right = _mm256_castps_si256(_mm256_cmp_ps(x, MidX, _CMP_GE_OQ));
+	const __m256i Bottom = _mm256_castps_si256(_mm256_cmp_ps(y, MidY, _CMP_GE_OQ));
+	Counters._Right = _mm256_sub_epi32(Counters._Right, Right);
+	Counters._Bottom = _mm256_sub_epi32(Counters._Bottom, Bottom);
+	Counters._BottomRight = _mm256_sub_epi32(Counters._BottomRight, _mm256_and_si256(Right, Bottom));
+
+	// Child index is right + 2 * bottom, narrowed down to bytes
+	const __m256i Child = _mm256_sub_epi32(_mm256_setzero_si256(), _mm256_add_epi32(Right, _mm256_add_epi32(Bottom, Bottom)));
+	const __m128i Child16 = _mm_packs_epi32(_mm256_castsi256_si128(Child), _mm256_extracti128_si256(Child, 1));
+	_mm_storel_epi64(reinterpret_cast<__m128i*>(ChildIndices), _mm_packus_epi16(Child16, Child16));
+}
+
+static inline uint32_t SumLanes(__m256i Counter)
+{
+	const __m128i Sum4 = _mm_add_epi32(_mm256_castsi256_si128(Counter), _mm256_extracti128_si256(Counter, 1));
+	const __m128i Sum2 = _mm_add_epi32(Sum4, _mm_shuffle_epi32(Sum4, _MM_SHUFFLE(1, 0, 3, 2)));
+	return static_cast<uint32_t>(_mm_cvtsi128_si32(_mm_add_epi32(Sum2, _mm_shuffle_epi32(Sum2, _MM_SHUFFLE(2, 3, 0, 1)))));
+}
+#elif defined(QUAD_PARTITION_SIMD)
+// Running counts of right, bottom and bottom right particles, one per lane
+struct ChildQuadCounters
+{
+	__m128i _Right = _mm_setzero_si128();
+	__m128i _Bottom = _mm_setzero_si128();
+	__m128i _BottomRight = _mm_setzero_si128();
 };
 
-bool Quad::AllocateChildQuads()
+// Classify 4 particles at once, returning their child indices and adding to the counts
+static inline __m128i ClassifyFour(const float* PosX, const float* PosY, const uint32_t* Indices,
+	__m128 MidX, __m128 MidY, ChildQuadCounters& Counters)
 {
-	_ChildQuads = _QuadPool->GetFourQuads();
+	const __m128 x = _mm_setr_ps(PosX[Indices[0]], PosX[Indices[1]], PosX[Indices[2]], PosX[Indices[3]]);
+	const __m128 y = _mm_setr_ps(PosY[Indices[0]], PosY[Indices[1]], PosY[Indices[2]], PosY[Indices[3]]);
+
+	// Comparisons give -1 in lanes where they are true
+	const __m128i Right = _mm_castps_si128(_mm_cmpge_ps(x, MidX));
+	const __m128i Bottom = _mm_castps_si128(_mm_cmpge_ps(y, MidY));
+	Counters._Right = _mm_sub_epi32(Counters._Right, Right);
+	Counters._Bottom = _mm_sub_epi32(Counters._Bottom, Bottom);
+	Counters._BottomRight = _mm_sub_epi32(Counters._BottomRight, _mm_and_si128(Right, Bottom));
+
+	// Child index is right + 2 * bottom
+	return _mm_sub_epi32(_mm_setzero_si128(), _mm_add_epi32(Right, _mm_add_epi32(Bottom, Bottom)));
+}
+
+// Classify 8 particles as two groups of 4, writing their child indices as bytes and adding to the counts
+static inline void ClassifyEight(const float* PosX, const float* PosY, const uint32_t* Indices,
+	__m128 MidX, __m128 MidY, uint8_t* ChildIndices, ChildQuadCounters& Counters)
+{
+	const __m128i Child16 = _mm_packs_epi32(ClassifyFour(PosX, PosY, Indices, MidX, MidY, Counters),
+		ClassifyFour(PosX, PosY, Indices + 4, MidX, MidY, Counters));
+	_mm_storel_epi64(reinterpret_cast<__m128i*>(ChildIndices), _mm_packus_epi16(Child16, Child16));
+}
+
+static inline uint32_t SumLanes(__m128i Counter)
+{
+	const __m128i Sum2 = _mm_add_epi32(Counter, _mm_shuffle_epi32(Counter, _MM_SHUFFLE(1, 0, 3, 2)));
+	return static_cast<uint32_t>(_mm_cvtsi128_si32(_mm_add_epi32(Sum2, _mm_shuffle_epi32(Sum2, _MM_SHUFFLE(2, 3, 0, 1)))));
+}
+#endif
+
+// Ranges smaller than this are partitioned with plain comparisons
+static const uint32_t _MinWidePartitionCount = 64;
+
+// Child index of every particle in the range being partitioned, per thread so any thread can partition
+static thread_local std::vector<uint8_t> ChildIndexScratch;
+
+// Partition a range of particle indices into the 4 child quads in place. In one pass every particle
+// is classified from its position and counted, then particles outside their child's range are swapped
+// into it using only the stored child indices. The index buffer keeps its order between sorts, so
+// most particles are already in place
+static void PartitionIntoChildQuads(const float* PosX, const float* PosY, float MidX, float MidY,
+	uint32_t* Indices, uint32_t Count, uint32_t ChildCounts[4])
+{
+	// Small ranges aren't worth the classify pass, split them by y then x as they are
+	if (Count < _MinWidePartitionCount)
+	{
+		const auto IsTop = [PosY, MidY](uint32_t Index) { return *(PosY + Index) < MidY; };
+		const auto IsLeft = [PosX, MidX](uint32_t Index) { return *(PosX + Index) < MidX; };
+		uint32_t* const BottomBegin = std::partition(Indices, Indices + Count, IsTop);
+		uint32_t* const TopRightBegin = std::partition(Indices, BottomBegin, IsLeft);
+		uint32_t* const BottomRightBegin = std::partition(BottomBegin, Indices + Count, IsLeft);
+		ChildCounts[0] = static_cast<uint32_t>(TopRightBegin - Indices);
+		ChildCounts[1] = static_cast<uint32_t>(BottomBegin - TopRightBegin);
+		ChildCounts[2] = static_cast<uint32_t>(BottomRightBegin - BottomBegin);
+		ChildCounts[3] = static_cast<uint32_t>(Indices + Count - BottomRightBegin);
+		return;
+	}
+
+	if (ChildIndexScratch.size() < Count)
+	{
+		ChildIndexScratch.resize(Count);
+	}
+	uint8_t* ChildIndices = ChildIndexScratch.data();
+
+	uint32_t Counts[4] = { 0, 0, 0, 0 };
+	uint32_t i = 0;
+
+#ifdef QUAD_PARTITION_SIMD
+#if defined(__AVX2__)
+	const __m256 MidXWide = _mm256_set1_ps(MidX);
+	const __m256 MidYWide = _mm256_set1_ps(MidY);
+#else
+	const __m128 MidXWide = _mm_set1_ps(MidX);
+	const __m128 MidYWide = _mm_set1_ps(MidY);
+#endif
+	const uint32_t WideCount = Count & ~7u;
+
+	// Classify 8 particles at a time
+	ChildQuadCounters Counters;
+	for (; i < WideCount; i += 8)
+	{
+		ClassifyEight(PosX, PosY, Indices + i, MidXWide, MidYWide, ChildIndices + i, Counters);
+	}
+	Counts[3] = SumLanes(Counters._BottomRight);
+	Counts[2] = SumLanes(Counters._Bottom) - Counts[3];
+	Counts[1] = SumLanes(Counters._Right) - Counts[3];
+	Counts[0] = WideCount - Counts[1] - Counts[2] - Counts[3];
+#endif
+	for (; i < Count; ++i)
+	{
+		const uint32_t Index = Indices[i];
+		ChildIndices[i] = static_cast<uint8_t>(GetChildQuadIndex(*(PosX + Index), *(PosY + Index), MidX, MidY));
+		++Counts[ChildIndices[i]];
+	}
+
+	// Next unsorted slot and end of each child's range
+	uint32_t Heads[4] = { 0, Counts[0], Counts[0] + Counts[1], Counts[0] + Counts[1] + Counts[2] };
+	const uint32_t Ends[4] = { Heads[1], Heads[2], Heads[3], Count };
+
+	// Swap pass, once the first 3 ranges are filled the last one is too
+	for (unsigned Child = 0; Child < 3; ++Child)
+	{
+		uint32_t& Head = Heads[Child];
+#ifdef QUAD_PARTITION_SIMD
+		const __m128i ChildWide = _mm_set1_epi8(static_cast<char>(Child));
+#endif
+		while (Head < Ends[Child])
+		{
+#ifdef QUAD_PARTITION_SIMD
+			// Step over 16 at a time while they all belong to this child
+			if (Head + 16 <= Ends[Child] && _mm_movemask_epi8(_mm_cmpeq_epi8(
+				_mm_loadu_si128(reinterpret_cast<const __m128i*>(ChildIndices + Head)), ChildWide)) == 0xFFFF)
+			{
+				Head += 16;
+				continue;
+			}
+#endif
+			const uint8_t TargetChild = ChildIndices[Head];
+			if (TargetChild == Child)
+			{
+				++Head;
+				continue;
+			}
+
+			// Skip particles already in the target child's range, there must be a slot
+			// in it holding a particle from elsewhere since this one belongs there
+			uint32_t& TargetHead = Heads[TargetChild];
+			while (ChildIndices[TargetHead] == TargetChild)
+			{
+				++TargetHead;
+			}
+
+			// Swap into the target child's range, the particle swapped back is checked next
+			std::swap(Indices[Head], Indices[TargetHead]);
+			std::swap(ChildIndices[Head], ChildIndices[TargetHead]);
+			++TargetHead;
+		}
+	}
 
-	return _ChildQuads != nullptr;
+	for (unsigned c = 0; c < 4; ++c)
+	{
+		ChildCounts[c] = Counts[c];
+	}
 }
 
-void Quad::SortChildQuads()
+void QuadTree::SortChildQuads(Quad* CurrentQuad) const
 {
-	// Create Child quads
-	float MidX = _l + ((_r - _l) / 2);
-	float MidY = _b + ((_t - _b) / 2);
+	InitialiseChildQuads(CurrentQuad);
+
+	const float MidX = GetMidX(CurrentQuad);
+	const float MidY = GetMidY(CurrentQuad);
+
+	uint32_t ChildCounts[4];
+	PartitionIntoChildQuads(_ParticleContainer->_PosX, _ParticleContainer->_PosY, MidX, MidY,
+		GetObjectIndices(CurrentQuad), CurrentQuad->_ObjectCount, ChildCounts);
 
+	uint32_t ChildBegin = CurrentQuad->_FirstObject;
 	for (unsigned i = 0; i < 4; ++i)
 	{
-		// Calculate boundaries of new quads
-		float l, t, r, b;
+		(CurrentQuad->_ChildQuads + i)->_FirstObject = ChildBegin;
+		(CurrentQuad->_ChildQuads + i)->_ObjectCount = ChildCounts[i];
+		ChildBegin += ChildCounts[i];
+	}
+}
+
+bool QuadTree::IsTooFull(const Quad* CurrentQuad) const
+{
+	return CurrentQuad->_ObjectCount > _Capacity;
+}
+
+bool QuadTree::CanBreak(const Quad* CurrentQuad) const
+{
+	return(CurrentQuad->_Depth < _MaxDepth
+		&& _ParticleContainer->_ParticleDiameter <= _QuadWidths[CurrentQuad->_Depth + 1u]
+		&& _ParticleContainer->_ParticleDiameter <= std::fabs(_QuadHeights[CurrentQuad->_Depth + 1u]));
+}
 
-		if ((i % 2) == 0)
+bool QuadTree::ShouldBreak(const Quad* CurrentQuad) const
+{
+	return(CanBreak(CurrentQuad) && IsTooFull(CurrentQuad));
+}
+
+static QuadBounds GetTopSearchBounds()
+{
+	const float Infinity = std::numeric_limits<float>::infinity();
+	return { -Infinity, -Infinity, Infinity, Infinity };
+}
+
+// Adds a particle to the query results if there is room, always counting it
+static inline void AddQueryResult(uint32_t Index, uint32_t* Out, size_t OutCapacity, size_t& Found)
+{
+	if (Found < OutCapacity)
+	{
+		*(Out + Found) = Index;
+	}
+	++Found;
+}
+
+static void QueryRectInQuad(const QuadTree& Tree, const Quad* CurrentQuad, const QuadBounds& Bounds,
+	float l, float t, float r, float b, uint32_t* Out, size_t OutCapacity, size_t& Found)
+{
+	// Skip quads the rectangle doesn't touch
+	if (Bounds._l > r || Bounds._r < l || Bounds._t > b || Bounds._b < t)
+	{
+		return;
+	}
+
+	// Every particle of a quad inside the rectangle is a result, broken quads keep their
+	// children's particles in their range
+	if (Bounds._l >= l && Bounds._r <= r && Bounds._t >= t && Bounds._b <= b)
+	{
+		const uint32_t* ObjectIndices = Tree.GetObjectIndices(CurrentQuad);
+		for (uint32_t i = 0; i < CurrentQuad->_ObjectCount; ++i)
 		{
-			l = _l;
-			r = MidX;
+			AddQueryResult(*(ObjectIndices + i), Out, OutCapacity, Found);
 		}
-		else
+		return;
+	}
+
+	if (CurrentQuad->_ChildQuads)
+	{
+		const float MidX = Tree.GetMidX(CurrentQuad);
+		const float MidY = Tree.GetMidY(CurrentQuad);
+		for (unsigned i = 0; i < 4; ++i)
 		{
-			l = MidX;
-			r = _r;
+			QueryRectInQuad(Tree, CurrentQuad->_ChildQuads + i, Bounds.GetChildBounds(MidX, MidY, i),
+				l, t, r, b, Out, OutCapacity, Found);
 		}
-		if (i < 2)
+		return;
+	}
+
+	const float* PosX = Tree._ParticleContainer->_PosX;
+	const float* PosY = Tree._ParticleContainer->_PosY;
+	const uint32_t* ObjectIndices = Tree.GetObjectIndices(CurrentQuad);
+	for (uint32_t i = 0; i < CurrentQuad->_ObjectCount; ++i)
+	{
+		const uint32_t Index = *(ObjectIndices + i);
+		const float x = *(PosX + Index);
+		const float y = *(PosY + Index);
+		if (x >= l && x <= r && y >= t && y <= b)
 		{
-			t = _t;
-			b = MidY;
+			AddQueryResult(Index, Out, OutCapacity, Found);
 		}
-		else
+	}
+}
+
+static void QueryRadiusInQuad(const QuadTree& Tree, const Quad* CurrentQuad, const QuadBounds& Bounds,
+	float x, float y, float RadiusSquared, uint32_t* Out, size_t OutCapacity, size_t& Found)
+{
+	// Skip quads where the closest point to the centre is outside the radius
+	const float ClosestX = std::max(std::max(Bounds._l - x, x - Bounds._r), 0.f);
+	const float ClosestY = std::max(std::max(Bounds._t - y, y - Bounds._b), 0.f);
+	if (ClosestX * ClosestX + ClosestY * ClosestY > RadiusSquared)
+	{
+		return;
+	}
+
+	// Every particle of a quad is a result when its furthest corner is inside the radius
+	const float FurthestX = std::max(x - Bounds._l, Bounds._r - x);
+	const float FurthestY = std::max(y - Bounds._t, Bounds._b - y);
+	if (FurthestX * FurthestX + FurthestY * FurthestY <= RadiusSquared)
+	{
+		const uint32_t* ObjectIndices = Tree.GetObjectIndices(CurrentQuad);
+		for (uint32_t i = 0; i < CurrentQuad->_ObjectCount; ++i)
 		{
-			t = MidY;
-			b = _b;
+			AddQueryResult(*(ObjectIndices + i), Out, OutCapacity, Found);
 		}
+		return;
+	}
 
-		// Initialise the quads with their boundaries and global capacity
-		*(_ChildQuads + i) = Quad::Quad(_ParticleContainer, this, _QuadPool, _Capacity, l, t, r, b, false, ++_Depth);
+	if (CurrentQuad->_ChildQuads)
+	{
+		const float MidX = Tree.GetMidX(CurrentQuad);
+		const float MidY = Tree.GetMidY(CurrentQuad);
+		for (unsigned i = 0; i < 4; ++i)
+		{
+			QueryRadiusInQuad(Tree, CurrentQuad->_ChildQuads + i, Bounds.GetChildBounds(MidX, MidY, i),
+				x, y, RadiusSquared, Out, OutCapacity, Found);
+		}
+		return;
+	}
 
+	const float* PosX = Tree._ParticleContainer->_PosX;
+	const float* PosY = Tree._ParticleContainer->_PosY;
+	const uint32_t* ObjectIndices = Tree.GetObjectIndices(CurrentQuad);
+	for (uint32_t i = 0; i < CurrentQuad->_ObjectCount; ++i)
+	{
+		const uint32_t Index = *(ObjectIndices + i);
+		const float DistanceX = *(PosX + Index) - x;
+		const float DistanceY = *(PosY + Index) - y;
+		if (DistanceX * DistanceX + DistanceY * DistanceY <= RadiusSquared)
+		{
+			AddQueryResult(Index, Out, OutCapacity, Found);
+		}
 	}
-	// Populate Child Quads with objects with objects
-	if (_IsTopQuad)
+}
+
+size_t QuadTree::QueryRect(float l, float t, float r, float b, uint32_t* Out, size_t OutCapacity) const
+{
+	size_t Found = 0;
+	QueryRectInQuad(*this, &_TopQuad, GetTopSearchBounds(), l, t, r, b, Out, OutCapacity, Found);
+	return Found;
+}
+
+size_t QuadTree::QueryRadius(float x, float y, float Radius, uint32_t* Out, size_t OutCapacity) const
+{
+	size_t Found = 0;
+	if (Radius >= 0.f)
 	{
-		// Add object indices from entire particle container
-		for (size_t i = 0; i < _ParticleContainer->_MaxParticles; ++i)
+		QueryRadiusInQuad(*this, &_TopQuad, GetTopSearchBounds(), x, y, Radius * Radius, Out, OutCapacity, Found);
+	}
+	return Found;
+}
+
+static inline CollisionPair MakeCollisionPair(uint32_t a, uint32_t b)
+{
+	return a < b ? CollisionPair{ a, b } : CollisionPair{ b, a };
+}
+
+// Finds particles in leaves after FromLeaf in the index buffer that overlap a particle of FromLeaf,
+// SearchArea covers every particle of FromLeaf grown by a diameter
+static void FindCollisionPairsInQuad(const QuadTree& Tree, const Quad* CurrentQuad, const QuadBounds& Bounds, const Quad* FromLeaf,
+	const QuadBounds& SearchArea, float DiameterSquared, std::vector<CollisionPair>& OutPairs)
+{
+	// Skip quads whose whole range comes before the leaf, those pairs are found from the other side
+	if (CurrentQuad->_FirstObject + CurrentQuad->_ObjectCount <= FromLeaf->_FirstObject || CurrentQuad == FromLeaf)
+	{
+		return;
+	}
+
+	// Skip quads too far away to hold an overlapping particle
+	if (Bounds._l > SearchArea._r || Bounds._r < SearchArea._l || Bounds._t > SearchArea._b || Bounds._b < SearchArea._t)
+	{
+		return;
+	}
+
+	if (CurrentQuad->_ChildQuads)
+	{
+		const float MidX = Tree.GetMidX(CurrentQuad);
+		const float MidY = Tree.GetMidY(CurrentQuad);
+		for (unsigned i = 0; i < 4; ++i)
+		{
+			FindCollisionPairsInQuad(Tree, CurrentQuad->_ChildQuads + i, Bounds.GetChildBounds(MidX, MidY, i),
+				FromLeaf, SearchArea, DiameterSquared, OutPairs);
+		}
+		return;
+	}
+
+	// Test every particle of the leaf against this one, leaves are small
+	const float* PosX = Tree._ParticleContainer->_PosX;
+	const float* PosY = Tree._ParticleContainer->_PosY;
+	const uint32_t* FromIndices = Tree.GetObjectIndices(FromLeaf);
+	const uint32_t* ObjectIndices = Tree.GetObjectIndices(CurrentQuad);
+	for (uint32_t i = 0; i < FromLeaf->_ObjectCount; ++i)
+	{
+		const uint32_t Index = *(FromIndices + i);
+		const float x = *(PosX + Index);
+		const float y = *(PosY + Index);
+
+		for (uint32_t j = 0; j < CurrentQuad->_ObjectCount; ++j)
 		{
-			for (unsigned j = 0; j < 4; ++j)
+			const uint32_t OtherIndex = *(ObjectIndices + j);
+			const float DistanceX = *(PosX + OtherIndex) - x;
+			const float DistanceY = *(PosY + OtherIndex) - y;
+			if (DistanceX * DistanceX + DistanceY * DistanceY < DiameterSquared)
 			{
-				if ((_ChildQuads + j)->TryAddObjectIndex(i))
-				{
-					// Move onto next index if it has been moved
-					break;
-				}
+				OutPairs.push_back(MakeCollisionPair(Index, OtherIndex));
 			}
 		}
 	}
-	else
+}
+
+void QuadTree::FindCollisionPairs(const Quad* Leaf, std::vector<CollisionPair>& OutPairs) const
+{
+	const float* PosX = _ParticleContainer->_PosX;
+	const float* PosY = _ParticleContainer->_PosY;
+	const float Diameter = _ParticleContainer->_ParticleDiameter;
+	const float DiameterSquared = Diameter * Diameter;
+
+	// Area holding every particle of this leaf
+	const float Infinity = std::numeric_limits<float>::infinity();
+	QuadBounds SearchArea = { Infinity, Infinity, -Infinity, -Infinity };
+
+	const uint32_t* ObjectIndices = GetObjectIndices(Leaf);
+	for (uint32_t i = 0; i < Leaf->_ObjectCount; ++i)
 	{
-		// Add object indices from child indices list
-		for (size_t i = 0; i < _ChildObjectIndices.size(); ++i)
+		const uint32_t Index = *(ObjectIndices + i);
+		const float x = *(PosX + Index);
+		const float y = *(PosY + Index);
+		SearchArea = { std::min(SearchArea._l, x), std::min(SearchArea._t, y), std::max(SearchArea._r, x), std::max(SearchArea._b, y) };
+
+		// Pairs inside this leaf
+		for (uint32_t j = i + 1; j < Leaf->_ObjectCount; ++j)
 		{
-			for (unsigned j = 0; j < 4; ++j)
+			const uint32_t OtherIndex = *(ObjectIndices + j);
+			const float DistanceX = *(PosX + OtherIndex) - x;
+			const float DistanceY = *(PosY + OtherIndex) - y;
+			if (DistanceX * DistanceX + DistanceY * DistanceY < DiameterSquared)
 			{
-				if ((_ChildQuads + j)->TryAddObjectIndex(_ChildObjectIndices[i]))
+				OutPairs.push_back(MakeCollisionPair(Index, OtherIndex));
+			}
+		}
+	}
+
+	// Particles in other leaves can only overlap when within a diameter of this area
+	SearchArea = { SearchArea._l - Diameter, SearchArea._t - Diameter, SearchArea._r + Diameter, SearchArea._b + Diameter };
+
+	// Start from the lowest quad holding the whole area, particles outside of it are too far away.
+	// Particles away from the sides of the leaf need nothing searched at all
+	const Quad* StartQuad = Leaf;
+	QuadBounds StartBounds = GetBounds(StartQuad);
+	while (StartQuad->_Depth > 0 && !(StartBounds._l <= SearchArea._l && StartBounds._r >= SearchArea._r
+		&& StartBounds._t <= SearchArea._t && StartBounds._b >= SearchArea._b))
+	{
+		StartQuad = StartQuad->_ParentQuad;
+		StartBounds = GetBounds(StartQuad);
+	}
+
+	FindCollisionPairsInQuad(*this, StartQuad, StartBounds, Leaf, SearchArea, DiameterSquared, OutPairs);
+}
+
+// Quad waiting to be searched by FindNearest and the closest any of its particles can be
+struct NearestQuad
+{
+	float _DistanceSquared;
+	const Quad* _Quad;
+	QuadBounds _Bounds;
+};
+
+// Particle found by FindNearest
+struct NearestParticle
+{
+	float _DistanceSquared;
+	uint32_t _Index;
+};
+
+// Heaps used by FindNearest, per thread so searches don't allocate once they have grown
+static thread_local std::vector<NearestQuad> NearestQuadHeap;
+static thread_local std::vector<NearestParticle> NearestParticleHeap;
+
+size_t QuadTree::FindNearest(float x, float y, size_t K, uint32_t ExcludeIndex, uint32_t* Out) const
+{
+	if (K == 0)
+	{
+		return 0;
+	}
+
+	// Quads are searched closest first, and the particles found are kept in a heap with the furthest on top
+	const auto CloserQuad = [](const NearestQuad& a, const NearestQuad& b) { return a._DistanceSquared > b._DistanceSquared; };
+	const auto CloserParticle = [](const NearestParticle& a, const NearestParticle& b) { return a._DistanceSquared < b._DistanceSquared; };
+
+	std::vector<NearestQuad>& QuadHeap = NearestQuadHeap;
+	std::vector<NearestParticle>& ParticleHeap = NearestParticleHeap;
+	QuadHeap.clear();
+	ParticleHeap.clear();
+	QuadHeap.push_back({ 0.f, &_TopQuad, GetTopSearchBounds() });
+
+	const float* PosX = _ParticleContainer->_PosX;
+	const float* PosY = _ParticleContainer->_PosY;
+
+	while (!QuadHeap.empty())
+	{
+		std::pop_heap(QuadHeap.begin(), QuadHeap.end(), CloserQuad);
+		const NearestQuad Next = QuadHeap.back();
+		QuadHeap.pop_back();
+
+		// Every quad left is further away than the K particles already found
+		if (ParticleHeap.size() == K && Next._DistanceSquared >= ParticleHeap.front()._DistanceSquared)
+		{
+			break;
+		}
+
+		const Quad* CurrentQuad = Next._Quad;
+		if (CurrentQuad->_ChildQuads)
+		{
+			const float MidX = GetMidX(CurrentQuad);
+			const float MidY = GetMidY(CurrentQuad);
+			for (unsigned i = 0; i < 4; ++i)
+			{
+				const QuadBounds ChildBounds = Next._Bounds.GetChildBounds(MidX, MidY, i);
+				const float ClosestX = std::max(std::max(ChildBounds._l - x, x - ChildBounds._r), 0.f);
+				const float ClosestY = std::max(std::max(ChildBounds._t - y, y - ChildBounds._b), 0.f);
+				const float DistanceSquared = ClosestX * ClosestX + ClosestY * ClosestY;
+
+				if ((CurrentQuad->_ChildQuads + i)->_ObjectCount > 0
+					&& (ParticleHeap.size() < K || DistanceSquared < ParticleHeap.front()._DistanceSquared))
 				{
-					// Move onto next index if it has been moved
-					break;
+					QuadHeap.push_back({ DistanceSquared, CurrentQuad->_ChildQuads + i, ChildBounds });
+					std::push_heap(QuadHeap.begin(), QuadHeap.end(), CloserQuad);
 				}
 			}
+			continue;
+		}
+
+		const uint32_t* ObjectIndices = GetObjectIndices(CurrentQuad);
+		for (uint32_t i = 0; i < CurrentQuad->_ObjectCount; ++i)
+		{
+			const uint32_t Index = *(ObjectIndices + i);
+			const float DistanceX = *(PosX + Index) - x;
+			const float DistanceY = *(PosY + Index) - y;
+			const float DistanceSquared = DistanceX * DistanceX + DistanceY * DistanceY;
+			if (Index == ExcludeIndex)
+			{
+				continue;
+			}
+
+			// Replace the furthest particle found once there are K of them
+			if (ParticleHeap.size() < K)
+			{
+				ParticleHeap.push_back({ DistanceSquared, Index });
+				std::push_heap(ParticleHeap.begin(), ParticleHeap.end(), CloserParticle);
+			}
+			else if (DistanceSquared < ParticleHeap.front()._DistanceSquared)
+			{
+				std::pop_heap(ParticleHeap.begin(), ParticleHeap.end(), CloserParticle);
+				ParticleHeap.back() = { DistanceSquared, Index };
+				std::push_heap(ParticleHeap.begin(), ParticleHeap.end(), CloserParticle);
+			}
 		}
 	}
 
-	// Clear list of child indices NOTE: Would need changing if sorted objects varied in size
-	_ChildObjectIndices.clear();
+	// Sorting the heap puts the closest first
+	std::sort_heap(ParticleHeap.begin(), ParticleHeap.end(), CloserParticle);
+	for (size_t i = 0; i < ParticleHeap.size(); ++i)
+	{
+		*(Out + i) = ParticleHeap[i]._Index;
+	}
+	return ParticleHeap.size();
 }
 
-bool Quad::IsTooFull()
+static bool AreLeafParticlesInside(const QuadTree& Tree, const Quad* CurrentQuad, std::vector<bool>& Seen, size_t& SeenCount)
 {
-	if (_IsTopQuad)
+	if (CurrentQuad->_ChildQuads)
 	{
-		return _ParticleContainer->_MaxParticles > _Capacity;
+		for (unsigned i = 0; i < 4; ++i)
+		{
+			if (!AreLeafParticlesInside(Tree, CurrentQuad->_ChildQuads + i, Seen, SeenCount))
+			{
+				return false;
+			}
+		}
+		return true;
 	}
-	else
+
+	const float* PosX = Tree._ParticleContainer->_PosX;
+	const float* PosY = Tree._ParticleContainer->_PosY;
+	const uint32_t* ObjectIndices = Tree.GetObjectIndices(CurrentQuad);
+	for (uint32_t i = 0; i < CurrentQuad->_ObjectCount; ++i)
 	{
-		return _ChildObjectIndices.size() > _Capacity;
+		// An index past the container or already held by another leaf means the sort lost track of a particle
+		const uint32_t Index = *(ObjectIndices + i);
+		if (Index >= Seen.size() || Seen[Index])
+		{
+			return false;
+		}
+		Seen[Index] = true;
+		++SeenCount;
+
+		if (!Tree.IsInsideQuad(CurrentQuad, *(PosX + Index), *(PosY + Index)))
+		{
+			return false;
+		}
 	}
+	return true;
 }
 
-bool Quad::ShouldBreak()
+bool QuadTree::AreLeavesSorted() const
 {
-	return(_ParticleContainer->_ParticleDiameter <= _Width / 2 
-		&& _ParticleContainer->_ParticleDiameter <= _Height / 2 
-		&& IsTooFull());
+	// Leaves holding every particle exactly once also means none were dropped
+	std::vector<bool> Seen(_ParticleContainer->_MaxParticles, false);
+	size_t SeenCount = 0;
+	return AreLeafParticlesInside(*this, &_TopQuad, Seen, SeenCount) && SeenCount == Seen.size();
 }
 
-bool Quad::TryAddObjectIndex(size_t index)
-{
-	// TODO : CHECK Y DIRECTION WHEN RENDERING WITH VULKAN
-	float x = *(_ParticleContainer->_PosX + index);
-	float y = *(_ParticleContainer->_PosY + index);
+// Source of unique epochs across every pool, so a thread's chunk can't be mistaken
+// for one from another pool or from before a reset
+static std::atomic<unsigned long long> NextQuadPoolEpoch(1);
 
+// The chunk of quads the current thread is allocating from
+struct QuadPoolCursor
+{
+	unsigned long long _Epoch = 0;
+	Quad* _Next = nullptr;
+	Quad* _End = nullptr;
+};
+static thread_local QuadPoolCursor CurrentQuadChunk;
 
-	if (x > _l && x < _r && y < _b && y > _t 
-		&& _ParticleContainer->_ParticleDiameter <= _Width
-		&& _ParticleContainer->_ParticleDiameter <= _Height)
+// Allocates zeroed memory aligned for huge pages. Zeroing it here makes the calling thread
+// the first to touch every page, so the pages are placed on that thread's NUMA node
+static Quad* AllocateSlabMemory(size_t Size)
+{
+	void* Memory = nullptr;
+#ifdef _WIN32
+	Memory = _aligned_malloc(Size, QuadPool::_SlabAlignment);
+#else
+	if (posix_memalign(&Memory, QuadPool::_SlabAlignment, Size))
 	{
-		_ChildObjectIndices.push_back(index);
-		return true;
+		Memory = nullptr;
+	}
+#ifdef MADV_HUGEPAGE
+	if (Memory)
+	{
+		madvise(Memory, Size, MADV_HUGEPAGE);
+	}
+#endif
+#endif
+	if (Memory)
+	{
+		memset(Memory, 0, Size);
 	}
-	return false;
+	return static_cast<Quad*>(Memory);
 }
 
+static void FreeSlabMemory(Quad* Memory)
+{
+#ifdef _WIN32
+	_aligned_free(Memory);
+#else
+	free(Memory);
+#endif
+}
 
 QuadPool::QuadPool()
-	:_End(0)
-{}
+	:_Epoch(NextQuadPoolEpoch.fetch_add(1))
+{
+	pthread_mutex_init(&_Slab_mutex, NULL);
+	for (NodeArena& Arena : _Arenas)
+	{
+		for (unsigned i = 0; i < _MaxSlabs; ++i)
+		{
+			Arena._Slabs[i].store(nullptr, std::memory_order_relaxed);
+		}
+		Arena._NextChunk.store(0, std::memory_order_relaxed);
+	}
+}
 
 QuadPool::~QuadPool()
 {
-	for (int i = 0; i < _QuadPages.size(); ++i)
+	for (NodeArena& Arena : _Arenas)
+	{
+		for (unsigned i = 0; i < _MaxSlabs; ++i)
+		{
+			FreeSlabMemory(Arena._Slabs[i].load(std::memory_order_relaxed));
+		}
+	}
+	pthread_mutex_destroy(&_Slab_mutex);
+}
+
+void QuadPool::Reserve(size_t QuadCount, unsigned Node)
+{
+	const size_t ChunkQuads = _ChunkSize * _PageSize;
+	const size_t ChunkCount = (QuadCount + ChunkQuads - 1) / ChunkQuads;
+
+	// Allocate every slab up to the one holding the last chunk needed
+	unsigned FirstChunkInSlab = 0;
+	const unsigned LastSlab = ChunkCount > 0 ? GetSlabIndex(static_cast<unsigned>(ChunkCount - 1), FirstChunkInSlab) : 0;
+	for (unsigned i = 0; i <= LastSlab && i < _MaxSlabs; ++i)
 	{
-		free(_QuadPages[i]);
+		GetSlab(Node, i);
 	}
 }
 
 void QuadPool::Reset()
 {
-	_End = 0;
+	for (NodeArena& Arena : _Arenas)
+	{
+		Arena._NextChunk.store(0, std::memory_order_relaxed);
+	}
+	_Epoch.store(NextQuadPoolEpoch.fetch_add(1), std::memory_order_relaxed);
 }
 
 Quad* QuadPool::GetFourQuads()
 {
-	if (_End < _QuadPages.size())
+	QuadPoolCursor& Cursor = CurrentQuadChunk;
+
+	// Take a new chunk if this thread's chunk is used up or came from another pool or reset
+	if (Cursor._Epoch != _Epoch.load(std::memory_order_relaxed) || Cursor._Next == Cursor._End)
+	{
+		Quad* Chunk = GetChunk(ThreadAffinity::GetCurrentNode());
+		if (!Chunk)
+		{
+			return nullptr;
+		}
+		Cursor._Epoch = _Epoch.load(std::memory_order_relaxed);
+		Cursor._Next = Chunk;
+		Cursor._End = Chunk + _ChunkSize * _PageSize;
+	}
+
+	Quad* FourQuads = Cursor._Next;
+	Cursor._Next += _PageSize;
+	return FourQuads;
+}
+
+Quad* QuadPool::GetChunk(unsigned Node)
+{
+	Node = std::min(Node, _MaxNodes - 1);
+	const unsigned ChunkIndex = _Arenas[Node]._NextChunk.fetch_add(1, std::memory_order_relaxed);
+
+	unsigned FirstChunkInSlab = 0;
+	const unsigned SlabIndex = GetSlabIndex(ChunkIndex, FirstChunkInSlab);
+	if (SlabIndex >= _MaxSlabs)
+	{
+		return nullptr;
+	}
+
+	Quad* Slab = GetSlab(Node, SlabIndex);
+	if (!Slab)
 	{
-		return _QuadPages[_End++];
+		return nullptr;
 	}
+	return Slab + static_cast<size_t>(ChunkIndex - FirstChunkInSlab) * _ChunkSize * _PageSize;
+}
 
-	_QuadPages.emplace_back(static_cast<Quad*>(calloc(_PageSize, sizeof(Quad))));
+unsigned QuadPool::GetSlabIndex(unsigned ChunkIndex, unsigned& FirstChunkInSlab)
+{
+	// Slab i holds _FirstSlabChunks << i chunks
+	unsigned SlabIndex = 0;
+	unsigned SlabChunks = _FirstSlabChunks;
+	FirstChunkInSlab = 0;
+	while (ChunkIndex - FirstChunkInSlab >= SlabChunks && SlabIndex < _MaxSlabs)
+	{
+		FirstChunkInSlab += SlabChunks;
+		SlabChunks <<= 1;
+		++SlabIndex;
+	}
+	return SlabIndex;
+}
 
-	++_End;
+Quad* QuadPool::GetSlab(unsigned Node, unsigned SlabIndex)
+{
+	std::atomic<Quad*>* Slabs = _Arenas[std::min(Node, _MaxNodes - 1)]._Slabs;
+	Quad* Slab = Slabs[SlabIndex].load(std::memory_order_acquire);
+	if (Slab)
+	{
+		return Slab;
+	}
 
-	return _QuadPages[_QuadPages.size()-1];
+	// Several threads can reach a new slab at once, only one allocates it
+	pthread_mutex_lock(&_Slab_mutex);
+	Slab = Slabs[SlabIndex].load(std::memory_order_relaxed);
+	if (!Slab)
+	{
+		const size_t SlabQuads = (static_cast<size_t>(_FirstSlabChunks) << SlabIndex) * _ChunkSize * _PageSize;
+		Slab = AllocateSlabMemory(SlabQuads * sizeof(Quad));
+		Slabs[SlabIndex].store(Slab, std::memory_order_release);
+	}
+	pthread_mutex_unlock(&_Slab_mutex);
+	return Slab;
 }
\ No newline at end of file
@@ -1,82 +1,287 @@
 #pragma once
+#include <atomic>
+#include <cstdint>
+#include <limits>
+#include <memory>
 #include <vector>
 #include "Particle.h"
 
+#define __PTW32_STATIC_LIB
+#include "pthread.h"
+
 struct QuadPool;
 
-// Quad structure which can be used in a QuadTree to sort particles
+// Two particles whose circles overlap, _A is the lower particle index
+struct CollisionPair
+{
+	uint32_t _A;
+	uint32_t _B;
+};
+
+// Quad of a QuadTree. Everything the quads of a tree share is kept once in the QuadTree, and the
+// bounds are worked out from where the quad is in the grid of quads at its depth, so a quad is
+// 32 bytes and 2 of them fit in a cache line
 struct Quad
 {
-	Quad() = delete;
+	// Pointer to the parent quad, nullptr for the top quad
+	Quad* _ParentQuad;
+
+	// Pointer to the 4 child quads, nullptr for leaves
+	Quad* _ChildQuads;
+
+	// Range of the tree's index buffer holding the indices of the particles inside this quad,
+	// quads that have been broken keep the range covering all of their child quads
+	uint32_t _FirstObject;
+	uint32_t _ObjectCount;
+
+	// Column and row of the quad in the 2^Depth by 2^Depth grid of quads at its depth
+	uint16_t _X, _Y;
+
+	// The depth in the quad tree, 0 for the top quad
+	uint8_t _Depth;
+};
 
-	// Constructor
-	Quad(Particles* ParticleContainer, Quad* ParentQuad, QuadPool* QuadPool, size_t Capacity, 
-		float l, float t, float r, float b, bool IsTopQuad = false, int Depth = 0);
+static_assert(sizeof(Quad) <= 32, "Quads should stay small enough for 2 to fit in a cache line");
+
+// Bounds of a quad, sides on the top quad's edges are infinite since sorting
+// puts particles outside the top quad into the quads along its edges
+struct QuadBounds
+{
+	float _l, _t, _r, _b;
+
+	// Bounds of a child quad, in the same child order as InitialiseChildQuads, from the middle of its parent
+	QuadBounds GetChildBounds(float MidX, float MidY, unsigned ChildIndex) const
+	{
+		return { (ChildIndex % 2) == 0 ? _l : MidX, ChildIndex < 2 ? _t : MidY,
+			(ChildIndex % 2) == 0 ? MidX : _r, ChildIndex < 2 ? MidY : _b };
+	}
+
+	// Checks a position is inside with the same rules as sorting, positions on a side go right and down
+	bool Contains(float x, float y) const
+	{
+		return x >= _l && x < _r && y >= _t && y < _b;
+	}
+};
+
+// Quad tree over a particle container. Holds the data every quad of the tree shares and
+// the operations on its quads that need that data
+struct QuadTree
+{
+	QuadTree() = delete;
 
-	// Allocates Quads from the global QuadPool, is critical, returns false if allocation failed
-	bool AllocateChildQuads();
+	// Constructor, the top quad covers the given bounds. A capacity of 0 is taken as 1
+	QuadTree(Particles* ParticleContainer, QuadPool* QuadPool, size_t Capacity, float l, float t, float r, float b);
 
-	// Sorts the particles into the Child Quads,
-	void SortChildQuads();
+	// Allocates Quads from the QuadPool, is critical, returns false if allocation failed
+	bool AllocateChildQuads(Quad* CurrentQuad) const;
 
-	// Check if this this Quad is over capacity
-	bool IsTooFull();
+	// Sets up the places of the Child Quads without giving them any particles
+	void InitialiseChildQuads(Quad* CurrentQuad) const;
+
+	// Sorts the particles into the Child Quads, partitioning the quad's index range in place
+	// so each child is handed a contiguous part of it
+	void SortChildQuads(Quad* CurrentQuad) const;
+
+	// Check if a Quad is over capacity
+	bool IsTooFull(const Quad* CurrentQuad) const;
+
+	// Check if particles would fit into child quads
+	bool CanBreak(const Quad* CurrentQuad) const;
 
 	// Check if the Quad is too full and if particles would fit into child quads
-	bool ShouldBreak();
+	bool ShouldBreak(const Quad* CurrentQuad) const;
 
-	// Check if the origin of an object is within the bounds of this quad, and add it if it is
-	// Return true = Is within bounds and was added
-	bool TryAddObjectIndex(size_t index);
+	// Index of the child quad a position is sorted into, bit 0 is right and bit 1 is bottom
+	unsigned GetChildIndex(const Quad* CurrentQuad, float x, float y) const;
 
-	// Pointer to the particle container storing particle data
-	Particles* _ParticleContainer = nullptr;
+	// Bounds of a quad, worked out from its column, row and depth
+	QuadBounds GetBounds(const Quad* CurrentQuad) const;
+
+	// Checks a position is in a quad with the same rules as sorting, sides on the top quad's edges don't limit it
+	bool IsInsideQuad(const Quad* CurrentQuad, float x, float y) const;
+
+	// Position of the left side of the quads in a column at a depth, the last column's right side is _r
+	float GetSideX(uint32_t Column, unsigned Depth) const;
+
+	// Position of the top side of the quads in a row at a depth, the last row's bottom side is _b
+	float GetSideY(uint32_t Row, unsigned Depth) const;
+
+	// Position of the side between a quad's left and right children
+	float GetMidX(const Quad* CurrentQuad) const;
+
+	// Position of the side between a quad's top and bottom children
+	float GetMidY(const Quad* CurrentQuad) const;
+
+	// Start of the quad's range of the index buffer
+	uint32_t* GetObjectIndices(const Quad* CurrentQuad) const;
+
+	// Writes the indices of particles inside the rectangle to Out, up to OutCapacity of them, and returns
+	// how many are inside, which can be more than OutCapacity. Particles outside of the top quad are found
+	// in the quads along its edges the same as sorting puts them there
+	size_t QueryRect(float l, float t, float r, float b, uint32_t* Out, size_t OutCapacity) const;
+
+	// Same as QueryRect for particles within Radius of a point
+	size_t QueryRadius(float x, float y, float Radius, uint32_t* Out, size_t OutCapacity) const;
+
+	// Appends every pair of overlapping particles with at least one particle in a leaf to OutPairs.
+	// A pair across two leaves is only found from the leaf whose range comes first in the index buffer,
+	// so running it on every leaf finds each pair once
+	void FindCollisionPairs(const Quad* Leaf, std::vector<CollisionPair>& OutPairs) const;
+
+	// Writes the indices of the K particles closest to a point to Out, closest first, and returns how many
+	// were written, fewer than K when the tree holds fewer particles. ExcludeIndex is never written so a
+	// particle's own index can be passed to find its neighbours
+	size_t FindNearest(float x, float y, size_t K, uint32_t ExcludeIndex, uint32_t* Out) const;
+
+	// Checks every particle of the container is held by exactly one leaf and is inside it by IsInsideQuad,
+	// for validating a sorted tree
+	bool AreLeavesSorted() const;
+
+	// Deepest a quad can be, so a quad's column and row fit in 16 bits
+	static const unsigned _MaxDepth = 16;
 
-	// Pointer to the parent quad
-	Quad* _ParentQuad = nullptr;
+	// Top quad to act as the parent quad for all other quads
+	Quad _TopQuad;
+
+	// Pointer to the particle container storing particle data
+	Particles* _ParticleContainer;
 
 	// Pointer to the quad pool used to get new quads allocated
-	QuadPool* _QuadPool = nullptr;
+	QuadPool* _QuadPool;
 
-	// Soft capacity of the quad
+	// Soft capacity of every quad, at least 1
 	size_t _Capacity;
 
-	// Coordinates of the sides
+	// Coordinates of the sides of the top quad
 	float _l, _t, _r, _b;
 
 	float _Width, _Height;
 
-	// Indices to particles stored inside the particle container
-	std::vector<size_t> _ChildObjectIndices;
+	// Width and height of the quads at every depth, halving each level down
+	float _QuadWidths[_MaxDepth + 1];
+	float _QuadHeights[_MaxDepth + 1];
+
+	// Frame wide index buffer every quad's range is in, must be set before sorting
+	uint32_t* _ObjectIndices;
+};
 
-	// Flag to check if this is the Top Quad with no parent
-	bool _IsTopQuad;
+// Quad sides are worked out on every step down the tree, so they are inlined where they are used
+inline float QuadTree::GetSideX(uint32_t Column, unsigned Depth) const
+{
+	return Column >= (1u << Depth) ? _r : _l + static_cast<float>(Column) * _QuadWidths[Depth];
+}
 
-	// The depth in the quad tree
-	int _Depth;
+inline float QuadTree::GetSideY(uint32_t Row, unsigned Depth) const
+{
+	return Row >= (1u << Depth) ? _b : _t + static_cast<float>(Row) * _QuadHeights[Depth];
+}
 
-	// Pointer to child quads
-	Quad* _ChildQuads = nullptr;
-};
+inline float QuadTree::GetMidX(const Quad* CurrentQuad) const
+{
+	// Same as GetSideX for the middle column of the children, which is never the last side
+	return _l + static_cast<float>(CurrentQuad->_X * 2u + 1u) * _QuadWidths[CurrentQuad->_Depth + 1u];
+}
+
+inline float QuadTree::GetMidY(const Quad* CurrentQuad) const
+{
+	return _t + static_cast<float>(CurrentQuad->_Y * 2u + 1u) * _QuadHeights[CurrentQuad->_Depth + 1u];
+}
+
+inline uint32_t* QuadTree::GetObjectIndices(const Quad* CurrentQuad) const
+{
+	return _ObjectIndices + CurrentQuad->_FirstObject;
+}
+
+inline unsigned QuadTree::GetChildIndex(const Quad* CurrentQuad, float x, float y) const
+{
+	// Same comparisons as the partition in SortChildQuads
+	return static_cast<unsigned>(x >= GetMidX(CurrentQuad)) | (static_cast<unsigned>(y >= GetMidY(CurrentQuad)) << 1);
+}
+
+inline QuadBounds QuadTree::GetBounds(const Quad* CurrentQuad) const
+{
+	const float Infinity = std::numeric_limits<float>::infinity();
+	const uint32_t LastSide = (1u << CurrentQuad->_Depth) - 1u;
+	return { CurrentQuad->_X == 0 ? -Infinity : GetSideX(CurrentQuad->_X, CurrentQuad->_Depth),
+		CurrentQuad->_Y == 0 ? -Infinity : GetSideY(CurrentQuad->_Y, CurrentQuad->_Depth),
+		CurrentQuad->_X == LastSide ? Infinity : GetSideX(CurrentQuad->_X + 1u, CurrentQuad->_Depth),
+		CurrentQuad->_Y == LastSide ? Infinity : GetSideY(CurrentQuad->_Y + 1u, CurrentQuad->_Depth) };
+}
+
+inline bool QuadTree::IsInsideQuad(const Quad* CurrentQuad, float x, float y) const
+{
+	return GetBounds(CurrentQuad).Contains(x, y);
+}
 
 
-// Quad pool to pre-allocate memory for Quads and retrieve Quads
+// Quad pool to pre-allocate memory for Quads and retrieve Quads.
+// Threads take chunks of quads from the pool with an atomic bump and then hand
+// out quads from their own chunk, so allocating quads never takes a lock.
+// Chunks are carved out of a few large slabs that double in size, so quads sit
+// next to each other in memory and nothing is allocated once the slabs are big enough.
+// Every NUMA node has its own arena of slabs, threads take chunks from the arena of the
+// node they run on and slabs are first touched by the thread allocating them
 struct QuadPool
 {
 	QuadPool();
 
 	~QuadPool();
 
-	// Reset the QuadPool so all allocated quads become free
+	// Reset the QuadPool so all allocated quads become free, must not be called while quads are being allocated
 	void Reset();
 
+	// Allocate slabs of a node's arena up front so at least this many quads can be handed out on the node
+	// without allocating. The slabs are first touched by the calling thread, so call it from a thread on the node
+	void Reserve(size_t QuadCount, unsigned Node = 0);
+
 	// Returns nullptr if there isn't any Quads Available
 	Quad* GetFourQuads();
 
-	std::vector<Quad*> _QuadPages;
+	// Claims the next chunk of quads from a node's arena, allocating its slab if it hasn't been used before
+	Quad* GetChunk(unsigned Node);
+
+	// Returns the slab a chunk index is in, and the index of the first chunk in that slab
+	static unsigned GetSlabIndex(unsigned ChunkIndex, unsigned& FirstChunkInSlab);
 
+	// Returns the memory of a slab of a node's arena, allocating it if needed
+	Quad* GetSlab(unsigned Node, unsigned SlabIndex);
+
+	// Quads are given out 4 at a time
 	static const unsigned _PageSize = 4;
 
-	unsigned _End;
-};
+	// Number of 4 quad pages a thread takes from the pool at once
+	static const unsigned _ChunkSize = 256;
+
+	// Number of chunks in the first slab, every slab after is double the size of the last
+	static const unsigned _FirstSlabChunks = 16;
+
+	// Upper limit on the number of slabs, enough for 2^24 * 16 chunks
+	static const unsigned _MaxSlabs = 24;
 
+	// Slabs are aligned to 2MB so they can be backed by huge pages
+	static const size_t _SlabAlignment = 2u * 1024u * 1024u;
+
+	// Number of node arenas, threads on higher nodes share the last one
+	static const unsigned _MaxNodes = 8;
+
+	// Size of a cache line, the counters every thread bumps or reads are kept on lines of their own
+	static const size_t _CacheLineSize = 64;
+
+	// Slabs of one node and the index of the next chunk to hand out from them
+	struct alignas(_CacheLineSize) NodeArena
+	{
+		// Slabs of chunk memory, kept between resets so they can be reused
+		std::atomic<Quad*> _Slabs[_MaxSlabs];
+
+		// Bumped by every thread taking a chunk, so it doesn't share a line with the slabs they read
+		alignas(_CacheLineSize) std::atomic<unsigned> _NextChunk;
+	};
+
+	NodeArena _Arenas[_MaxNodes];
+
+	// Only held while a new slab is allocated
+	pthread_mutex_t _Slab_mutex;
+
+	// Changed on every reset so threads know their current chunk is stale, read on every allocation
+	alignas(_CacheLineSize) std::atomic<unsigned long long> _Epoch;
+};
@@ -0,0 +1,388 @@
+#include "Scenario.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+ScenarioRandom::ScenarioRandom(uint64_t Seed)
+	:_State(Seed)
+{}
+
+uint64_t ScenarioRandom::NextUInt64()
+{
+	uint64_t Value = (_State += 0x9E3779B97F4A7C15ull);
+	Value = (Value ^ (Value >> 30)) * 0xBF58476D1CE4E5B9ull;
+	Value = (Value ^ (Value >> 27)) * 0x94D049BB133111EBull;
+	return Value ^ (Value >> 31);
+}
+
+float ScenarioRandom::NextFloat()
+{
+	// The top 24 bits fill a float's mantissa exactly, so the result never rounds up to 1
+	return static_cast<float>(NextUInt64() >> 40) * (1.f / 16777216.f);
+}
+
+float ScenarioRandom::NextGaussian()
+{
+	// Box-Muller, 1 - NextFloat is never 0 so the log is always finite
+	const double Radius = std::sqrt(-2.0 * std::log(1.0 - static_cast<double>(NextFloat())));
+	const double Angle = 6.283185307179586 * static_cast<double>(NextFloat());
+	return static_cast<float>(Radius * std::cos(Angle));
+}
+
+// Number of blobs the Clusters distribution places particles around
+static const unsigned ClusterCount = 16;
+
+// Distances from the middle of the PowerLaw distribution are a uniform number to this power
+static const float PowerLawExponent = 3.f;
+
+// Keeps a generated position inside [Min, Max), positions on the far side of the world would be outside the top quad
+static inline float ClampToWorld(float Value, float Min, float Max)
+{
+	return std::min(std::max(Value, Min), std::nextafter(Max, Min));
+}
+
+void GenerateDistribution(Particles& ParticleContainer, ParticleDistribution Distribution, uint64_t Seed,
+	float l, float t, float r, float b)
+{
+	ScenarioRandom Random(Seed);
+
+	const float Width = r - l;
+	const float Height = b - t;
+	const float MidX = l + Width * 0.5f;
+	const float MidY = t + Height * 0.5f;
+	const float Extent = std::min(Width, Height);
+	const float TwoPi = 6.28318530718f;
+
+	float* PosX = ParticleContainer._PosX;
+	float* PosY = ParticleContainer._PosY;
+	const size_t ParticleCount = ParticleContainer._MaxParticles;
+
+	switch (Distribution)
+	{
+	case ParticleDistribution::Uniform:
+		for (size_t i = 0; i < ParticleCount; ++i)
+		{
+			*(PosX + i) = ClampToWorld(l + Random.NextFloat() * Width, l, r);
+			*(PosY + i) = ClampToWorld(t + Random.NextFloat() * Height, t, b);
+		}
+		break;
+
+	case ParticleDistribution::Clusters:
+	{
+		// Blobs of different sizes, between half a percent and 3 percent of the world across
+		float CentreX[ClusterCount], CentreY[ClusterCount], Spread[ClusterCount];
+		for (unsigned c = 0; c < ClusterCount; ++c)
+		{
+			CentreX[c] = l + Random.NextFloat() * Width;
+			CentreY[c] = t + Random.NextFloat() * Height;
+			Spread[c] = Extent * (0.005f + 0.025f * Random.NextFloat());
+		}
+		for (size_t i = 0; i < ParticleCount; ++i)
+		{
+			const unsigned Cluster = static_cast<unsigned>(Random.NextUInt64() % ClusterCount);
+			*(PosX + i) = ClampToWorld(CentreX[Cluster] + Random.NextGaussian() * Spread[Cluster], l, r);
+			*(PosY + i) = ClampToWorld(CentreY[Cluster] + Random.NextGaussian() * Spread[Cluster], t, b);
+		}
+		break;
+	}
+
+	case ParticleDistribution::PowerLaw:
+	{
+		const float MaxDistance = 0.5f * std::sqrt(Width * Width + Height * Height);
+		for (size_t i = 0; i < ParticleCount; ++i)
+		{
+			const float Distance = MaxDistance * std::pow(Random.NextFloat(), PowerLawExponent);
+			const float Angle = TwoPi * Random.NextFloat();
+			*(PosX + i) = ClampToWorld(MidX + Distance * std::cos(Angle), l, r);
+			*(PosY + i) = ClampToWorld(MidY + Distance * std::sin(Angle), t, b);
+		}
+		break;
+	}
+
+	case ParticleDistribution::Line:
+		for (size_t i = 0; i < ParticleCount; ++i)
+		{
+			const float Along = Random.NextFloat();
+			*(PosX + i) = ClampToWorld(l + Along * Width, l, r);
+			*(PosY + i) = ClampToWorld(t + Along * Height, t, b);
+		}
+		break;
+
+	case ParticleDistribution::Ring:
+	{
+		// The ring is about a particle wide
+		const float RingRadius = 0.4f * Extent;
+		for (size_t i = 0; i < ParticleCount; ++i)
+		{
+			const float Radius = RingRadius + Random.NextGaussian() * ParticleContainer._ParticleRadius;
+			const float Angle = TwoPi * Random.NextFloat();
+			*(PosX + i) = ClampToWorld(MidX + Radius * std::cos(Angle), l, r);
+			*(PosY + i) = ClampToWorld(MidY + Radius * std::sin(Angle), t, b);
+		}
+		break;
+	}
+
+	case ParticleDistribution::Corner:
+	{
+		const float Side = Extent / 64.f;
+		for (size_t i = 0; i < ParticleCount; ++i)
+		{
+			*(PosX + i) = ClampToWorld(l + Random.NextFloat() * Side, l, r);
+			*(PosY + i) = ClampToWorld(t + Random.NextFloat() * Side, t, b);
+		}
+		break;
+	}
+	}
+}
+
+// Traces are larger than 2GB for big runs, so offsets are 64 bit on every platform
+static bool SeekTrace(FILE* File, uint64_t Offset, int Origin)
+{
+#ifdef _WIN32
+	return _fseeki64(File, static_cast<long long>(Offset), Origin) == 0;
+#else
+	return fseeko(File, static_cast<off_t>(Offset), Origin) == 0;
+#endif
+}
+
+static uint64_t TellTrace(FILE* File)
+{
+#ifdef _WIN32
+	return static_cast<uint64_t>(_ftelli64(File));
+#else
+	return static_cast<uint64_t>(ftello(File));
+#endif
+}
+
+// Size of one frame of a trace, the x and y positions of every particle
+static inline uint64_t GetTraceFrameSize(const TraceHeader& Header)
+{
+	return static_cast<uint64_t>(Header._ParticleCount) * 2u * sizeof(float);
+}
+
+TraceRecorder::TraceRecorder()
+	:_Header()
+{}
+
+TraceRecorder::~TraceRecorder()
+{
+	Close();
+}
+
+bool TraceRecorder::Open(const std::string& Path, const Particles& ParticleContainer, float l, float t, float r, float b)
+{
+	Close();
+	_Failed = false;
+
+	_File = fopen(Path.c_str(), "wb");
+	if (!_File)
+	{
+		return false;
+	}
+
+	memset(&_Header, 0, sizeof(_Header));
+	memcpy(_Header._Magic, TraceMagic, sizeof(_Header._Magic));
+	_Header._Version = TraceVersion;
+	_Header._ByteOrder = TraceByteOrder;
+	_Header._ParticleCount = static_cast<uint32_t>(ParticleContainer._MaxParticles);
+	_Header._l = l;
+	_Header._t = t;
+	_Header._r = r;
+	_Header._b = b;
+	_Header._ParticleRadius = ParticleContainer._ParticleRadius;
+
+	// The header is written again with the frame count on close, the padding after it stays zeroed
+	char Start[TraceFrameOffset] = {};
+	memcpy(Start, &_Header, sizeof(_Header));
+	if (fwrite(Start, 1, sizeof(Start), _File) != sizeof(Start))
+	{
+		_Failed = true;
+	}
+	return !_Failed;
+}
+
+bool TraceRecorder::RecordFrame(const Particles& ParticleContainer)
+{
+	if (!_File || ParticleContainer._MaxParticles != _Header._ParticleCount)
+	{
+		return false;
+	}
+
+	const size_t ParticleCount = _Header._ParticleCount;
+	if (fwrite(ParticleContainer._PosX, sizeof(float), ParticleCount, _File) != ParticleCount
+		|| fwrite(ParticleContainer._PosY, sizeof(float), ParticleCount, _File) != ParticleCount)
+	{
+		_Failed = true;
+		return false;
+	}
+	++_Header._FrameCount;
+	return true;
+}
+
+bool TraceRecorder::Close()
+{
+	if (!_File)
+	{
+		return false;
+	}
+
+	if (!SeekTrace(_File, 0, SEEK_SET) || fwrite(&_Header, sizeof(_Header), 1, _File) != 1)
+	{
+		_Failed = true;
+	}
+	if (fclose(_File) != 0)
+	{
+		_Failed = true;
+	}
+	_File = nullptr;
+	return !_Failed;
+}
+
+uint32_t TraceRecorder::GetFrameCount() const
+{
+	return _Header._FrameCount;
+}
+
+TraceReader::TraceReader()
+	:_Header()
+{}
+
+TraceReader::~TraceReader()
+{
+	Close();
+}
+
+bool TraceReader::Open(const std::string& Path)
+{
+	Close();
+
+	_File = fopen(Path.c_str(), "rb");
+	if (!_File)
+	{
+		return false;
+	}
+
+	const bool HeaderRead = fread(&_Header, sizeof(_Header), 1, _File) == 1;
+	if (!HeaderRead || memcmp(_Header._Magic, TraceMagic, sizeof(_Header._Magic)) != 0 || _Header._Version != TraceVersion
+		|| _Header._ByteOrder != TraceByteOrder || _Header._ParticleCount == 0 || _Header._FrameCount == 0
+		|| !SeekTrace(_File, 0, SEEK_END)
+		|| TellTrace(_File) < TraceFrameOffset + GetTraceFrameSize(_Header) * _Header._FrameCount)
+	{
+		Close();
+		return false;
+	}
+
+	// Positioned at the end, so the first read seeks to its frame
+	_NextFrame = _Header._FrameCount;
+	return true;
+}
+
+void TraceReader::Close()
+{
+	if (_File)
+	{
+		fclose(_File);
+		_File = nullptr;
+	}
+}
+
+bool TraceReader::IsOpen() const
+{
+	return _File != nullptr;
+}
+
+const TraceHeader& TraceReader::GetHeader() const
+{
+	return _Header;
+}
+
+bool TraceReader::ReadFrame(uint32_t Frame, Particles& ParticleContainer)
+{
+	if (!_File || Frame >= _Header._FrameCount || ParticleContainer._MaxParticles != _Header._ParticleCount)
+	{
+		return false;
+	}
+
+	if (Frame != _NextFrame && !SeekTrace(_File, TraceFrameOffset + GetTraceFrameSize(_Header) * Frame, SEEK_SET))
+	{
+		return false;
+	}
+
+	const size_t ParticleCount = _Header._ParticleCount;
+	if (fread(ParticleContainer._PosX, sizeof(float), ParticleCount, _File) != ParticleCount
+		|| fread(ParticleContainer._PosY, sizeof(float), ParticleCount, _File) != ParticleCount)
+	{
+		// Where the file is positioned is unknown, so the next read seeks
+		_NextFrame = _Header._FrameCount;
+		return false;
+	}
+	_NextFrame = Frame + 1;
+	return true;
+}
+
+ParticleScenario::ParticleScenario(float l, float t, float r, float b)
+	:_l(l), _t(t), _r(r), _b(b), _Distribution(ParticleDistribution::Uniform), _Seed(1), _Trace()
+{}
+
+void ParticleScenario::SetDistribution(ParticleDistribution Distribution, uint64_t Seed)
+{
+	_Trace.Close();
+	_Distribution = Distribution;
+	_Seed = Seed;
+}
+
+bool ParticleScenario::LoadTrace(const std::string& Path)
+{
+	if (!_Trace.Open(Path))
+	{
+		return false;
+	}
+
+	// Replaying a trace in another world would leave particles outside of the tree
+	const TraceHeader& Header = _Trace.GetHeader();
+	if (Header._l != _l || Header._t != _t || Header._r != _r || Header._b != _b)
+	{
+		_Trace.Close();
+		return false;
+	}
+	return true;
+}
+
+bool ParticleScenario::IsTrace() const
+{
+	return _Trace.IsOpen();
+}
+
+size_t ParticleScenario::GetParticleCount() const
+{
+	return IsTrace() ? _Trace.GetHeader()._ParticleCount : 0;
+}
+
+const char* ParticleScenario::GetName() const
+{
+	return IsTrace() ? "Trace" : GetParticleDistributionName(_Distribution);
+}
+
+bool ParticleScenario::Start(Particles& ParticleContainer)
+{
+	if (IsTrace())
+	{
+		_TraceFrame = 0;
+		return _Trace.ReadFrame(_TraceFrame, ParticleContainer);
+	}
+
+	GenerateDistribution(ParticleContainer, _Distribution, _Seed, _l, _t, _r, _b);
+	return true;
+}
+
+bool ParticleScenario::NextFrame(Particles& ParticleContainer, float DeltaTime)
+{
+	if (IsTrace())
+	{
+		_TraceFrame = (_TraceFrame + 1) % _Trace.GetHeader()._FrameCount;
+		return _Trace.ReadFrame(_TraceFrame, ParticleContainer);
+	}
+
+	ParticleContainer.AdvancePositions(DeltaTime, _l, _r, _t, _b);
+	return true;
+}
@@ -0,0 +1,204 @@
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include "Particle.h"
+
+// How generated scenarios place the particles
+enum class ParticleDistribution
+{
+	// Spread evenly over the world
+	Uniform,
+	// Gaussian blobs around a few random centres, leaving most of the world empty
+	Clusters,
+	// Density falling off with a power of the distance from the middle of the world, so the tree
+	// is very deep in the middle and shallow everywhere else
+	PowerLaw,
+	// On the diagonal from the top left to the bottom right corner
+	Line,
+	// On a thin ring around the middle of the world
+	Ring,
+	// Packed into a small square in the top left corner
+	Corner
+};
+
+// Number of distributions, Corner must stay the last one
+const unsigned ParticleDistributionCount = static_cast<unsigned>(ParticleDistribution::Corner) + 1;
+
+// Readable name of a distribution, used for benchmark options and output
+inline const char* GetParticleDistributionName(ParticleDistribution Distribution)
+{
+	switch (Distribution)
+	{
+	case ParticleDistribution::Uniform:		return "Uniform";
+	case ParticleDistribution::Clusters:	return "Clusters";
+	case ParticleDistribution::PowerLaw:	return "PowerLaw";
+	case ParticleDistribution::Line:		return "Line";
+	case ParticleDistribution::Ring:		return "Ring";
+	case ParticleDistribution::Corner:		return "Corner";
+	}
+	return "Unknown";
+}
+
+// Small random number generator (SplitMix64) with its own state, so the same seed gives the same
+// numbers on every run and every platform whatever else calls rand
+class ScenarioRandom
+{
+public:
+	ScenarioRandom(uint64_t Seed);
+
+	uint64_t NextUInt64();
+
+	// Uniform in [0, 1)
+	float NextFloat();
+
+	// Normally distributed with a mean of 0 and a standard deviation of 1
+	float NextGaussian();
+
+private:
+	uint64_t _State;
+};
+
+// Places every particle of the container inside the given bounds following a distribution
+void GenerateDistribution(Particles& ParticleContainer, ParticleDistribution Distribution, uint64_t Seed,
+	float l, float t, float r, float b);
+
+// Trace files hold the particle positions of a run frame after frame so it can be replayed exactly:
+//
+//	TraceHeader
+//	frames, each the x positions then the y positions of every particle as floats
+//
+// Frames start at TraceFrameOffset and are all the same size, so any frame can be read without the ones
+// before it. Values are stored in the byte order of the machine that recorded them, readers check _ByteOrder
+const char TraceMagic[8] = { 'Q', 'U', 'A', 'D', 'T', 'R', 'C', 'E' };
+const uint32_t TraceVersion = 1;
+const uint32_t TraceByteOrder = 0x01020304;
+const uint64_t TraceFrameOffset = 64;
+
+struct TraceHeader
+{
+	char _Magic[8];
+	uint32_t _Version;
+	uint32_t _ByteOrder;
+
+	uint32_t _ParticleCount;
+
+	// Written when the recording is closed, a recording that was never closed has no frames
+	uint32_t _FrameCount;
+
+	// World the particles were recorded in
+	float _l, _t, _r, _b;
+	float _ParticleRadius;
+	uint32_t _Reserved;
+};
+
+static_assert(sizeof(TraceHeader) == 48, "The trace header layout is part of the file format");
+
+// Records the particle positions of every frame to a trace file
+class TraceRecorder
+{
+public:
+	TraceRecorder();
+
+	// Closes the trace if it is still open
+	~TraceRecorder();
+
+	TraceRecorder(const TraceRecorder&) = delete;
+	TraceRecorder& operator=(const TraceRecorder&) = delete;
+
+	// Starts a trace of the container's particles in the given world, returns false if the file can't be written
+	bool Open(const std::string& Path, const Particles& ParticleContainer, float l, float t, float r, float b);
+
+	// Appends the current positions as the next frame, returns false if they couldn't be written
+	bool RecordFrame(const Particles& ParticleContainer);
+
+	// Writes the frame count into the header and closes the file, returns false if anything failed to write
+	bool Close();
+
+	uint32_t GetFrameCount() const;
+
+private:
+	FILE* _File = nullptr;
+	TraceHeader _Header;
+
+	// Set once any write fails, so Close can report it
+	bool _Failed = false;
+};
+
+// Reads frames of particle positions back from a trace file
+class TraceReader
+{
+public:
+	TraceReader();
+
+	~TraceReader();
+
+	TraceReader(const TraceReader&) = delete;
+	TraceReader& operator=(const TraceReader&) = delete;
+
+	// Opens a trace, returns false if it can't be read, has no frames or isn't a trace this version understands
+	bool Open(const std::string& Path);
+
+	void Close();
+
+	bool IsOpen() const;
+
+	const TraceHeader& GetHeader() const;
+
+	// Reads the positions of a frame into the container, which must hold as many particles as the trace.
+	// Returns false if the frame doesn't exist or couldn't be read
+	bool ReadFrame(uint32_t Frame, Particles& ParticleContainer);
+
+private:
+	FILE* _File = nullptr;
+	TraceHeader _Header;
+
+	// Frame the file is positioned at, reading frames in order doesn't seek
+	uint32_t _NextFrame = 0;
+};
+
+// Where the particle positions of a run come from. Generated scenarios place the particles once with a
+// distribution and move them by their velocity every frame, the same as the particle machine. Trace
+// scenarios replay recorded positions, starting from the first frame again once the trace runs out
+class ParticleScenario
+{
+public:
+	ParticleScenario() = delete;
+
+	// Scenario generating Uniform particles in the given world until told otherwise
+	ParticleScenario(float l, float t, float r, float b);
+
+	ParticleScenario(const ParticleScenario&) = delete;
+	ParticleScenario& operator=(const ParticleScenario&) = delete;
+
+	// Generates particles with a distribution, closing any trace
+	void SetDistribution(ParticleDistribution Distribution, uint64_t Seed);
+
+	// Replays a trace recorded in the same world, returns false if it can't be opened or was recorded elsewhere
+	bool LoadTrace(const std::string& Path);
+
+	bool IsTrace() const;
+
+	// Number of particles a container needs to replay the trace, 0 when particles are generated
+	size_t GetParticleCount() const;
+
+	// Distribution name, or "Trace" when replaying one
+	const char* GetName() const;
+
+	// Places the particles for the first frame, returns false if the trace couldn't be read
+	bool Start(Particles& ParticleContainer);
+
+	// Moves the particles on to the next frame, returns false if the trace couldn't be read
+	bool NextFrame(Particles& ParticleContainer, float DeltaTime);
+
+private:
+	float _l, _t, _r, _b;
+
+	ParticleDistribution _Distribution;
+	uint64_t _Seed;
+
+	TraceReader _Trace;
+
+	// Trace frame shown last
+	uint32_t _TraceFrame = 0;
+};
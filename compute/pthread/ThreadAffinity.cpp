@@ -0,0 +1,251 @@
+#include "ThreadAffinity.h"
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <thread>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+// Parses a /sys CPU or node list such as "0-3,8-11", appending every number in it to Out
+static void ParseSysList(const std::string& List, std::vector<unsigned>& Out)
+{
+	const char* Position = List.c_str();
+	while (*Position)
+	{
+		char* End = nullptr;
+		const unsigned long First = strtoul(Position, &End, 10);
+		if (End == Position)
+		{
+			// Not a number, nothing after it can be trusted
+			return;
+		}
+		unsigned long Last = First;
+		if (*End == '-')
+		{
+			Position = End + 1;
+			Last = strtoul(Position, &End, 10);
+		}
+		for (unsigned long i = First; i <= Last; ++i)
+		{
+			Out.push_back(static_cast<unsigned>(i));
+		}
+		if (*End != ',')
+		{
+			return;
+		}
+		Position = End + 1;
+	}
+}
+
+// Reads the first line of a /sys file, empty if it can't be read
+static std::string ReadSysLine(const std::string& Path)
+{
+	std::ifstream File(Path);
+	std::string Line;
+	std::getline(File, Line);
+	return Line;
+}
+
+static CpuTopology ReadCpuTopology()
+{
+	CpuTopology Topology;
+
+#ifdef __linux__
+	cpu_set_t AllowedCpus;
+	CPU_ZERO(&AllowedCpus);
+	if (sched_getaffinity(0, sizeof(AllowedCpus), &AllowedCpus) == 0)
+	{
+		for (unsigned Cpu = 0; Cpu < CPU_SETSIZE; ++Cpu)
+		{
+			if (CPU_ISSET(Cpu, &AllowedCpus))
+			{
+				Topology._Cpus.push_back(Cpu);
+			}
+		}
+	}
+
+	std::vector<unsigned> Nodes;
+	ParseSysList(ReadSysLine("/sys/devices/system/node/online"), Nodes);
+	for (unsigned Node : Nodes)
+	{
+		std::vector<unsigned> NodeCpus;
+		ParseSysList(ReadSysLine("/sys/devices/system/node/node" + std::to_string(Node) + "/cpulist"), NodeCpus);
+		for (unsigned Cpu : NodeCpus)
+		{
+			if (Cpu >= Topology._CpuNodes.size())
+			{
+				Topology._CpuNodes.resize(Cpu + 1, 0);
+			}
+			Topology._CpuNodes[Cpu] = Node;
+		}
+		Topology._NodeCount = std::max(Topology._NodeCount, Node + 1);
+	}
+#endif
+
+	if (Topology._Cpus.empty())
+	{
+		const unsigned CpuCount = std::max(std::thread::hardware_concurrency(), 1u);
+		for (unsigned Cpu = 0; Cpu < CpuCount; ++Cpu)
+		{
+			Topology._Cpus.push_back(Cpu);
+		}
+	}
+	return Topology;
+}
+
+const CpuTopology& CpuTopology::Get()
+{
+	static const CpuTopology Topology = ReadCpuTopology();
+	return Topology;
+}
+
+unsigned CpuTopology::GetNode(unsigned Cpu) const
+{
+	return Cpu < _CpuNodes.size() ? _CpuNodes[Cpu] : 0;
+}
+
+ThreadAffinity::ThreadAffinity()
+	:_Policy(AffinityPolicy::None), _CpuOrder()
+{}
+
+ThreadAffinity::ThreadAffinity(AffinityPolicy Policy, const std::vector<unsigned>& CpuList)
+	:_Policy(Policy), _CpuOrder()
+{
+	const CpuTopology& Topology = CpuTopology::Get();
+
+	if (_Policy == AffinityPolicy::Explicit)
+	{
+		for (unsigned Cpu : CpuList)
+		{
+			if (std::find(Topology._Cpus.begin(), Topology._Cpus.end(), Cpu) != Topology._Cpus.end())
+			{
+				_CpuOrder.push_back(Cpu);
+			}
+		}
+	}
+	else if (_Policy != AffinityPolicy::None)
+	{
+		// Group the allowed CPUs by node, keeping them in order inside each node
+		std::vector<std::vector<unsigned>> NodeCpus(Topology._NodeCount);
+		for (unsigned Cpu : Topology._Cpus)
+		{
+			NodeCpus[std::min(Topology.GetNode(Cpu), Topology._NodeCount - 1)].push_back(Cpu);
+		}
+
+		if (_Policy == AffinityPolicy::Compact)
+		{
+			for (const std::vector<unsigned>& Cpus : NodeCpus)
+			{
+				_CpuOrder.insert(_CpuOrder.end(), Cpus.begin(), Cpus.end());
+			}
+		}
+		else
+		{
+			// Take the next CPU of each node in turn until every node has run out
+			for (size_t i = 0; _CpuOrder.size() < Topology._Cpus.size(); ++i)
+			{
+				for (const std::vector<unsigned>& Cpus : NodeCpus)
+				{
+					if (i < Cpus.size())
+					{
+						_CpuOrder.push_back(Cpus[i]);
+					}
+				}
+			}
+		}
+	}
+
+	// A policy with no usable CPUs places nothing
+	if (_CpuOrder.empty())
+	{
+		_Policy = AffinityPolicy::None;
+	}
+}
+
+AffinityPolicy ThreadAffinity::GetPolicy() const
+{
+	return _Policy;
+}
+
+const std::vector<unsigned>& ThreadAffinity::GetCpuOrder() const
+{
+	return _CpuOrder;
+}
+
+int ThreadAffinity::GetSlotCpu(unsigned Slot) const
+{
+	if (_Policy == AffinityPolicy::None)
+	{
+		return -1;
+	}
+	return static_cast<int>(_CpuOrder[Slot % _CpuOrder.size()]);
+}
+
+int ThreadAffinity::CreateThread(pthread_t* Thread, void*(*ThreadFunc)(void*), void* Arg, unsigned Slot) const
+{
+#ifdef __linux__
+	const int Cpu = GetSlotCpu(Slot);
+	if (Cpu >= 0)
+	{
+		cpu_set_t CpuSet;
+		CPU_ZERO(&CpuSet);
+		CPU_SET(Cpu, &CpuSet);
+
+		// Pinning through the attributes means the thread never runs anywhere else,
+		// so not even its stack is first touched on another node
+		pthread_attr_t Attributes;
+		pthread_attr_init(&Attributes);
+		int Result = pthread_attr_setaffinity_np(&Attributes, sizeof(CpuSet), &CpuSet);
+		if (Result == 0)
+		{
+			Result = pthread_create(Thread, &Attributes, ThreadFunc, Arg);
+		}
+		pthread_attr_destroy(&Attributes);
+		if (Result == 0)
+		{
+			return 0;
+		}
+		// The CPU may have gone offline since the topology was read, run the thread unpinned instead
+	}
+#endif
+	return pthread_create(Thread, NULL, ThreadFunc, Arg);
+}
+
+bool ThreadAffinity::PinCurrentThread(unsigned Slot) const
+{
+#ifdef __linux__
+	cpu_set_t CpuSet;
+	CPU_ZERO(&CpuSet);
+	const int Cpu = GetSlotCpu(Slot);
+	if (Cpu >= 0)
+	{
+		CPU_SET(Cpu, &CpuSet);
+	}
+	else
+	{
+		for (unsigned AllowedCpu : CpuTopology::Get()._Cpus)
+		{
+			CPU_SET(AllowedCpu, &CpuSet);
+		}
+	}
+	return pthread_setaffinity_np(pthread_self(), sizeof(CpuSet), &CpuSet) == 0;
+#else
+	(void)Slot;
+	return _Policy == AffinityPolicy::None;
+#endif
+}
+
+unsigned ThreadAffinity::GetCurrentNode()
+{
+#ifdef __linux__
+	const int Cpu = sched_getcpu();
+	if (Cpu >= 0)
+	{
+		return CpuTopology::Get().GetNode(static_cast<unsigned>(Cpu));
+	}
+#endif
+	return 0;
+}
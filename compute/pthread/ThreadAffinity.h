@@ -0,0 +1,87 @@
+#pragma once
+#include <vector>
+
+#define __PTW32_STATIC_LIB
+#include "pthread.h"
+
+// How sort workers are placed on CPUs
+enum class AffinityPolicy
+{
+	// Threads are left for the OS to place and move around
+	None,
+	// Workers fill every CPU of one NUMA node before moving onto the next node
+	Compact,
+	// Workers are dealt out to the NUMA nodes in turn, spreading them over every node
+	Scatter,
+	// Workers are given CPUs from a list, in order
+	Explicit
+};
+
+// Readable name of an affinity policy, used for UI and benchmark output
+inline const char* GetAffinityPolicyName(AffinityPolicy Policy)
+{
+	switch (Policy)
+	{
+	case AffinityPolicy::None:		return "None";
+	case AffinityPolicy::Compact:	return "Compact";
+	case AffinityPolicy::Scatter:	return "Scatter";
+	case AffinityPolicy::Explicit:	return "Explicit";
+	}
+	return "Unknown";
+}
+
+// CPUs the process may run on and the NUMA node each of them is on, read once from /sys on Linux.
+// Elsewhere, or when there is no node information, every CPU is on node 0
+struct CpuTopology
+{
+	// Topology of the machine, read the first time it is needed
+	static const CpuTopology& Get();
+
+	// Node of a CPU, 0 for CPUs it knows nothing about
+	unsigned GetNode(unsigned Cpu) const;
+
+	// CPUs the process was allowed to run on when the topology was read, lowest first
+	std::vector<unsigned> _Cpus;
+
+	// Node of every CPU, indexed by CPU number
+	std::vector<unsigned> _CpuNodes;
+
+	unsigned _NodeCount = 1;
+};
+
+// Places sort workers on CPUs following a policy. Every group of sort workers counts its threads from
+// slot 1, slot 0 being the thread calling the sort, so the same worker of a group lands on the same CPU
+// every time it is started and the memory it first touches stays on that CPU's node
+class ThreadAffinity
+{
+public:
+	// Leaves every thread unpinned
+	ThreadAffinity();
+
+	// CPUs the explicit policy uses, CPUs the process isn't allowed on are dropped from the list
+	ThreadAffinity(AffinityPolicy Policy, const std::vector<unsigned>& CpuList = std::vector<unsigned>());
+
+	AffinityPolicy GetPolicy() const;
+
+	// CPUs given out in slot order, repeating from the start when there are more slots than CPUs
+	const std::vector<unsigned>& GetCpuOrder() const;
+
+	// CPU a slot is pinned to, -1 when the policy leaves it unpinned
+	int GetSlotCpu(unsigned Slot) const;
+
+	// Same as pthread_create, pinning the new thread to the CPU of a slot before it runs
+	int CreateThread(pthread_t* Thread, void*(*ThreadFunc)(void*), void* Arg, unsigned Slot) const;
+
+	// Pins the calling thread to the CPU of a slot, or lets it run on any allowed CPU again when the
+	// policy doesn't pin. Returns false if the affinity couldn't be set
+	bool PinCurrentThread(unsigned Slot) const;
+
+	// NUMA node the calling thread is running on
+	static unsigned GetCurrentNode();
+
+private:
+	AffinityPolicy _Policy;
+
+	// CPU of each slot
+	std::vector<unsigned> _CpuOrder;
+};
@@ -1,219 +1,680 @@
 #include "ThreadPool.h"
+#include <sched.h>
+
+// The worker the current thread is running as, nullptr on threads outside of any pool
+static thread_local void* CurrentWorker = nullptr;
+
+JobLatch::JobLatch()
+	:_Count(0)
+{
+	pthread_mutex_init(&_Count_mutex, NULL);
+	pthread_cond_init(&_CountReachedZero, NULL);
+}
+
+JobLatch::~JobLatch()
+{
+	pthread_mutex_destroy(&_Count_mutex);
+	pthread_cond_destroy(&_CountReachedZero);
+}
+
+void JobLatch::Add(long long Count)
+{
+	_Count.fetch_add(Count, std::memory_order_relaxed);
+}
+
+void JobLatch::CountDown(long long Count)
+{
+	// Counting down without reaching zero needs no lock
+	long long Current = _Count.load(std::memory_order_relaxed);
+	while (Current > Count)
+	{
+		if (_Count.compare_exchange_weak(Current, Current - Count, std::memory_order_acq_rel, std::memory_order_relaxed))
+		{
+			return;
+		}
+	}
+
+	// The last count down happens under the mutex, so a waiter can't return and destroy
+	// the latch while it's still being used here
+	pthread_mutex_lock(&_Count_mutex);
+	if (_Count.fetch_sub(Count, std::memory_order_acq_rel) == Count)
+	{
+		pthread_cond_broadcast(&_CountReachedZero);
+	}
+	pthread_mutex_unlock(&_Count_mutex);
+}
+
+void JobLatch::Wait()
+{
+	// Always take the mutex, even when already done, to wait out the last count down
+	pthread_mutex_lock(&_Count_mutex);
+	while (!IsDone())
+	{
+		pthread_cond_wait(&_CountReachedZero, &_Count_mutex);
+	}
+	pthread_mutex_unlock(&_Count_mutex);
+}
+
+bool JobLatch::IsDone() const
+{
+	return _Count.load(std::memory_order_acquire) == 0;
+}
+
+JobDeque::JobBuffer::JobBuffer(int64_t Capacity)
+	:_Mask(Capacity - 1), _Jobs(new std::atomic<JobBase*>[Capacity])
+{}
+
+JobDeque::JobDeque(unsigned InitialCapacity)
+	:_Top(0), _Bottom(0), _Buffer(nullptr), _RetiredBuffers()
+{
+	// Round the capacity up to a power of two so indices can be masked
+	int64_t Capacity = 1;
+	while (Capacity < InitialCapacity)
+	{
+		Capacity <<= 1;
+	}
+	_Buffer.store(new JobBuffer(Capacity), std::memory_order_relaxed);
+}
+
+JobDeque::~JobDeque()
+{
+	delete _Buffer.load(std::memory_order_relaxed);
+	for (unsigned i = 0; i < _RetiredBuffers.size(); ++i)
+	{
+		delete _RetiredBuffers[i];
+	}
+}
+
+void JobDeque::Push(JobBase* NewJob)
+{
+	const int64_t Bottom = _Bottom.load(std::memory_order_relaxed);
+	const int64_t Top = _Top.load(std::memory_order_acquire);
+	JobBuffer* Buffer = _Buffer.load(std::memory_order_relaxed);
+
+	if (Bottom - Top > Buffer->_Mask)
+	{
+		Buffer = Grow(Buffer, Top, Bottom);
+	}
+
+	// Publishing the new bottom makes the job's contents visible to the thread that steals it. It is seq_cst
+	// so SignalIdleThread's read of the idle count can't be ordered before it
+	Buffer->Put(Bottom, NewJob);
+	_Bottom.store(Bottom + 1, std::memory_order_seq_cst);
+}
+
+JobBase* JobDeque::Pop()
+{
+	const int64_t Bottom = _Bottom.load(std::memory_order_relaxed) - 1;
+	JobBuffer* Buffer = _Buffer.load(std::memory_order_relaxed);
+	// Taking the bottom before reading the top must not be reordered, or a stealing thread and this one
+	// could both take the last job. Both are seq_cst so the ordering is on the operations themselves
+	_Bottom.exchange(Bottom, std::memory_order_seq_cst);
+	int64_t Top = _Top.load(std::memory_order_seq_cst);
+
+	JobBase* Job = nullptr;
+	if (Top <= Bottom)
+	{
+		Job = Buffer->Get(Bottom);
+		if (Top == Bottom)
+		{
+			// Last job in the deque, race any stealing threads for it
+			if (!_Top.compare_exchange_strong(Top, Top + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+			{
+				Job = nullptr;
+			}
+			_Bottom.store(Bottom + 1, std::memory_order_relaxed);
+		}
+	}
+	else
+	{
+		_Bottom.store(Bottom + 1, std::memory_order_relaxed);
+	}
+	return Job;
+}
+
+JobBase* JobDeque::Steal()
+{
+	// The top is read before the bottom, pairs with the seq_cst exchange in Pop
+	int64_t Top = _Top.load(std::memory_order_seq_cst);
+	const int64_t Bottom = _Bottom.load(std::memory_order_seq_cst);
+
+	if (Top < Bottom)
+	{
+		JobBuffer* Buffer = _Buffer.load(std::memory_order_acquire);
+		JobBase* Job = Buffer->Get(Top);
+		if (!_Top.compare_exchange_strong(Top, Top + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+		{
+			return nullptr;
+		}
+		return Job;
+	}
+	return nullptr;
+}
+
+bool JobDeque::IsEmpty() const
+{
+	const int64_t Top = _Top.load(std::memory_order_seq_cst);
+	const int64_t Bottom = _Bottom.load(std::memory_order_seq_cst);
+	return Bottom <= Top;
+}
+
+JobDeque::JobBuffer* JobDeque::Grow(JobBuffer* OldBuffer, int64_t Top, int64_t Bottom)
+{
+	JobBuffer* NewBuffer = new JobBuffer((OldBuffer->_Mask + 1) * 2);
+	for (int64_t i = Top; i < Bottom; ++i)
+	{
+		NewBuffer->Put(i, OldBuffer->Get(i));
+	}
+	_RetiredBuffers.push_back(OldBuffer);
+	_Buffer.store(NewBuffer, std::memory_order_release);
+	return NewBuffer;
+}
 
 ThreadPool::ThreadPool(unsigned ThreadCount)
-	:_IdleThreads(0),_JobQueue(), _ThreadCount(ThreadCount), _Threads(ThreadCount), _EndWork(false), _NumJobsCompleted(0)
+	:_IdleThreads(0), _JobQueue(), _JobQueueSize(0), _Workers(new Worker[ThreadCount]), _ThreadCount(ThreadCount),
+	_Threads(), _Affinity(), _EndWork(false), _JobsDropped(0), _AllJobsWaiters(0)
 {
 	pthread_mutex_init(&_IdleThreads_mutex, NULL);
 	pthread_mutex_init(&_JobQueue_mutex, NULL);
 	pthread_mutex_init(&_JobPool_mutex, NULL);
-	pthread_mutex_init(&_NumJobsCompleted_mutex, NULL);
+	pthread_mutex_init(&_AllJobsDone_mutex, NULL);
 
 	// Initialise conditional variables
 	pthread_cond_init(&_JobSignaller, NULL);
+	pthread_cond_init(&_AllJobsDone, NULL);
+
+	for (unsigned i = 0; i < _ThreadCount; ++i)
+	{
+		_Workers[i]._Pool = this;
+		_Workers[i]._Index = i;
+	}
 }
 
 bool ThreadPool::Initialise()
 {
+	_EndWork.store(false, std::memory_order_release);
+
+	_Threads.resize(_ThreadCount);
 	for (unsigned i = 0; i < _ThreadCount; ++i)
 	{
-		_Threads.push_back(pthread_t());
-
-		if (pthread_create(&_Threads[i], NULL, &this->DoWork, this)) { return false; }
+		if (_Affinity.CreateThread(&_Threads[i], &this->DoWork, &_Workers[i], i + 1))
+		{
+			// Only the threads that started can be stopped
+			_Threads.resize(i);
+			StopThreads(false);
+			return false;
+		}
 	}
 	return true;
 }
 
-void ThreadPool::AddWork(JobBase* NewJob)
+void ThreadPool::SetAffinity(const ThreadAffinity& Affinity)
 {
-	// Acquire mutex lock and add jobs to the queue
-	pthread_mutex_lock(&_JobQueue_mutex);
+	_Affinity = Affinity;
+}
+
+void ThreadPool::AddWork(JobBase* NewJob, JobLatch* Latch)
+{
+	// Count the job before it can be picked up so waiting threads can't see zero early
+	NewJob->_Latch = Latch;
+	if (Latch)
+	{
+		Latch->Add();
+	}
+	Worker* ThisWorker = (Worker*)CurrentWorker;
 
-	_JobQueue.push(NewJob);
+	if (ThisWorker && ThisWorker->_Pool == this)
+	{
+		CountOwn(ThisWorker->_Stats._JobsAdded);
 
-	pthread_mutex_unlock(&_JobQueue_mutex);
+		// Jobs added by a job stay on this thread's deque for other threads to steal
+		ThisWorker->_Deque.Push(NewJob);
+	}
+	else
+	{
+		_ExternalStats._JobsAdded.fetch_add(1, std::memory_order_release);
+
+		// Acquire mutex lock and add jobs to the queue
+		pthread_mutex_lock(&_JobQueue_mutex);
+
+		_JobQueue.push(NewJob);
+		_JobQueueSize.store(_JobQueue.size(), std::memory_order_seq_cst);
+
+		pthread_mutex_unlock(&_JobQueue_mutex);
+	}
+
+	SignalIdleThread();
+}
 
-	// Signal the threads that work has been added
-	pthread_cond_signal(&_JobSignaller);
+void ThreadPool::SignalIdleThread()
+{
+	// The job was published with a seq_cst store and an idle thread counts itself with a seq_cst add before
+	// checking for jobs, so either this sees the idle thread or the idle thread sees the job
+	if (_IdleThreads.load(std::memory_order_seq_cst) > 0)
+	{
+		// Signal the threads that work has been added, holding the idle mutex so the
+		// signal can't land between a thread checking for work and going to sleep
+		pthread_mutex_lock(&_IdleThreads_mutex);
+		pthread_cond_signal(&_JobSignaller);
+		pthread_mutex_unlock(&_IdleThreads_mutex);
+	}
+}
+
+bool ThreadPool::HasQueuedJobs()
+{
+	if (_JobQueueSize.load(std::memory_order_seq_cst) > 0)
+	{
+		return true;
+	}
+	for (unsigned i = 0; i < _ThreadCount; ++i)
+	{
+		if (!_Workers[i]._Deque.IsEmpty())
+		{
+			return true;
+		}
+	}
+	return false;
 }
 
 bool ThreadPool::AreAllThreadsIdle()
 {
-	pthread_mutex_lock(&_JobQueue_mutex);
 	pthread_mutex_lock(&_IdleThreads_mutex);
-	bool AllThreadsIdle(_IdleThreads == _ThreadCount && _JobQueue.empty());
-	pthread_mutex_unlock(&_JobQueue_mutex);
+	bool AllThreadsIdle(_IdleThreads.load() == _ThreadCount && !HasQueuedJobs());
 	pthread_mutex_unlock(&_IdleThreads_mutex);
 	return AllThreadsIdle;
 }
 
-void ThreadPool::WaitForAllThreads(bool WaitForWorkStart)
+void ThreadPool::WaitForAllThreads()
 {
-	if (WaitForWorkStart)
+	WaitForOutstandingJobs();
+}
+
+void ThreadPool::CountOwn(std::atomic<long long>& Count, std::memory_order Order)
+{
+	Count.store(Count.load(std::memory_order_relaxed) + 1, Order);
+}
+
+long long ThreadPool::GetOutstandingJobCount() const
+{
+	// A completion that is seen was counted after its job was added, so its addition is seen below
+	// Completions are read seq_cst to pair with WaitForOutstandingJobs counting itself as a waiter
+	long long Finished = _JobsDropped.load(std::memory_order_seq_cst)
+		+ _ExternalStats._JobsCompleted.load(std::memory_order_seq_cst);
+	for (unsigned i = 0; i < _ThreadCount; ++i)
+	{
+		Finished += _Workers[i]._Stats._JobsCompleted.load(std::memory_order_seq_cst);
+	}
+
+	long long Added = _ExternalStats._JobsAdded.load(std::memory_order_acquire);
+	for (unsigned i = 0; i < _ThreadCount; ++i)
 	{
-		while (!_WorkStarted)
-		{}
+		Added += _Workers[i]._Stats._JobsAdded.load(std::memory_order_acquire);
 	}
-	while (!AreAllThreadsIdle())
-	{}
-	_WorkStarted = false;
+	return Added - Finished;
 }
 
-bool ThreadPool::StopThreads(bool Safely)
+void ThreadPool::WaitForOutstandingJobs()
 {
-	if (Safely)
+	pthread_mutex_lock(&_AllJobsDone_mutex);
+	// Completions are counted with seq_cst stores and read back seq_cst after this, so either this sees
+	// the last job finish or its thread sees the waiter in SignalJobFinished
+	_AllJobsWaiters.fetch_add(1, std::memory_order_seq_cst);
+
+	while (GetOutstandingJobCount() > 0)
 	{
-		// Check All threads are idle
-		if (!AreAllThreadsIdle())
-		{
-			// Flush the Job Queue of any outstanding jobs
-			pthread_mutex_lock(&_JobQueue_mutex);
+		pthread_cond_wait(&_AllJobsDone, &_AllJobsDone_mutex);
+	}
+	_AllJobsWaiters.fetch_sub(1, std::memory_order_relaxed);
+	pthread_mutex_unlock(&_AllJobsDone_mutex);
+}
 
-			while (!_JobQueue.empty())
-			{
-				_JobQueue.front()->_Complete = true;
-				_JobQueue.pop();
-			}
+void ThreadPool::SignalJobFinished()
+{
+	// Nobody waits on every job most of the time, so finishing a job only reads a line nobody writes
+	if (_AllJobsWaiters.load(std::memory_order_seq_cst) > 0)
+	{
+		pthread_mutex_lock(&_AllJobsDone_mutex);
+		pthread_cond_broadcast(&_AllJobsDone);
+		pthread_mutex_unlock(&_AllJobsDone_mutex);
+	}
+}
 
-			pthread_mutex_unlock(&_JobQueue_mutex);
+bool ThreadPool::StopThreads(bool Safely)
+{
+	// Jobs nobody has taken yet are dropped either way
+	FlushJobQueue();
 
-			// Wait for all threads to become idle
-			while (!AreAllThreadsIdle()) {}
-		}
+	if (Safely)
+	{
+		// Wait for the jobs already on a thread's deque to be finished
+		WaitForOutstandingJobs();
+	}
 
-		_EndWork = true;
-		pthread_cond_signal(&_JobSignaller);
+	// Wake every thread so they all see the end work flag
+	pthread_mutex_lock(&_IdleThreads_mutex);
+	_EndWork.store(true, std::memory_order_release);
+	pthread_cond_broadcast(&_JobSignaller);
+	pthread_mutex_unlock(&_IdleThreads_mutex);
 
-		for (int i = 0; i < _Threads.size(); ++i)
-		{
-			if (pthread_join(_Threads[i], NULL)) { return false; };
-		}
+	bool Success = true;
+	for (unsigned i = 0; i < _Threads.size(); ++i)
+	{
+		if (pthread_join(_Threads[i], NULL)) { Success = false; }
 	}
-	else
+	_Threads.clear();
+
+	// Threads that exited early leave jobs on their deques, no thread is left to steal them
+	// so the deques can be emptied from here
+	for (unsigned i = 0; i < _ThreadCount; ++i)
 	{
-		for (int i = 0; i < _Threads.size(); ++i)
+		while (JobBase* Job = _Workers[i]._Deque.Pop())
 		{
-			pthread_kill(_Threads[i], NULL);
+			DropJob(Job);
 		}
 	}
-	_Threads.clear();
+	FlushJobQueue();
 
-	return true;
+	return Success;
 }
 
-template<class JobType>
-static JobType* GetFreeJob(std::vector<JobType*>& JobPages, const unsigned PageSize)
+void ThreadPool::FlushJobQueue()
 {
-	// Find a completed Job to reuse
-	for (unsigned i = 0; i < JobPages.size(); ++i)
+	pthread_mutex_lock(&_JobQueue_mutex);
+	while (!_JobQueue.empty())
 	{
-		for (unsigned j = 0; j < PageSize; ++j)
-		{
-			if ((JobPages[i] + j)->_Complete)
-			{
-				(JobPages[i] + j)->_Complete = false;
-				return (JobPages[i] + j);
-			}
-		}
+		JobBase* FlushedJob = _JobQueue.front();
+		_JobQueue.pop();
+		DropJob(FlushedJob);
 	}
+	_JobQueueSize.store(0, std::memory_order_relaxed);
+	pthread_mutex_unlock(&_JobQueue_mutex);
+}
+
+void ThreadPool::DropJob(JobBase* Job)
+{
+	Job->DiscardJob();
 
-	// Allocate a new page of jobs
-	JobType* NewPage = new JobType[PageSize];
-	JobPages.push_back(NewPage);
-	for (unsigned i = 1; i < PageSize; ++i)
+	// The job can be reused as soon as it's returned, so read the latch first
+	JobLatch* Latch = Job->_Latch;
+	Job->_Complete.store(true, std::memory_order_release);
+	if (Job->_FreeList)
 	{
-		(JobPages[JobPages.size() - 1] + i)->_Complete = true;
+		Job->_FreeList->Return(Job);
 	}
-	// Return a new job one cannot be reused
-	return (JobPages[JobPages.size() - 1]);
+
+	if (Latch)
+	{
+		Latch->CountDown();
+	}
+	_JobsDropped.fetch_add(1, std::memory_order_seq_cst);
+	SignalJobFinished();
 }
 
-JobOneParam* JobPool::GetFreeJob_OneParam()
+void JobFreeList::Return(JobBase* Job)
 {
-	return GetFreeJob(_JobPages_OneParam, _PageSize);
+	JobBase* Head = _ReturnedJobs.load(std::memory_order_relaxed);
+	do
+	{
+		Job->_NextFreeJob = Head;
+	} while (!_ReturnedJobs.compare_exchange_weak(Head, Job, std::memory_order_release, std::memory_order_relaxed));
 }
 
-JobTwoParams* JobPool::GetFreeJob_TwoParams()
+JobBase* JobFreeList::TakeAll()
 {
-	return GetFreeJob(_JobPages_TwoParams, _PageSize);
+	return _ReturnedJobs.exchange(nullptr, std::memory_order_acquire);
 }
 
-JobThreeParams* JobPool::GetFreeJob_ThreeParams()
+template<class JobType>
+JobType* ThreadPool::GetFreeJob(std::vector<JobType*>& JobPages, unsigned JobTypeIndex)
 {
-	return GetFreeJob(_JobPages_ThreeParams, _PageSize);
+	Worker* ThisWorker = (Worker*)CurrentWorker;
+	const bool IsPoolThread = ThisWorker && ThisWorker->_Pool == this;
+
+	// Threads outside of the pool share their free jobs
+	if (!IsPoolThread)
+	{
+		pthread_mutex_lock(&_JobPool_mutex);
+	}
+	JobBase*& FreeJobs = IsPoolThread ? ThisWorker->_FreeJobs[JobTypeIndex] : _ExternalFreeJobs[JobTypeIndex];
+
+	JobFreeList& FreeList = _JobPool._FreeLists[JobTypeIndex];
+	if (!FreeJobs)
+	{
+		FreeJobs = FreeList.TakeAll();
+	}
+
+	if (!FreeJobs)
+	{
+		// Allocate a new page of jobs
+		const unsigned PageSize = _JobPool._PageSize;
+		JobType* NewPage = new JobType[PageSize];
+		if (IsPoolThread)
+		{
+			pthread_mutex_lock(&_JobPool_mutex);
+		}
+		JobPages.push_back(NewPage);
+		if (IsPoolThread)
+		{
+			pthread_mutex_unlock(&_JobPool_mutex);
+		}
+
+		for (unsigned i = 0; i < PageSize; ++i)
+		{
+			(NewPage + i)->_FreeList = &FreeList;
+			(NewPage + i)->_NextFreeJob = i + 1 < PageSize ? NewPage + i + 1 : nullptr;
+		}
+		FreeJobs = NewPage;
+	}
+
+	JobBase* Job = FreeJobs;
+	FreeJobs = Job->_NextFreeJob;
+
+	if (!IsPoolThread)
+	{
+		pthread_mutex_unlock(&_JobPool_mutex);
+	}
+
+	Job->_NextFreeJob = nullptr;
+	Job->_Complete.store(false, std::memory_order_relaxed);
+	return static_cast<JobType*>(Job);
 }
 
 // Get a free Job that handles one paramter
 JobOneParam* ThreadPool::GetFreeJob_OneParam()
 {
-	pthread_mutex_lock(&_JobPool_mutex);
-	JobOneParam* ret(_JobPool.GetFreeJob_OneParam());
-	pthread_mutex_unlock(&_JobPool_mutex);
-	return ret;
+	return GetFreeJob(_JobPool._JobPages_OneParam, JobPool::_OneParamJobs);
 }
 JobTwoParams* ThreadPool::GetFreeJob_TwoParams()
 {
-	pthread_mutex_lock(&_JobPool_mutex);
-	JobTwoParams* ret(_JobPool.GetFreeJob_TwoParams());
-	pthread_mutex_unlock(&_JobPool_mutex);
-	return ret;
+	return GetFreeJob(_JobPool._JobPages_TwoParams, JobPool::_TwoParamsJobs);
 }
 JobThreeParams* ThreadPool::GetFreeJob_ThreeParams()
 {
-	pthread_mutex_lock(&_JobPool_mutex);
-	JobThreeParams* ret(_JobPool.GetFreeJob_ThreeParams());
-	pthread_mutex_unlock(&_JobPool_mutex);
-	return ret;
+	return GetFreeJob(_JobPool._JobPages_ThreeParams, JobPool::_ThreeParamsJobs);
+}
+JobInline* ThreadPool::GetFreeJob_Inline()
+{
+	return GetFreeJob(_JobPool._JobPages_Inline, JobPool::_InlineJobs);
+}
+
+void ThreadPool::WaitForLatch(JobLatch& Latch)
+{
+	Worker* ThisWorker = (Worker*)CurrentWorker;
+	const bool IsPoolThread = ThisWorker && ThisWorker->_Pool == this;
+	Worker* HelpingWorker = IsPoolThread ? ThisWorker : nullptr;
+
+	while (!Latch.IsDone())
+	{
+		JobBase* Job = FindJob(HelpingWorker);
+		if (Job)
+		{
+			RunJob(HelpingWorker, Job);
+		}
+		else if (IsPoolThread)
+		{
+			// The remaining jobs are running on other threads and may still add more
+			sched_yield();
+		}
+		else
+		{
+			Latch.Wait();
+		}
+	}
+
+	// Wait out the last count down before the latch can be destroyed
+	Latch.Wait();
 }
 
 long long ThreadPool::GetNumJobsCompleted() const
 {
-	return _NumJobsCompleted;
+	long long NumJobsCompleted = 0;
+	for (unsigned i = 0; i < _ThreadCount; ++i)
+	{
+		NumJobsCompleted += _Workers[i]._Stats._JobsCompleted.load(std::memory_order_relaxed);
+	}
+	return NumJobsCompleted;
+}
+
+ThreadPoolStats ThreadPool::GetStats() const
+{
+	ThreadPoolStats Stats;
+
+	// Entry 0 is the threads outside of the pool
+	for (unsigned i = 0; i <= _ThreadCount; ++i)
+	{
+		const WorkerStats& ThreadStats = i == 0 ? _ExternalStats : _Workers[i - 1]._Stats;
+		Stats._JobsAdded += ThreadStats._JobsAdded.load(std::memory_order_relaxed);
+		Stats._JobsCompleted += ThreadStats._JobsCompleted.load(std::memory_order_relaxed);
+		Stats._JobsStolen += ThreadStats._JobsStolen.load(std::memory_order_relaxed);
+		Stats._Sleeps += ThreadStats._Sleeps.load(std::memory_order_relaxed);
+	}
+	Stats._JobsDropped = _JobsDropped.load(std::memory_order_relaxed);
+	return Stats;
 }
 
 unsigned ThreadPool::GetNumIdleThreads() const
 {
-	return _IdleThreads;
+	return _IdleThreads.load(std::memory_order_relaxed);
 }
 
-void* ThreadPool::DoWork(void* arg)
+unsigned ThreadPool::GetThreadCount() const
+{
+	return _ThreadCount;
+}
+
+int ThreadPool::GetCurrentThreadIndex() const
 {
-	ThreadPool* ThisPool = (ThreadPool*)arg;
+	const Worker* ThisWorker = (const Worker*)CurrentWorker;
+	return ThisWorker && ThisWorker->_Pool == this ? static_cast<int>(ThisWorker->_Index) : -1;
+}
 
-	bool QueueEmpty(true);
-	JobBase* CurrentJob(nullptr);
+JobBase* ThreadPool::FindJob(Worker* ThisWorker)
+{
+	// Newest job from this thread's own deque first, it's likely still in cache
+	JobBase* Job = ThisWorker ? ThisWorker->_Deque.Pop() : nullptr;
+	if (Job)
+	{
+		return Job;
+	}
 
-	while (ThisPool->_EndWork == false)
+	// Then jobs added from outside of the pool
+	if (_JobQueueSize.load(std::memory_order_relaxed) > 0)
 	{
-		// Check the job queue for work
-		pthread_mutex_lock(&ThisPool->_JobQueue_mutex);
+		pthread_mutex_lock(&_JobQueue_mutex);
+		if (!_JobQueue.empty())
+		{
+			Job = _JobQueue.front();
+			_JobQueue.pop();
+			_JobQueueSize.store(_JobQueue.size(), std::memory_order_relaxed);
+		}
+		pthread_mutex_unlock(&_JobQueue_mutex);
 
-		QueueEmpty = ThisPool->_JobQueue.empty();
+		if (Job)
+		{
+			return Job;
+		}
+	}
 
-		if (!QueueEmpty)
+	// Finally steal the oldest job from another thread, starting with the next one along
+	const unsigned FirstVictim = ThisWorker ? ThisWorker->_Index + 1 : 0;
+	const unsigned VictimCount = ThisWorker ? _ThreadCount - 1 : _ThreadCount;
+	for (unsigned i = 0; i < VictimCount; ++i)
+	{
+		Job = _Workers[(FirstVictim + i) % _ThreadCount]._Deque.Steal();
+		if (Job)
 		{
-			CurrentJob = ThisPool->_JobQueue.front();
-			ThisPool->_JobQueue.pop();
+			if (ThisWorker)
+			{
+				CountOwn(ThisWorker->_Stats._JobsStolen);
+			}
+			else
+			{
+				_ExternalStats._JobsStolen.fetch_add(1, std::memory_order_relaxed);
+			}
+			return Job;
 		}
+	}
+	return nullptr;
+}
 
-		pthread_mutex_unlock(&ThisPool->_JobQueue_mutex);
+void ThreadPool::RunJob(Worker* ThisWorker, JobBase* Job)
+{
+	Job->DoJob();
 
-		if (QueueEmpty)
+	// The job can be reused as soon as it's returned, so read the latch first
+	JobLatch* Latch = Job->_Latch;
+	Job->_Complete.store(true, std::memory_order_release);
+	if (Job->_FreeList)
+	{
+		Job->_FreeList->Return(Job);
+	}
+
+	if (Latch)
+	{
+		Latch->CountDown();
+	}
+
+	if (ThisWorker)
+	{
+		CountOwn(ThisWorker->_Stats._JobsCompleted, std::memory_order_seq_cst);
+	}
+	else
+	{
+		_ExternalStats._JobsCompleted.fetch_add(1, std::memory_order_seq_cst);
+	}
+	SignalJobFinished();
+}
+
+void* ThreadPool::DoWork(void* arg)
+{
+	Worker* ThisWorker = (Worker*)arg;
+	ThreadPool* ThisPool = ThisWorker->_Pool;
+
+	CurrentWorker = ThisWorker;
+
+	while (!ThisPool->_EndWork.load(std::memory_order_acquire))
+	{
+		JobBase* CurrentJob = ThisPool->FindJob(ThisWorker);
+
+		if (CurrentJob)
 		{
-			pthread_mutex_lock(&ThisPool->_IdleThreads_mutex);
-			++ThisPool->_IdleThreads;
-			pthread_cond_wait(&ThisPool->_JobSignaller, &ThisPool->_IdleThreads_mutex);
-			--ThisPool->_IdleThreads;
-			pthread_mutex_unlock(&ThisPool->_IdleThreads_mutex);
+			ThisPool->RunJob(ThisWorker, CurrentJob);
+			continue;
 		}
-		else
+
+		pthread_mutex_lock(&ThisPool->_IdleThreads_mutex);
+		// Check again for work once counted as idle, the seq_cst add pairs with the seq_cst read in SignalIdleThread
+		ThisPool->_IdleThreads.fetch_add(1, std::memory_order_seq_cst);
+
+		if (!ThisPool->HasQueuedJobs() && !ThisPool->_EndWork.load(std::memory_order_acquire))
 		{
-			CurrentJob->DoJob();
-			CurrentJob->_Complete = true;
-			pthread_mutex_lock(&ThisPool->_NumJobsCompleted_mutex);
-			++ThisPool->_NumJobsCompleted;
-			pthread_mutex_unlock(&ThisPool->_NumJobsCompleted_mutex);
-			ThisPool->_WorkStarted = true;
+			CountOwn(ThisWorker->_Stats._Sleeps);
+			pthread_cond_wait(&ThisPool->_JobSignaller, &ThisPool->_IdleThreads_mutex);
 		}
+		ThisPool->_IdleThreads.fetch_sub(1);
+		pthread_mutex_unlock(&ThisPool->_IdleThreads_mutex);
 	}
+
+	CurrentWorker = nullptr;
 	return nullptr;
-}
\ No newline at end of file
+}
@@ -1,7 +1,68 @@
 #pragma once
 #include "pthread.h"
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
 #include <queue>
+#include <type_traits>
+#include <utility>
 #include <vector>
+#include "ThreadAffinity.h"
+
+// Size of a cache line, data written by different threads is kept this far apart so
+// one thread's writes don't keep taking the line away from the others
+static const size_t CacheLineSize = 64;
+
+// Counting latch used to wait on a group of jobs, each added job counts up and
+// each completed job counts down, waiting threads sleep until the count reaches zero.
+// Every job of the group writes the count, so a latch never shares a line with anything else
+class alignas(CacheLineSize) JobLatch
+{
+public:
+	JobLatch();
+
+	~JobLatch();
+
+	JobLatch(const JobLatch&) = delete;
+	JobLatch& operator=(const JobLatch&) = delete;
+
+	// Add outstanding jobs to the latch
+	void Add(long long Count = 1);
+
+	// Mark one job as completed, wakes waiting threads when it was the last one
+	void CountDown(long long Count = 1);
+
+	// Blocks the calling thread until there are no outstanding jobs, once it returns the latch can be destroyed
+	void Wait();
+
+	// Returns true if there are no outstanding jobs, the last job may still be counting down so
+	// call Wait before destroying the latch
+	bool IsDone() const;
+
+private:
+	std::atomic<long long> _Count;
+	pthread_mutex_t _Count_mutex;
+	pthread_cond_t _CountReachedZero;
+};
+
+struct JobBase;
+
+// Completed jobs waiting to be handed out again. Any thread can return a job without locking, and
+// threads take every returned job at once, so no job can be taken by two threads.
+// Each list has a line of its own as every completed job is pushed onto one
+struct alignas(CacheLineSize) JobFreeList
+{
+	// Pushes a job onto the list
+	void Return(JobBase* Job);
+
+	// Empties the list, returning the jobs linked through _NextFreeJob
+	JobBase* TakeAll();
+
+	std::atomic<JobBase*> _ReturnedJobs{ nullptr };
+};
 
 // Job structure used to pass work to the ThreadPool
 struct JobBase
@@ -9,8 +70,20 @@ struct JobBase
 	// Run the function this job points to
 	virtual void DoJob() = 0;
 
-	// Flag to check if the Job has been completed
-	bool _Complete = false;
+	// Called instead of DoJob when the pool drops the job without running it, releases anything the job holds
+	virtual void DiscardJob() {}
+
+	// Flag to check if the Job has been completed, set by the thread that ran it
+	std::atomic<bool> _Complete{ false };
+
+	// Optional latch counted down when this job completes
+	JobLatch* _Latch = nullptr;
+
+	// List a job from the job pool goes back to once completed, jobs made elsewhere have none
+	JobFreeList* _FreeList = nullptr;
+
+	// Next job while this one is on a free list
+	JobBase* _NextFreeJob = nullptr;
 };
 
 struct JobOneParam : public JobBase
@@ -49,6 +122,29 @@ struct JobThreeParams : public JobBase
 	void* _Param3;
 };
 
+// Job holding a callable in place, so submitting a lambda doesn't allocate. Callables larger than
+// _StorageSize bytes don't fit and fail to compile
+struct JobInline : public JobBase
+{
+	void DoJob() override
+	{
+		_Run(_Storage);
+	}
+
+	void DiscardJob() override
+	{
+		_Destroy(_Storage);
+	}
+
+	static const size_t _StorageSize = 64;
+
+	// Calls the stored callable and destroys it
+	void(*_Run)(void*);
+
+	// Destroys the stored callable without calling it
+	void(*_Destroy)(void*);
+	alignas(std::max_align_t) unsigned char _Storage[_StorageSize];
+};
 
 class ThreadPool;
 
@@ -58,14 +154,14 @@ class JobPool
 {
 	friend class ThreadPool;
 public:
-	// Default constructor, Jobs will be allocated at a page size of 8
+	// Default constructor, Jobs will be allocated at a page size of 64
 	JobPool()
-		:_JobPages_OneParam(), _JobPages_TwoParams(), _JobPages_ThreeParams(), _PageSize(8)
+		:_JobPages_OneParam(), _JobPages_TwoParams(), _JobPages_ThreeParams(), _JobPages_Inline(), _PageSize(64)
 	{}
 
 	// Constructor to specify a custom Job page size
 	JobPool(unsigned PageSize)
-		:_JobPages_OneParam(), _JobPages_TwoParams(), _JobPages_ThreeParams(), _PageSize(PageSize)
+		:_JobPages_OneParam(), _JobPages_TwoParams(), _JobPages_ThreeParams(), _JobPages_Inline(), _PageSize(PageSize)
 	{}
 
 	// Deconstructor will free all allocated memory for Jobs
@@ -73,27 +169,32 @@ public:
 	{
 		for (unsigned i = 0; i < _JobPages_OneParam.size(); ++i)
 		{
-			delete _JobPages_OneParam[i];
+			delete[] _JobPages_OneParam[i];
 		}
 		for (unsigned i = 0; i < _JobPages_TwoParams.size(); ++i)
 		{
-			delete _JobPages_TwoParams[i];
+			delete[] _JobPages_TwoParams[i];
 		}
 		for (unsigned i = 0; i < _JobPages_ThreeParams.size(); ++i)
 		{
-			delete _JobPages_ThreeParams[i];
+			delete[] _JobPages_ThreeParams[i];
+		}
+		for (unsigned i = 0; i < _JobPages_Inline.size(); ++i)
+		{
+			delete[] _JobPages_Inline[i];
 		}
 	}
 
-protected:
-	// Returns a one parameter job that's free
-	JobOneParam* GetFreeJob_OneParam();
-	// Returns a two parameter job that's free
-	JobTwoParams* GetFreeJob_TwoParams();
-	// Returns a three parameter job that's free
-	JobThreeParams* GetFreeJob_ThreeParams();
-
 private:
+	// Index of each job type's free list
+	static const unsigned _OneParamJobs = 0;
+	static const unsigned _TwoParamsJobs = 1;
+	static const unsigned _ThreeParamsJobs = 2;
+	static const unsigned _InlineJobs = 3;
+	static const unsigned _JobTypeCount = 4;
+
+	// Completed jobs of each type returned by any thread
+	JobFreeList _FreeLists[_JobTypeCount];
 
 	// Allocated Pages of Job memory
 
@@ -103,10 +204,69 @@ private:
 
 	std::vector<JobThreeParams*> _JobPages_ThreeParams;
 
+	std::vector<JobInline*> _JobPages_Inline;
+
 	// The size of a Job page for memory allocation
 	const unsigned _PageSize;
 };
 
+// Chase-Lev work stealing deque of jobs, the owning thread pushes and pops at the bottom
+// without locking while any other thread can steal from the top
+class JobDeque
+{
+public:
+	JobDeque(unsigned InitialCapacity = 256);
+
+	~JobDeque();
+
+	// Only the owning thread may push and pop
+	void Push(JobBase* NewJob);
+	JobBase* Pop();
+
+	// Takes the oldest job, returns nullptr if empty or another thread won the race for it
+	JobBase* Steal();
+
+	bool IsEmpty() const;
+
+private:
+	// Ring buffer of jobs, replaced by a larger one when full
+	struct JobBuffer
+	{
+		JobBuffer(int64_t Capacity);
+
+		JobBase* Get(int64_t Index) const { return _Jobs[Index & _Mask].load(std::memory_order_relaxed); }
+		void Put(int64_t Index, JobBase* Job) { _Jobs[Index & _Mask].store(Job, std::memory_order_relaxed); }
+
+		int64_t _Mask;
+		std::unique_ptr<std::atomic<JobBase*>[]> _Jobs;
+	};
+
+	JobBuffer* Grow(JobBuffer* OldBuffer, int64_t Top, int64_t Bottom);
+
+	// Stealing threads write the top and the owner writes the bottom, so they sit on separate lines
+	alignas(CacheLineSize) std::atomic<int64_t> _Top;
+	alignas(CacheLineSize) std::atomic<int64_t> _Bottom;
+	std::atomic<JobBuffer*> _Buffer;
+
+	// Replaced buffers may still be read by stealing threads, so they are kept until destruction
+	std::vector<JobBuffer*> _RetiredBuffers;
+};
+
+// Counts of what a pool's threads have done, summed over every thread when read
+struct ThreadPoolStats
+{
+	// Jobs added to the pool, and run or dropped without running
+	long long _JobsAdded = 0;
+	long long _JobsCompleted = 0;
+	long long _JobsDropped = 0;
+
+	// Jobs taken from another thread's deque
+	long long _JobsStolen = 0;
+
+	// Times a thread went to sleep waiting for work
+	long long _Sleeps = 0;
+};
+
 // Thread Pool which can be used to startup multiple threads and feed them jobs to do
 class ThreadPool
 {
@@ -116,19 +276,42 @@ public:
 	// Create a threadpool that will manage the given number of Threads
 	ThreadPool(unsigned ThreadCount);
 
-	// Initialises pthread objects and starts up threads
+	// Initialises pthread objects and starts up threads, if any thread fails to start
+	// the ones that did are stopped again and false is returned
 	bool Initialise();
 
-	// Pass a Job to the threadpool to be completed by threads
-	void AddWork(JobBase* NewJob);
+	// Where threads are placed by the next Initialise, worker i is started in slot i + 1
+	// of the policy so slot 0 is left for the thread adding the work
+	void SetAffinity(const ThreadAffinity& Affinity);
+
+	// Pass a Job to the threadpool to be completed by threads, jobs added from
+	// inside a job go to the calling thread's own deque.
+	// If a latch is given it's counted up now and down once the job is completed
+	void AddWork(JobBase* NewJob, JobLatch* Latch = nullptr);
+
+	// Runs a callable on the pool, stored in a pooled job so nothing is allocated.
+	// If a latch is given it's counted up now and down once the callable has run
+	template<class Func>
+	void Submit(Func&& Callable, JobLatch* Latch = nullptr);
+
+	// Splits [Begin, End) into chunks of Grain and calls Callable(ChunkBegin, ChunkEnd) for each on the pool,
+	// returning once every chunk has run. The calling thread runs the first chunk and helps with the rest
+	template<class Func>
+	void ParallelFor(size_t Begin, size_t End, size_t Grain, Func&& Callable);
+
+	// Blocks until the latch reaches zero, running queued jobs on the calling thread meanwhile. Safe to call
+	// from inside a job, where sleeping could leave the jobs being waited on with no thread to run them
+	void WaitForLatch(JobLatch& Latch);
 
 	// Returns true if all Threads are Idle
 	bool AreAllThreadsIdle();
 
-	// Waits for all Threads to become idle and all jobs to be completed
-	void WaitForAllThreads(bool WaitForWorkStart = true);
+	// Blocks until every job added to the pool has been completed
+	void WaitForAllThreads();
 
-	// Returns true if threads were successfully killed
+	// Wakes every thread to exit and joins them, returns true if every thread was joined. Stopping safely
+	// waits for jobs already on a thread's deque to finish, otherwise threads exit after their current job.
+	// Jobs that never ran are dropped, counting down their latches so nothing waits on them forever
 	bool StopThreads(bool Safely = true);
 
 	// Get a free
@@ -139,42 +322,171 @@ public:
 	// Gets the number of Jobs completed by threads since initialisation
 	long long GetNumJobsCompleted() const;
 
+	// Sums the counts of every pool thread and of the threads outside the pool
+	ThreadPoolStats GetStats() const;
+
 	// Gets the current number of Idle threads
 	unsigned GetNumIdleThreads() const;
 
+	// Gets the number of threads managed by the pool
+	unsigned GetThreadCount() const;
+
+	// Index of the pool thread calling this, or -1 when called from a thread outside of this pool
+	int GetCurrentThreadIndex() const;
+
 private:
 
+	// Counts kept by one thread. A pool thread is the only one writing its counts, so counting is a plain
+	// store to a line no other thread writes, and readers sum every thread's counts
+	struct alignas(CacheLineSize) WorkerStats
+	{
+		std::atomic<long long> _JobsAdded{ 0 };
+		std::atomic<long long> _JobsCompleted{ 0 };
+		std::atomic<long long> _JobsStolen{ 0 };
+		std::atomic<long long> _Sleeps{ 0 };
+	};
+
+	// Per thread data, each thread owns a deque that other threads steal from.
+	// Workers start on their own line so neighbouring workers never share one
+	struct alignas(CacheLineSize) Worker
+	{
+		ThreadPool* _Pool;
+		unsigned _Index;
+
+		// Free jobs of each type only this thread hands out
+		JobBase* _FreeJobs[JobPool::_JobTypeCount] = {};
+
+		JobDeque _Deque;
+		WorkerStats _Stats;
+	};
+
+	// Adds one to a count only the calling thread writes, without a locked instruction
+	static void CountOwn(std::atomic<long long>& Count, std::memory_order Order = std::memory_order_release);
+
+	// Jobs added but not yet run or dropped, never less than the real number. Completions are read
+	// before additions, and a job is always counted as added before it can be completed
+	long long GetOutstandingJobCount() const;
+
+	// Blocks until every job added to the pool has been run or dropped
+	void WaitForOutstandingJobs();
+
+	// Wakes threads waiting on every job to finish, called after a job has been counted as run or dropped
+	void SignalJobFinished();
+
+	// Hands out a free job, from the calling thread's own free jobs if it's a pool thread. When those run
+	// out every returned job is taken, and a new page is only allocated when there are none of them either
+	template<class JobType>
+	JobType* GetFreeJob(std::vector<JobType*>& JobPages, unsigned JobTypeIndex);
+
 	// Static function for Threads to run
 	static void* DoWork(void* arg);
 
+	// Finds a job for a worker from its own deque, the shared queue or another worker.
+	// Threads outside of the pool pass nullptr and only take from the shared queue and the workers
+	JobBase* FindJob(Worker* ThisWorker);
+
+	// Runs a job and returns it to its free list, counting down its latch and the outstanding jobs
+	void RunJob(Worker* ThisWorker, JobBase* Job);
+
+	// Drops a job that will never run, releasing what it holds and counting it down as if it had run
+	void DropJob(JobBase* Job);
+
+	// Drops every job in the shared queue
+	void FlushJobQueue();
+
+	JobInline* GetFreeJob_Inline();
+
+	// Returns true if any job is waiting in the shared queue or a worker's deque
+	bool HasQueuedJobs();
+
+	// Wakes a sleeping thread if there are any
+	void SignalIdleThread();
+
 	// Counter and mutex to track number of Threads not doing work
-	unsigned _IdleThreads;
+	alignas(CacheLineSize) std::atomic<unsigned> _IdleThreads;
 	pthread_mutex_t _IdleThreads_mutex;
 
 
-	// Job Queue and accompanying pthread objects to
-	//  facilitate providing work to threads
-	std::queue<JobBase*> _JobQueue;
+	// Job Queue for jobs added from outside of the pool and accompanying
+	// pthread objects to facilitate providing work to threads
+	alignas(CacheLineSize) std::queue<JobBase*> _JobQueue;
+	std::atomic<size_t> _JobQueueSize;
 	pthread_mutex_t _JobQueue_mutex;
 	pthread_cond_t _JobSignaller;
 
+	// One worker per thread
+	std::unique_ptr<Worker[]> _Workers;
+
 	// Number of threads managed by the pool
 	const unsigned _ThreadCount;
 
 	// Vector of pthread handles
 	std::vector<pthread_t> _Threads;
 
-	// Bool to signal threads to exit
-	bool _EndWork;
+	// Placement of the threads started by Initialise
+	ThreadAffinity _Affinity;
+
+	// Bool to signal threads to exit, set under the idle threads mutex so a thread can't miss it before sleeping.
+	// Every thread reads it between jobs, so it has a line nothing else writes
+	alignas(CacheLineSize) std::atomic<bool> _EndWork;
+
+	// Counts of threads outside of the pool, any number of them can add and help run jobs
+	// so they count with atomic adds. Dropped jobs are counted here whichever thread drops them
+	WorkerStats _ExternalStats;
+	alignas(CacheLineSize) std::atomic<long long> _JobsDropped;
+
+	// Threads sleeping until every job has finished, only signalled while there are any
+	alignas(CacheLineSize) std::atomic<unsigned> _AllJobsWaiters;
+	pthread_mutex_t _AllJobsDone_mutex;
+	pthread_cond_t _AllJobsDone;
 
-	// Job Pool and mutex for allocating Jobs
+	// Job Pool and mutex for allocating Jobs, the mutex also guards the free jobs of threads outside the pool
 	JobPool _JobPool;
-	pthread_mutex_t _JobPool_mutex;
+	alignas(CacheLineSize) pthread_mutex_t _JobPool_mutex;
+	JobBase* _ExternalFreeJobs[JobPool::_JobTypeCount] = {};
+};
+
+template<class Func>
+void ThreadPool::Submit(Func&& Callable, JobLatch* Latch)
+{
+	typedef typename std::decay<Func>::type CallableType;
+	static_assert(sizeof(CallableType) <= JobInline::_StorageSize, "Callable is too large to store in a job");
+	static_assert(alignof(CallableType) <= alignof(std::max_align_t), "Callable is too strictly aligned to store in a job");
+
+	JobInline* NewJob = GetFreeJob_Inline();
+	new (NewJob->_Storage) CallableType(std::forward<Func>(Callable));
+	NewJob->_Run = [](void* Storage)
+	{
+		CallableType* StoredCallable = static_cast<CallableType*>(Storage);
+		(*StoredCallable)();
+		StoredCallable->~CallableType();
+	};
+	NewJob->_Destroy = [](void* Storage)
+	{
+		static_cast<CallableType*>(Storage)->~CallableType();
+	};
+	AddWork(NewJob, Latch);
+}
 
-	// For debugging
-	pthread_mutex_t _NumJobsCompleted_mutex;
-	long long _NumJobsCompleted;
+template<class Func>
+void ThreadPool::ParallelFor(size_t Begin, size_t End, size_t Grain, Func&& Callable)
+{
+	if (End <= Begin)
+	{
+		return;
+	}
+	Grain = std::max<size_t>(Grain, 1);
+
+	// Every chunk after the first goes to the pool, they only hold a pointer to the callable
+	JobLatch ChunkLatch;
+	const size_t FirstEnd = Begin + std::min(Grain, End - Begin);
+	for (size_t ChunkBegin = FirstEnd; ChunkBegin < End;)
+	{
+		const size_t ChunkEnd = ChunkBegin + std::min(Grain, End - ChunkBegin);
+		Submit([&Callable, ChunkBegin, ChunkEnd]() { Callable(ChunkBegin, ChunkEnd); }, &ChunkLatch);
+		ChunkBegin = ChunkEnd;
+	}
 
-	// A flag to signal that work has been completed since the last time the threapool was waited on
-	bool _WorkStarted = false;
-};
\ No newline at end of file
+	Callable(Begin, FirstEnd);
+	WaitForLatch(ChunkLatch);
+}
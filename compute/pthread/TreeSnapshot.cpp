@@ -0,0 +1,606 @@
+#include "TreeSnapshot.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+
+// Rounds a file offset up to the start of the next section
+static inline uint64_t AlignSection(uint64_t Offset)
+{
+	return (Offset + SnapshotSectionAlignment - 1) & ~(SnapshotSectionAlignment - 1);
+}
+
+// Quads of the tree being laid out in breadth first order, kept between snapshots so they don't allocate
+static thread_local std::vector<const Quad*> SnapshotQuadOrder;
+
+void BuildTreeSnapshot(const QuadTree& Tree, uint64_t Frame, std::vector<char>& Out)
+{
+	// Breadth first order puts the 4 children of every quad next to each other, like the quad pool does
+	std::vector<const Quad*>& QuadOrder = SnapshotQuadOrder;
+	QuadOrder.assign(1, &Tree._TopQuad);
+	for (size_t i = 0; i < QuadOrder.size(); ++i)
+	{
+		const Quad* CurrentQuad = QuadOrder[i];
+		if (CurrentQuad->_ChildQuads)
+		{
+			for (unsigned c = 0; c < 4; ++c)
+			{
+				QuadOrder.push_back(CurrentQuad->_ChildQuads + c);
+			}
+		}
+	}
+
+	const uint32_t NodeCount = static_cast<uint32_t>(QuadOrder.size());
+	const uint32_t IndexCount = Tree._TopQuad._ObjectCount;
+	const uint32_t ParticleCount = static_cast<uint32_t>(Tree._ParticleContainer->_MaxParticles);
+
+	SnapshotHeader Header;
+	memset(&Header, 0, sizeof(Header));
+	memcpy(Header._Magic, SnapshotMagic, sizeof(Header._Magic));
+	Header._Version = SnapshotVersion;
+	Header._ByteOrder = SnapshotByteOrder;
+	Header._Frame = Frame;
+	Header._l = Tree._l;
+	Header._t = Tree._t;
+	Header._r = Tree._r;
+	Header._b = Tree._b;
+	Header._ParticleDiameter = Tree._ParticleContainer->_ParticleDiameter;
+	Header._Capacity = static_cast<uint32_t>(Tree._Capacity);
+	Header._NodeCount = NodeCount;
+	Header._IndexCount = IndexCount;
+	Header._ParticleCount = ParticleCount;
+	Header._NodeOffset = AlignSection(sizeof(SnapshotHeader));
+	Header._IndexOffset = AlignSection(Header._NodeOffset + static_cast<uint64_t>(NodeCount) * sizeof(SnapshotNode));
+	Header._PosXOffset = AlignSection(Header._IndexOffset + static_cast<uint64_t>(IndexCount) * sizeof(uint32_t));
+	Header._PosYOffset = AlignSection(Header._PosXOffset + static_cast<uint64_t>(ParticleCount) * sizeof(float));
+	Header._FileSize = Header._PosYOffset + static_cast<uint64_t>(ParticleCount) * sizeof(float);
+
+	Out.resize(static_cast<size_t>(Header._FileSize));
+	char* Data = Out.data();
+
+	// Gaps between sections are zeroed so the same tree always gives the same bytes
+	memset(Data, 0, static_cast<size_t>(Header._IndexOffset));
+	memset(Data + Header._IndexOffset + static_cast<uint64_t>(IndexCount) * sizeof(uint32_t), 0,
+		static_cast<size_t>(Header._PosXOffset - Header._IndexOffset - static_cast<uint64_t>(IndexCount) * sizeof(uint32_t)));
+	memset(Data + Header._PosXOffset + static_cast<uint64_t>(ParticleCount) * sizeof(float), 0,
+		static_cast<size_t>(Header._PosYOffset - Header._PosXOffset - static_cast<uint64_t>(ParticleCount) * sizeof(float)));
+	memcpy(Data, &Header, sizeof(Header));
+
+	// Children are numbered in the order they were pushed, so each parent's are the next 4 after the last parent's
+	SnapshotNode* Nodes = reinterpret_cast<SnapshotNode*>(Data + Header._NodeOffset);
+	uint32_t NextChild = 1;
+	for (uint32_t i = 0; i < NodeCount; ++i)
+	{
+		const Quad* CurrentQuad = QuadOrder[i];
+		SnapshotNode& Node = *(Nodes + i);
+		Node._FirstChild = 0;
+		if (CurrentQuad->_ChildQuads)
+		{
+			Node._FirstChild = NextChild;
+			NextChild += 4;
+		}
+		Node._FirstObject = CurrentQuad->_FirstObject;
+		Node._ObjectCount = CurrentQuad->_ObjectCount;
+		Node._X = CurrentQuad->_X;
+		Node._Y = CurrentQuad->_Y;
+		Node._Depth = CurrentQuad->_Depth;
+	}
+
+	memcpy(Data + Header._IndexOffset, Tree.GetObjectIndices(&Tree._TopQuad), static_cast<size_t>(IndexCount) * sizeof(uint32_t));
+	memcpy(Data + Header._PosXOffset, Tree._ParticleContainer->_PosX, static_cast<size_t>(ParticleCount) * sizeof(float));
+	memcpy(Data + Header._PosYOffset, Tree._ParticleContainer->_PosY, static_cast<size_t>(ParticleCount) * sizeof(float));
+}
+
+bool WriteSnapshotFile(const std::vector<char>& Snapshot, const std::string& Path)
+{
+	const std::string TempPath = Path + ".tmp";
+	FILE* File = fopen(TempPath.c_str(), "wb");
+	if (!File)
+	{
+		return false;
+	}
+
+	const bool Written = fwrite(Snapshot.data(), 1, Snapshot.size(), File) == Snapshot.size();
+	if (fclose(File) != 0 || !Written)
+	{
+		remove(TempPath.c_str());
+		return false;
+	}
+
+#ifdef _WIN32
+	// Renaming doesn't replace an existing file on Windows
+	remove(Path.c_str());
+#endif
+	if (rename(TempPath.c_str(), Path.c_str()) != 0)
+	{
+		remove(TempPath.c_str());
+		return false;
+	}
+	return true;
+}
+
+bool WriteTreeSnapshot(const QuadTree& Tree, uint64_t Frame, const std::string& Path)
+{
+	std::vector<char> Snapshot;
+	BuildTreeSnapshot(Tree, Frame, Snapshot);
+	return WriteSnapshotFile(Snapshot, Path);
+}
+
+SnapshotWriter::SnapshotWriter()
+	:_Buffers(), _Thread()
+{
+	pthread_mutex_init(&_Buffers_mutex, NULL);
+	pthread_cond_init(&_BuffersChanged, NULL);
+}
+
+SnapshotWriter::~SnapshotWriter()
+{
+	Flush();
+
+	if (_ThreadRunning)
+	{
+		pthread_mutex_lock(&_Buffers_mutex);
+		_Stopping = true;
+		pthread_cond_broadcast(&_BuffersChanged);
+		pthread_mutex_unlock(&_Buffers_mutex);
+
+		pthread_join(_Thread, NULL);
+	}
+
+	pthread_mutex_destroy(&_Buffers_mutex);
+	pthread_cond_destroy(&_BuffersChanged);
+}
+
+void SnapshotWriter::Capture(const QuadTree& Tree, uint64_t Frame, const std::string& Path)
+{
+	pthread_mutex_lock(&_Buffers_mutex);
+	if (!_ThreadRunning)
+	{
+		_ThreadRunning = pthread_create(&_Thread, NULL, &WriteWorker, this) == 0;
+	}
+
+	// Wait for the writer thread to be done with the buffer from two captures ago
+	SnapshotBuffer& Buffer = _Buffers[_NextCapture];
+	while (Buffer._Queued)
+	{
+		pthread_cond_wait(&_BuffersChanged, &_Buffers_mutex);
+	}
+	const bool WriteOnThread = _ThreadRunning;
+	pthread_mutex_unlock(&_Buffers_mutex);
+
+	// The writer thread only touches queued buffers, so this one is laid out without holding the lock
+	BuildTreeSnapshot(Tree, Frame, Buffer._Data);
+	Buffer._Path = Path;
+
+	if (!WriteOnThread)
+	{
+		const bool Written = WriteSnapshotFile(Buffer._Data, Buffer._Path);
+		pthread_mutex_lock(&_Buffers_mutex);
+		++(Written ? _WrittenCount : _FailedWriteCount);
+		pthread_mutex_unlock(&_Buffers_mutex);
+		return;
+	}
+
+	pthread_mutex_lock(&_Buffers_mutex);
+	Buffer._Queued = true;
+	_NextCapture = (_NextCapture + 1) % _BufferCount;
+	pthread_cond_broadcast(&_BuffersChanged);
+	pthread_mutex_unlock(&_Buffers_mutex);
+}
+
+void SnapshotWriter::Flush()
+{
+	pthread_mutex_lock(&_Buffers_mutex);
+	for (unsigned i = 0; i < _BufferCount; ++i)
+	{
+		while (_Buffers[i]._Queued)
+		{
+			pthread_cond_wait(&_BuffersChanged, &_Buffers_mutex);
+		}
+	}
+	pthread_mutex_unlock(&_Buffers_mutex);
+}
+
+size_t SnapshotWriter::GetWrittenCount() const
+{
+	pthread_mutex_lock(&_Buffers_mutex);
+	const size_t WrittenCount = _WrittenCount;
+	pthread_mutex_unlock(&_Buffers_mutex);
+	return WrittenCount;
+}
+
+size_t SnapshotWriter::GetFailedWriteCount() const
+{
+	pthread_mutex_lock(&_Buffers_mutex);
+	const size_t FailedWriteCount = _FailedWriteCount;
+	pthread_mutex_unlock(&_Buffers_mutex);
+	return FailedWriteCount;
+}
+
+void* SnapshotWriter::WriteWorker(void* inData)
+{
+	SnapshotWriter* ThisWriter = (SnapshotWriter*)inData;
+
+	pthread_mutex_lock(&ThisWriter->_Buffers_mutex);
+	for (;;)
+	{
+		// Buffers are queued in turn, so when the next one isn't queued none of them are
+		SnapshotBuffer& Buffer = ThisWriter->_Buffers[ThisWriter->_NextWrite];
+		while (!Buffer._Queued && !ThisWriter->_Stopping)
+		{
+			pthread_cond_wait(&ThisWriter->_BuffersChanged, &ThisWriter->_Buffers_mutex);
+		}
+		if (!Buffer._Queued)
+		{
+			break;
+		}
+		pthread_mutex_unlock(&ThisWriter->_Buffers_mutex);
+
+		const bool Written = WriteSnapshotFile(Buffer._Data, Buffer._Path);
+
+		pthread_mutex_lock(&ThisWriter->_Buffers_mutex);
+		++(Written ? ThisWriter->_WrittenCount : ThisWriter->_FailedWriteCount);
+		Buffer._Queued = false;
+		ThisWriter->_NextWrite = (ThisWriter->_NextWrite + 1) % _BufferCount;
+		pthread_cond_broadcast(&ThisWriter->_BuffersChanged);
+	}
+	pthread_mutex_unlock(&ThisWriter->_Buffers_mutex);
+	return nullptr;
+}
+
+SnapshotView::SnapshotView()
+	:_ReadData(), _Geometry(nullptr, nullptr, 0, 0.f, 0.f, 1.f, 1.f)
+{}
+
+SnapshotView::~SnapshotView()
+{
+	Close();
+}
+
+bool SnapshotView::Open(const std::string& Path)
+{
+	Close();
+
+#ifdef _WIN32
+	FILE* File = fopen(Path.c_str(), "rb");
+	if (!File)
+	{
+		return false;
+	}
+	fseek(File, 0, SEEK_END);
+	const long FileSize = ftell(File);
+	fseek(File, 0, SEEK_SET);
+	if (FileSize <= 0)
+	{
+		fclose(File);
+		return false;
+	}
+	_ReadData.resize(static_cast<size_t>(FileSize));
+	const bool Read = fread(_ReadData.data(), 1, _ReadData.size(), File) == _ReadData.size();
+	fclose(File);
+	if (!Read)
+	{
+		_ReadData.clear();
+		return false;
+	}
+	_Data = _ReadData.data();
+	_Size = _ReadData.size();
+#else
+	const int File = open(Path.c_str(), O_RDONLY);
+	if (File < 0)
+	{
+		return false;
+	}
+	struct stat FileStatus;
+	if (fstat(File, &FileStatus) != 0 || FileStatus.st_size <= 0)
+	{
+		close(File);
+		return false;
+	}
+
+	// The mapping keeps the file open on its own
+	void* Mapping = mmap(nullptr, static_cast<size_t>(FileStatus.st_size), PROT_READ, MAP_PRIVATE, File, 0);
+	close(File);
+	if (Mapping == MAP_FAILED)
+	{
+		return false;
+	}
+	_Data = static_cast<const char*>(Mapping);
+	_Size = static_cast<size_t>(FileStatus.st_size);
+	_Mapped = true;
+#endif
+
+	if (!ReadSections())
+	{
+		Close();
+		return false;
+	}
+	return true;
+}
+
+void SnapshotView::Close()
+{
+#ifndef _WIN32
+	if (_Mapped)
+	{
+		munmap(const_cast<char*>(_Data), _Size);
+	}
+#endif
+	_ReadData.clear();
+	_ReadData.shrink_to_fit();
+	_Mapped = false;
+	_Data = nullptr;
+	_Size = 0;
+	_Header = nullptr;
+	_Nodes = nullptr;
+	_Indices = nullptr;
+	_PosX = nullptr;
+	_PosY = nullptr;
+}
+
+bool SnapshotView::IsOpen() const
+{
+	return _Header != nullptr;
+}
+
+// Checks a section of Count items of ItemSize bytes starting at Offset is inside the file and aligned
+static bool IsSectionInFile(uint64_t Offset, uint64_t Count, uint64_t ItemSize, uint64_t FileSize)
+{
+	return Offset % SnapshotSectionAlignment == 0 && Offset <= FileSize && Count * ItemSize <= FileSize - Offset;
+}
+
+bool SnapshotView::ReadSections()
+{
+	if (_Size < sizeof(SnapshotHeader))
+	{
+		return false;
+	}
+
+	const SnapshotHeader* Header = reinterpret_cast<const SnapshotHeader*>(_Data);
+	if (memcmp(Header->_Magic, SnapshotMagic, sizeof(Header->_Magic)) != 0 || Header->_Version != SnapshotVersion
+		|| Header->_ByteOrder != SnapshotByteOrder || Header->_FileSize > _Size || Header->_NodeCount == 0
+		|| !IsSectionInFile(Header->_NodeOffset, Header->_NodeCount, sizeof(SnapshotNode), Header->_FileSize)
+		|| !IsSectionInFile(Header->_IndexOffset, Header->_IndexCount, sizeof(uint32_t), Header->_FileSize)
+		|| !IsSectionInFile(Header->_PosXOffset, Header->_ParticleCount, sizeof(float), Header->_FileSize)
+		|| !IsSectionInFile(Header->_PosYOffset, Header->_ParticleCount, sizeof(float), Header->_FileSize))
+	{
+		return false;
+	}
+
+	const SnapshotNode* Nodes = reinterpret_cast<const SnapshotNode*>(_Data + Header->_NodeOffset);
+	const uint32_t* Indices = reinterpret_cast<const uint32_t*>(_Data + Header->_IndexOffset);
+
+	// The top quad holds every index
+	if (Nodes->_Depth != 0 || Nodes->_X != 0 || Nodes->_Y != 0 || Nodes->_FirstObject != 0
+		|| Nodes->_ObjectCount != Header->_IndexCount)
+	{
+		return false;
+	}
+
+	// Nodes must be laid out breadth first the same as BuildTreeSnapshot does, so every node but the top
+	// quad has exactly one parent and queries can't loop. Children must sit where their parent puts them
+	uint32_t NextChild = 1;
+	for (uint32_t i = 0; i < Header->_NodeCount; ++i)
+	{
+		const SnapshotNode& Node = *(Nodes + i);
+		if (static_cast<uint64_t>(Node._FirstObject) + Node._ObjectCount > Header->_IndexCount)
+		{
+			return false;
+		}
+		if (Node._FirstChild == 0)
+		{
+			continue;
+		}
+		if (Node._FirstChild != NextChild || Node._Depth >= QuadTree::_MaxDepth
+			|| static_cast<uint64_t>(NextChild) + 4 > Header->_NodeCount)
+		{
+			return false;
+		}
+		for (unsigned c = 0; c < 4; ++c)
+		{
+			const SnapshotNode& Child = *(Nodes + NextChild + c);
+			if (Child._Depth != Node._Depth + 1 || Child._X != Node._X * 2u + (c % 2) || Child._Y != Node._Y * 2u + (c / 2))
+			{
+				return false;
+			}
+		}
+		NextChild += 4;
+	}
+	if (NextChild != Header->_NodeCount)
+	{
+		return false;
+	}
+
+	for (uint32_t i = 0; i < Header->_IndexCount; ++i)
+	{
+		if (*(Indices + i) >= Header->_ParticleCount)
+		{
+			return false;
+		}
+	}
+
+	_Header = Header;
+	_Nodes = Nodes;
+	_Indices = Indices;
+	_PosX = reinterpret_cast<const float*>(_Data + Header->_PosXOffset);
+	_PosY = reinterpret_cast<const float*>(_Data + Header->_PosYOffset);
+	_Geometry = QuadTree(nullptr, nullptr, Header->_Capacity, Header->_l, Header->_t, Header->_r, Header->_b);
+	return true;
+}
+
+const SnapshotHeader& SnapshotView::GetHeader() const
+{
+	return *_Header;
+}
+
+const SnapshotNode* SnapshotView::GetNodes() const
+{
+	return _Nodes;
+}
+
+const uint32_t* SnapshotView::GetIndices() const
+{
+	return _Indices;
+}
+
+const float* SnapshotView::GetPosX() const
+{
+	return _PosX;
+}
+
+const float* SnapshotView::GetPosY() const
+{
+	return _PosY;
+}
+
+// Sections of an open snapshot a query reads, and the tree its node bounds are worked out with
+struct SnapshotQuery
+{
+	const SnapshotNode* _Nodes;
+	const uint32_t* _Indices;
+	const float* _PosX;
+	const float* _PosY;
+	const QuadTree* _Geometry;
+};
+
+// Quad standing in for a node, so the tree's inline side positions can be used on it
+static inline Quad GetNodeQuad(const SnapshotNode& Node)
+{
+	return { nullptr, nullptr, Node._FirstObject, Node._ObjectCount, Node._X, Node._Y, Node._Depth };
+}
+
+static QuadBounds GetTopSearchBounds()
+{
+	const float Infinity = std::numeric_limits<float>::infinity();
+	return { -Infinity, -Infinity, Infinity, Infinity };
+}
+
+static inline void AddQueryResult(uint32_t Index, uint32_t* Out, size_t OutCapacity, size_t& Found)
+{
+	if (Found < OutCapacity)
+	{
+		*(Out + Found) = Index;
+	}
+	++Found;
+}
+
+// Same search as QueryRectInQuad in QuadTree.cpp, walking nodes instead of quads
+static void QueryRectInNode(const SnapshotQuery& Query, const SnapshotNode& Node, const QuadBounds& Bounds,
+	float l, float t, float r, float b, uint32_t* Out, size_t OutCapacity, size_t& Found)
+{
+	if (Bounds._l > r || Bounds._r < l || Bounds._t > b || Bounds._b < t)
+	{
+		return;
+	}
+
+	const uint32_t* ObjectIndices = Query._Indices + Node._FirstObject;
+	if (Bounds._l >= l && Bounds._r <= r && Bounds._t >= t && Bounds._b <= b)
+	{
+		for (uint32_t i = 0; i < Node._ObjectCount; ++i)
+		{
+			AddQueryResult(*(ObjectIndices + i), Out, OutCapacity, Found);
+		}
+		return;
+	}
+
+	if (Node._FirstChild)
+	{
+		const Quad NodeQuad = GetNodeQuad(Node);
+		const float MidX = Query._Geometry->GetMidX(&NodeQuad);
+		const float MidY = Query._Geometry->GetMidY(&NodeQuad);
+		for (unsigned i = 0; i < 4; ++i)
+		{
+			QueryRectInNode(Query, *(Query._Nodes + Node._FirstChild + i), Bounds.GetChildBounds(MidX, MidY, i),
+				l, t, r, b, Out, OutCapacity, Found);
+		}
+		return;
+	}
+
+	for (uint32_t i = 0; i < Node._ObjectCount; ++i)
+	{
+		const uint32_t Index = *(ObjectIndices + i);
+		const float x = *(Query._PosX + Index);
+		const float y = *(Query._PosY + Index);
+		if (x >= l && x <= r && y >= t && y <= b)
+		{
+			AddQueryResult(Index, Out, OutCapacity, Found);
+		}
+	}
+}
+
+// Same search as QueryRadiusInQuad in QuadTree.cpp, walking nodes instead of quads
+static void QueryRadiusInNode(const SnapshotQuery& Query, const SnapshotNode& Node, const QuadBounds& Bounds,
+	float x, float y, float RadiusSquared, uint32_t* Out, size_t OutCapacity, size_t& Found)
+{
+	const float ClosestX = std::max(std::max(Bounds._l - x, x - Bounds._r), 0.f);
+	const float ClosestY = std::max(std::max(Bounds._t - y, y - Bounds._b), 0.f);
+	if (ClosestX * ClosestX + ClosestY * ClosestY > RadiusSquared)
+	{
+		return;
+	}
+
+	const uint32_t* ObjectIndices = Query._Indices + Node._FirstObject;
+	const float FurthestX = std::max(x - Bounds._l, Bounds._r - x);
+	const float FurthestY = std::max(y - Bounds._t, Bounds._b - y);
+	if (FurthestX * FurthestX + FurthestY * FurthestY <= RadiusSquared)
+	{
+		for (uint32_t i = 0; i < Node._ObjectCount; ++i)
+		{
+			AddQueryResult(*(ObjectIndices + i), Out, OutCapacity, Found);
+		}
+		return;
+	}
+
+	if (Node._FirstChild)
+	{
+		const Quad NodeQuad = GetNodeQuad(Node);
+		const float MidX = Query._Geometry->GetMidX(&NodeQuad);
+		const float MidY = Query._Geometry->GetMidY(&NodeQuad);
+		for (unsigned i = 0; i < 4; ++i)
+		{
+			QueryRadiusInNode(Query, *(Query._Nodes + Node._FirstChild + i), Bounds.GetChildBounds(MidX, MidY, i),
+				x, y, RadiusSquared, Out, OutCapacity, Found);
+		}
+		return;
+	}
+
+	for (uint32_t i = 0; i < Node._ObjectCount; ++i)
+	{
+		const uint32_t Index = *(ObjectIndices + i);
+		const float DistanceX = *(Query._PosX + Index) - x;
+		const float DistanceY = *(Query._PosY + Index) - y;
+		if (DistanceX * DistanceX + DistanceY * DistanceY <= RadiusSquared)
+		{
+			AddQueryResult(Index, Out, OutCapacity, Found);
+		}
+	}
+}
+
+size_t SnapshotView::QueryRect(float l, float t, float r, float b, uint32_t* Out, size_t OutCapacity) const
+{
+	size_t Found = 0;
+	if (IsOpen())
+	{
+		const SnapshotQuery Query = { _Nodes, _Indices, _PosX, _PosY, &_Geometry };
+		QueryRectInNode(Query, *_Nodes, GetTopSearchBounds(), l, t, r, b, Out, OutCapacity, Found);
+	}
+	return Found;
+}
+
+size_t SnapshotView::QueryRadius(float x, float y, float Radius, uint32_t* Out, size_t OutCapacity) const
+{
+	size_t Found = 0;
+	if (IsOpen() && Radius >= 0.f)
+	{
+		const SnapshotQuery Query = { _Nodes, _Indices, _PosX, _PosY, &_Geometry };
+		QueryRadiusInNode(Query, *_Nodes, GetTopSearchBounds(), x, y, Radius * Radius, Out, OutCapacity, Found);
+	}
+	return Found;
+}
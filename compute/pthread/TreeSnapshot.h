@@ -0,0 +1,196 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "QuadTree.h"
+
+#define __PTW32_STATIC_LIB
+#include "pthread.h"
+
+// Snapshots of a built quad tree and the particle positions it was built from, stored in a flat binary
+// file that can be mapped into memory and queried in place. Nothing in the file is a pointer, a file is:
+//
+//	SnapshotHeader
+//	SnapshotNode array, breadth first from the top quad so the 4 children of a quad are next to each other
+//	uint32_t index buffer, every node's particles are a range of it the same as in the tree
+//	float x positions, then float y positions, one of each for every particle of the container
+//
+// Sections start on 64 byte boundaries at the offsets in the header, counted from the start of the file.
+// Values are stored in the byte order of the machine that wrote them, readers check _ByteOrder
+
+// Written into every header, the version is bumped whenever the layout changes
+const char SnapshotMagic[8] = { 'Q', 'U', 'A', 'D', 'S', 'N', 'A', 'P' };
+const uint32_t SnapshotVersion = 1;
+const uint32_t SnapshotByteOrder = 0x01020304;
+
+// Alignment of every section of a snapshot file
+const uint64_t SnapshotSectionAlignment = 64;
+
+struct SnapshotHeader
+{
+	char _Magic[8];
+	uint32_t _Version;
+	uint32_t _ByteOrder;
+
+	// Sort the snapshot was taken after, and the size of the whole file
+	uint64_t _Frame;
+	uint64_t _FileSize;
+
+	// Sides of the top quad, node bounds are worked out from them the same way QuadTree does
+	float _l, _t, _r, _b;
+	float _ParticleDiameter;
+	uint32_t _Capacity;
+
+	uint32_t _NodeCount;
+	uint32_t _IndexCount;
+	uint32_t _ParticleCount;
+	uint32_t _Reserved;
+
+	uint64_t _NodeOffset;
+	uint64_t _IndexOffset;
+	uint64_t _PosXOffset;
+	uint64_t _PosYOffset;
+};
+
+static_assert(sizeof(SnapshotHeader) == 104, "The snapshot header layout is part of the file format");
+
+// A quad of the snapshot, the same as Quad with its pointers replaced by node indices
+struct SnapshotNode
+{
+	// Node index of the first of the 4 children, 0 for leaves since the top quad is never a child
+	uint32_t _FirstChild;
+
+	// Range of the index buffer holding the particles inside this node
+	uint32_t _FirstObject;
+	uint32_t _ObjectCount;
+
+	// Column and row in the grid of quads at the node's depth
+	uint16_t _X, _Y;
+	uint8_t _Depth;
+
+	// Always 0, keeps the node free of compiler padding so files are byte for byte repeatable
+	uint8_t _Padding[3];
+};
+
+static_assert(sizeof(SnapshotNode) == 20, "The snapshot node layout is part of the file format");
+
+// Lays out a snapshot of the tree in Out, resizing it to the file size. Out's memory is reused between
+// calls, so writing snapshots of the same size every frame doesn't allocate
+void BuildTreeSnapshot(const QuadTree& Tree, uint64_t Frame, std::vector<char>& Out);
+
+// Writes a snapshot laid out by BuildTreeSnapshot to a file, returns false if it couldn't be written.
+// The file is written under a temporary name and renamed into place, so readers never see half of one
+bool WriteSnapshotFile(const std::vector<char>& Snapshot, const std::string& Path);
+
+// Builds and writes a snapshot on the calling thread
+bool WriteTreeSnapshot(const QuadTree& Tree, uint64_t Frame, const std::string& Path);
+
+// Writes snapshots on a thread of its own. Capture lays the snapshot out on the calling thread, which
+// only takes copying the tree's nodes and particle arrays, and the disk write then overlaps whatever
+// the caller does next, such as the next sort. Two snapshot buffers are used in turn, so Capture only
+// waits when the disk has fallen two snapshots behind. Capture and Flush are called from one thread
+class SnapshotWriter
+{
+public:
+	SnapshotWriter();
+
+	// Writes every snapshot still queued before stopping the thread
+	~SnapshotWriter();
+
+	SnapshotWriter(const SnapshotWriter&) = delete;
+	SnapshotWriter& operator=(const SnapshotWriter&) = delete;
+
+	// Lays out a snapshot of the tree and queues it to be written to Path, starting the writer thread
+	// the first time. Writes it on the calling thread if the writer thread fails to start
+	void Capture(const QuadTree& Tree, uint64_t Frame, const std::string& Path);
+
+	// Waits until every queued snapshot has been written
+	void Flush();
+
+	// Number of snapshots written, and the number that couldn't be written
+	size_t GetWrittenCount() const;
+	size_t GetFailedWriteCount() const;
+
+private:
+	// Static function for the writer thread to run, writes queued snapshots in order
+	static void* WriteWorker(void* inData);
+
+	static const unsigned _BufferCount = 2;
+
+	struct SnapshotBuffer
+	{
+		std::vector<char> _Data;
+		std::string _Path;
+		bool _Queued = false;
+	};
+
+	SnapshotBuffer _Buffers[_BufferCount];
+
+	// Buffer the next capture lays out into, and the next one the writer thread writes
+	unsigned _NextCapture = 0;
+	unsigned _NextWrite = 0;
+
+	pthread_t _Thread;
+	bool _ThreadRunning = false;
+	bool _Stopping = false;
+
+	// Guards everything the writer thread shares, signalled whenever a buffer is queued or written
+	mutable pthread_mutex_t _Buffers_mutex;
+	pthread_cond_t _BuffersChanged;
+
+	size_t _WrittenCount = 0;
+	size_t _FailedWriteCount = 0;
+};
+
+// Read only view of a snapshot file. The file is mapped into memory and queried where it is, so opening
+// a snapshot costs the same however large it is and only the pages a query touches are read from disk
+class SnapshotView
+{
+public:
+	SnapshotView();
+
+	~SnapshotView();
+
+	SnapshotView(const SnapshotView&) = delete;
+	SnapshotView& operator=(const SnapshotView&) = delete;
+
+	// Maps a snapshot file, returns false if it can't be read or isn't a snapshot this version understands.
+	// Every node and index is checked to be in range, so queries are safe on any file Open accepts
+	bool Open(const std::string& Path);
+
+	void Close();
+
+	bool IsOpen() const;
+
+	const SnapshotHeader& GetHeader() const;
+	const SnapshotNode* GetNodes() const;
+	const uint32_t* GetIndices() const;
+	const float* GetPosX() const;
+	const float* GetPosY() const;
+
+	// Same as QuadTree::QueryRect on the tree the snapshot was taken of
+	size_t QueryRect(float l, float t, float r, float b, uint32_t* Out, size_t OutCapacity) const;
+
+	// Same as QuadTree::QueryRadius on the tree the snapshot was taken of
+	size_t QueryRadius(float x, float y, float Radius, uint32_t* Out, size_t OutCapacity) const;
+
+private:
+	// Checks the header of the open file and points the views at its sections, then checks every node and index
+	bool ReadSections();
+
+	const char* _Data = nullptr;
+	size_t _Size = 0;
+
+	// Files are read into memory where they can't be mapped
+	bool _Mapped = false;
+	std::vector<char> _ReadData;
+
+	const SnapshotHeader* _Header = nullptr;
+	const SnapshotNode* _Nodes = nullptr;
+	const uint32_t* _Indices = nullptr;
+	const float* _PosX = nullptr;
+	const float* _PosY = nullptr;
+
+	// Tree with the snapshot's bounds, so node bounds are worked out with the same code as sorting used
+	QuadTree _Geometry;
+};
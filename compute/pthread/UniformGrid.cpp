@@ -0,0 +1,304 @@
+#include "UniformGrid.h"
+#include <algorithm>
+#include <cmath>
+
+UniformGrid::UniformGrid(unsigned ThreadCount)
+	:_ThreadCount(ThreadCount > 0 ? ThreadCount : 1), _l(0.f), _t(0.f), _CellSize(1.f), _InvCellSize(1.f),
+	_CellCountX(1), _CellCountY(1), _CellParticles(), _CellStarts(2, 0), _ParticleCells(), _Histograms(), _CellRangeTotals(),
+	_WorkerInfos(), _Affinity(), _Workers()
+{
+}
+
+UniformGrid::~UniformGrid()
+{
+	StopWorkers();
+	if (_StepBarrierReady)
+	{
+		pthread_barrier_destroy(&_StepBarrier);
+	}
+}
+
+void UniformGrid::SetAffinity(const ThreadAffinity& Affinity)
+{
+	_Affinity = Affinity;
+	StopWorkers();
+}
+
+bool UniformGrid::StopWorkers()
+{
+	return _Workers.Stop();
+}
+
+bool UniformGrid::Build(const Particles* ParticleContainer, float CellSize, float l, float t, float r, float b)
+{
+	_ParticleContainer = ParticleContainer;
+	_l = l;
+	_t = t;
+
+	// Grow the cells if there would be too many of them
+	const float Width = r - l;
+	const float Height = b - t;
+	_CellSize = CellSize > 0.f ? CellSize : std::max(Width, Height);
+	if ((Width / _CellSize + 1.f) * (Height / _CellSize + 1.f) > static_cast<float>(_MaxCellCount))
+	{
+		_CellSize = std::sqrt(Width * Height / static_cast<float>(_MaxCellCount)) + 1.f;
+	}
+	_InvCellSize = 1.f / _CellSize;
+	_CellCountX = std::max(1u, static_cast<unsigned>(std::ceil(Width * _InvCellSize)));
+	_CellCountY = std::max(1u, static_cast<unsigned>(std::ceil(Height * _InvCellSize)));
+
+	const size_t CellCount = static_cast<size_t>(_CellCountX) * _CellCountY;
+	_CellParticles.resize(ParticleContainer->_MaxParticles);
+	_ParticleCells.resize(ParticleContainer->_MaxParticles);
+	_CellStarts.resize(CellCount + 1);
+
+	// Helper threads are started the first time they are needed and stay parked between builds
+	bool Success = true;
+	if (!_Workers._Running && _ThreadCount > 1)
+	{
+		_WorkerInfos.resize(_ThreadCount);
+		std::vector<void*> WorkerArgs(_ThreadCount - 1);
+		for (unsigned i = 1; i < _ThreadCount; ++i)
+		{
+			_WorkerInfos[i] = { this, i };
+			WorkerArgs[i - 1] = &_WorkerInfos[i];
+		}
+		Success = _Workers.Start(_Affinity, _ThreadCount - 1, &BuildWorker, WorkerArgs.data());
+	}
+
+	// The step barrier only changes when the number of threads building does
+	const unsigned WorkerCount = _Workers._Running ? _Workers._WorkerCount + 1 : 1;
+	if (!_StepBarrierReady || WorkerCount != _WorkerCount)
+	{
+		if (_StepBarrierReady)
+		{
+			pthread_barrier_destroy(&_StepBarrier);
+		}
+		pthread_barrier_init(&_StepBarrier, NULL, WorkerCount);
+		_StepBarrierReady = true;
+		_WorkerCount = WorkerCount;
+	}
+
+	// Histograms are only resized when the number of cells or threads changes, each worker clears its own
+	_Histograms.resize(static_cast<size_t>(_WorkerCount) * CellCount);
+	_CellRangeTotals.resize(_WorkerCount);
+
+	// Wake the helpers, the calling thread builds the first chunk
+	if (_Workers._Running)
+	{
+		pthread_barrier_wait(&_Workers._FrameStartBarrier);
+	}
+	BuildChunk(0);
+	if (_Workers._Running)
+	{
+		pthread_barrier_wait(&_Workers._FrameEndBarrier);
+	}
+
+	return Success;
+}
+
+unsigned UniformGrid::GetCellX(float x) const
+{
+	const float CellX = (x - _l) * _InvCellSize;
+	return CellX < 0.f ? 0u : std::min(static_cast<unsigned>(CellX), _CellCountX - 1);
+}
+
+unsigned UniformGrid::GetCellY(float y) const
+{
+	const float CellY = (y - _t) * _InvCellSize;
+	return CellY < 0.f ? 0u : std::min(static_cast<unsigned>(CellY), _CellCountY - 1);
+}
+
+void* UniformGrid::BuildWorker(void* inData)
+{
+	WorkerInfo* Info = (WorkerInfo*)inData;
+	UniformGrid* ThisGrid = Info->_Grid;
+	ParkedWorkerGroup& Workers = ThisGrid->_Workers;
+
+	Workers.WaitForStartGate();
+
+	// Stay parked until a build wakes the helpers
+	for (;;)
+	{
+		pthread_barrier_wait(&Workers._FrameStartBarrier);
+		if (Workers._Stopping)
+		{
+			break;
+		}
+
+		ThisGrid->BuildChunk(Info->_ThreadID);
+
+		pthread_barrier_wait(&Workers._FrameEndBarrier);
+	}
+	return nullptr;
+}
+
+void UniformGrid::BuildChunk(unsigned ThreadID)
+{
+	const unsigned WorkerCount = _WorkerCount;
+	const size_t ParticleCount = _ParticleCells.size();
+	const size_t Begin = ParticleCount * ThreadID / WorkerCount;
+	const size_t End = ParticleCount * (ThreadID + 1) / WorkerCount;
+
+	const size_t CellCount = static_cast<size_t>(_CellCountX) * _CellCountY;
+	uint32_t* Histograms = _Histograms.data();
+	uint32_t* Histogram = Histograms + static_cast<size_t>(ThreadID) * CellCount;
+	std::fill(Histogram, Histogram + CellCount, 0u);
+
+	// Count the particles of this chunk in each cell
+	const float* PosX = _ParticleContainer->_PosX;
+	const float* PosY = _ParticleContainer->_PosY;
+	uint32_t* ParticleCells = _ParticleCells.data();
+	for (size_t i = Begin; i < End; ++i)
+	{
+		const uint32_t Cell = GetCellY(*(PosY + i)) * _CellCountX + GetCellX(*(PosX + i));
+		ParticleCells[i] = Cell;
+		++Histogram[Cell];
+	}
+
+	pthread_barrier_wait(&_StepBarrier);
+
+	// Each worker takes a range of cells, turning every thread's count into where that thread
+	// starts inside the cell and adding up the particles in the range
+	const size_t CellBegin = CellCount * ThreadID / WorkerCount;
+	const size_t CellEnd = CellCount * (ThreadID + 1) / WorkerCount;
+	uint32_t* CellStarts = _CellStarts.data();
+	uint32_t RangeTotal = 0;
+	for (size_t c = CellBegin; c < CellEnd; ++c)
+	{
+		CellStarts[c] = RangeTotal;
+		for (unsigned w = 0; w < WorkerCount; ++w)
+		{
+			uint32_t& Count = Histograms[static_cast<size_t>(w) * CellCount + c];
+			const uint32_t WorkerCellCount = Count;
+			Count = RangeTotal;
+			RangeTotal += WorkerCellCount;
+		}
+	}
+	_CellRangeTotals[ThreadID] = RangeTotal;
+
+	pthread_barrier_wait(&_StepBarrier);
+
+	// Offset the range by every range before it
+	uint32_t RangeStart = 0;
+	for (unsigned w = 0; w < ThreadID; ++w)
+	{
+		RangeStart += _CellRangeTotals[w];
+	}
+	for (size_t c = CellBegin; c < CellEnd; ++c)
+	{
+		CellStarts[c] += RangeStart;
+		for (unsigned w = 0; w < WorkerCount; ++w)
+		{
+			Histograms[static_cast<size_t>(w) * CellCount + c] += RangeStart;
+		}
+	}
+	if (ThreadID + 1 == WorkerCount)
+	{
+		CellStarts[CellCount] = static_cast<uint32_t>(ParticleCount);
+	}
+
+	pthread_barrier_wait(&_StepBarrier);
+
+	// Scatter the chunk, particles keep their order inside each cell
+	uint32_t* CellParticles = _CellParticles.data();
+	for (size_t i = Begin; i < End; ++i)
+	{
+		CellParticles[Histogram[ParticleCells[i]]++] = static_cast<uint32_t>(i);
+	}
+}
+
+size_t UniformGrid::QueryRect(float l, float t, float r, float b, uint32_t* Out, size_t OutCapacity) const
+{
+	size_t Found = 0;
+	if (l > r || t > b || _CellParticles.empty())
+	{
+		return Found;
+	}
+
+	const float* PosX = _ParticleContainer->_PosX;
+	const float* PosY = _ParticleContainer->_PosY;
+
+	// Cells along the edges also hold the particles outside of the grid, so clamping finds them
+	const unsigned CellL = GetCellX(l), CellR = GetCellX(r);
+	const unsigned CellT = GetCellY(t), CellB = GetCellY(b);
+	for (unsigned CellY = CellT; CellY <= CellB; ++CellY)
+	{
+		// Cells of a row are next to each other, so the row's particles are one range
+		const uint32_t RowBegin = _CellStarts[static_cast<size_t>(CellY) * _CellCountX + CellL];
+		const uint32_t RowEnd = _CellStarts[static_cast<size_t>(CellY) * _CellCountX + CellR + 1];
+		for (uint32_t i = RowBegin; i < RowEnd; ++i)
+		{
+			const uint32_t Index = _CellParticles[i];
+			const float x = *(PosX + Index);
+			const float y = *(PosY + Index);
+			if (x >= l && x <= r && y >= t && y <= b)
+			{
+				if (Found < OutCapacity)
+				{
+					*(Out + Found) = Index;
+				}
+				++Found;
+			}
+		}
+	}
+	return Found;
+}
+
+size_t UniformGrid::QueryRadius(float x, float y, float Radius, uint32_t* Out, size_t OutCapacity) const
+{
+	size_t Found = 0;
+	if (Radius < 0.f || _CellParticles.empty())
+	{
+		return Found;
+	}
+
+	const float* PosX = _ParticleContainer->_PosX;
+	const float* PosY = _ParticleContainer->_PosY;
+	const float RadiusSquared = Radius * Radius;
+
+	const unsigned CellL = GetCellX(x - Radius), CellR = GetCellX(x + Radius);
+	const unsigned CellT = GetCellY(y - Radius), CellB = GetCellY(y + Radius);
+	for (unsigned CellY = CellT; CellY <= CellB; ++CellY)
+	{
+		const uint32_t RowBegin = _CellStarts[static_cast<size_t>(CellY) * _CellCountX + CellL];
+		const uint32_t RowEnd = _CellStarts[static_cast<size_t>(CellY) * _CellCountX + CellR + 1];
+		for (uint32_t i = RowBegin; i < RowEnd; ++i)
+		{
+			const uint32_t Index = _CellParticles[i];
+			const float DistanceX = *(PosX + Index) - x;
+			const float DistanceY = *(PosY + Index) - y;
+			if (DistanceX * DistanceX + DistanceY * DistanceY <= RadiusSquared)
+			{
+				if (Found < OutCapacity)
+				{
+					*(Out + Found) = Index;
+				}
+				++Found;
+			}
+		}
+	}
+	return Found;
+}
+
+unsigned UniformGrid::GetCellCountX() const
+{
+	return _CellCountX;
+}
+
+unsigned UniformGrid::GetCellCountY() const
+{
+	return _CellCountY;
+}
+
+float UniformGrid::GetCellSize() const
+{
+	return _CellSize;
+}
+
+const uint32_t* UniformGrid::GetCellParticles(unsigned CellX, unsigned CellY, uint32_t& OutCount) const
+{
+	const size_t Cell = static_cast<size_t>(CellY) * _CellCountX + CellX;
+	OutCount = _CellStarts[Cell + 1] - _CellStarts[Cell];
+	return _CellParticles.data() + _CellStarts[Cell];
+}
@@ -0,0 +1,107 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+#include "Particle.h"
+#include "ThreadAffinity.h"
+#include "ParkedWorkerGroup.h"
+
+#define __PTW32_STATIC_LIB
+#include "pthread.h"
+
+// Uniform grid of square cells over the particles, built with a parallel counting sort so the
+// particles of every cell end up next to each other in one index buffer. Cheaper to build than
+// a quad tree when particles are spread evenly
+class UniformGrid
+{
+public:
+	UniformGrid() = delete;
+
+	// Create a grid that splits building over the given number of threads
+	UniformGrid(unsigned ThreadCount);
+
+	// Stops the helper threads
+	~UniformGrid();
+
+	// Where the helper threads are placed, helper i runs in slot i of the policy. Helpers running now
+	// are stopped and start again on their new CPUs the next time Build is called
+	void SetAffinity(const ThreadAffinity& Affinity);
+
+	// Sort every particle into the cells covering the given bounds, particles outside of the bounds go
+	// into the cells along the edges. Helper threads are started by the first build and stay parked
+	// between builds, returns false if some of them failed to start
+	bool Build(const Particles* ParticleContainer, float CellSize, float l, float t, float r, float b);
+
+	// Writes the indices of particles inside the rectangle to Out, up to OutCapacity of them, and returns
+	// how many are inside, which can be more than OutCapacity
+	size_t QueryRect(float l, float t, float r, float b, uint32_t* Out, size_t OutCapacity) const;
+
+	// Same as QueryRect for particles within Radius of a point
+	size_t QueryRadius(float x, float y, float Radius, uint32_t* Out, size_t OutCapacity) const;
+
+	unsigned GetCellCountX() const;
+	unsigned GetCellCountY() const;
+	float GetCellSize() const;
+
+	// Particle indices of a cell, the cells of a row are next to each other in memory
+	const uint32_t* GetCellParticles(unsigned CellX, unsigned CellY, uint32_t& OutCount) const;
+
+	// Has the helper threads exit, returns false if any of them couldn't be joined. Build starts them again
+	bool StopWorkers();
+
+	// Upper limit on the number of cells, larger grids have their cells grown to fit
+	static const size_t _MaxCellCount = 1u << 22;
+
+private:
+	struct WorkerInfo
+	{
+		UniformGrid* _Grid;
+		unsigned _ThreadID;
+	};
+
+	// Static function for the helper threads to run, sorts a chunk of particles every time they are woken
+	static void* BuildWorker(void* inData);
+
+	// Counts and scatters one worker's chunk of particles
+	void BuildChunk(unsigned ThreadID);
+
+	// Cell column or row of a position, clamped onto the grid
+	unsigned GetCellX(float x) const;
+	unsigned GetCellY(float y) const;
+
+	const unsigned _ThreadCount;
+
+	// Grid placement, cells are _CellSize wide starting from the top left corner
+	float _l, _t;
+	float _CellSize;
+	float _InvCellSize;
+	unsigned _CellCountX, _CellCountY;
+
+	// Particle indices sorted by cell, and where each cell's particles start with one extra entry for the end
+	std::vector<uint32_t> _CellParticles;
+	std::vector<uint32_t> _CellStarts;
+
+	// Cell of every particle, worked out once while counting and reused when scattering
+	std::vector<uint32_t> _ParticleCells;
+
+	// One count per cell per thread, turned into the offsets each thread scatters to
+	std::vector<uint32_t> _Histograms;
+
+	// Number of particles in each thread's range of cells, used to find where the ranges start
+	std::vector<uint32_t> _CellRangeTotals;
+
+	std::vector<WorkerInfo> _WorkerInfos;
+	ThreadAffinity _Affinity;
+
+	// Helper threads, the calling thread builds the first chunk
+	ParkedWorkerGroup _Workers;
+
+	// Number of threads building, helpers that started plus the calling thread
+	unsigned _WorkerCount = 1;
+
+	// Barrier to keep workers on the same step of the counting sort, set up for _WorkerCount threads
+	pthread_barrier_t _StepBarrier;
+	bool _StepBarrierReady = false;
+
+	// Particles being sorted by the build in progress
+	const Particles* _ParticleContainer = nullptr;
+};